@@ -0,0 +1,481 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "render/gridio.h"
+
+//This file holds the batch modes of the viewshed binary: the grid is read once
+//and the viewsheds of a whole list of viewpoints are computed by a pool of
+//threads, one viewpoint per thread at a time. Each thread keeps its viewshed
+//and the buffers it writes from, and fills them in again for every viewpoint
+//instead of allocating new ones. The viewsheds are either written out one by
+//one or, for a cumulative viewshed, counted into a single grid.
+
+//The grid, options and files shared by every thread of a batch
+typedef struct _batch {
+
+     Grid *grid;
+     Options opts;            //options each viewshed is computed with
+
+     FILE *points;            //the viewpoints, a line each
+     long next;               //number of the next viewpoint read
+     pthread_mutex_t inLock;  //held while reading a viewpoint
+
+     char *newfile;           //file, or file name pattern, written to
+     FILE *packed;            //the packed file every record goes in, or NULL
+     long recordBytes;        //size of each record of it
+     pthread_mutex_t outLock; //held while writing a record
+
+     long done, skipped;      //viewpoints computed and viewpoints left empty
+
+     int cumulative;          //count the viewsheds instead of writing them
+     float **counts;          //each thread's count grid, in the order they
+     int counted;             //started, and how many there are
+
+} Batch;
+
+//The count grids being merged in one round of the reduction
+typedef struct _merge {
+
+     Batch *batch;
+     int step;                //grid t takes in grid t + step
+     long cells;
+
+} Merge;
+
+//Names the ascii file for viewpoint number index: newfile with its %d
+//replaced by the number, or the number added to the end of it
+static void batchName(char *name, int size, char *newfile, long index)
+{
+  char *percent = strchr(newfile, '%');
+  if (percent && percent[1] == 'd' && strchr(percent + 1, '%') == NULL)
+  {
+    snprintf(name, size, "%.*s%ld%s", (int) (percent - newfile), newfile,
+             index, percent + 2);
+  }
+  else {snprintf(name, size, "%s.%ld", newfile, index);}
+}
+
+//Reads the next viewpoint, a row and a column and optionally a weight that
+//is otherwise 1, and returns its number, or -1 once they run out. Blank lines
+//are skipped.
+static long nextViewpoint(Batch *batch, int *row, int *col, float *weight)
+{
+  long index = -1;
+  char line[256];
+  pthread_mutex_lock(&batch->inLock);
+  while (fgets(line, sizeof(line), batch->points))
+  {
+    *weight = 1;
+    int read = sscanf(line, "%d %d %f", row, col, weight);
+    if (read >= 2) {index = batch->next++; break;}
+    if (read != EOF)
+    {
+      fprintf(stderr, "viewshed: viewpoint %ld is not two numbers, "
+              "stopping\n", batch->next);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&batch->inLock);
+  return index;
+}
+
+//Adds weight to the count of every cell visible in the viewshed, a word of
+//the viewshed at a time
+static void countShed(Shed *shed, float *counts, int cols, float weight)
+{
+  for (int row = 0; row < shed->rows; row++)
+  {
+    uint64_t *words = shed->bits + (long) row * shed->wordsPerRow;
+    float *line = counts + (long) (shed->row0 + row) * cols + shed->col0;
+    for (int w = 0; w < shed->wordsPerRow; w++)
+    {
+      for (uint64_t word = words[w]; word; word &= word - 1)
+      {
+        line[w * 64 + __builtin_ctzll(word)] += weight;
+      }
+    }
+  }
+}
+
+//Each thread computes viewpoints until they run out. The viewshed is filled in
+//place each time (see shedReuse), and one covering the whole grid is kept for
+//putting viewsheds limited to a radius back to full size.
+static void *batchWorker(void *arg)
+{
+  Batch *batch = (Batch*) arg;
+  Grid grid = *batch->grid;
+  grid.view_shed = NULL;
+  Shed *full = NULL;
+  char name[4096];
+  int row, col;
+  float weight;
+  long index;
+  float *counts = NULL;
+  if (batch->cumulative)
+  {
+    counts = (float*) calloc((long) grid.rows * grid.cols, sizeof(float));
+    if (counts == NULL)
+    {
+      printf("cannot allocate count grid\n");
+      exit(1);
+    }
+    batch->counts[__sync_fetch_and_add(&batch->counted, 1)] = counts;
+  }
+  while ((index = nextViewpoint(batch, &row, &col, &weight)) >= 0)
+  {
+    //A viewpoint off the grid gets a viewshed with nothing visible
+    if (row < 0 || row >= grid.rows || col < 0 || col >= grid.cols)
+    {
+      fprintf(stderr, "viewshed: viewpoint %ld (%d %d) is off the grid\n",
+              index, row, col);
+      grid.view_shed = shedReuse(grid.view_shed, 0, 0, grid.rows, grid.cols);
+      __sync_fetch_and_add(&batch->skipped, 1);
+    }
+    else
+    {
+      createViewshed(&grid, row, col, &batch->opts);
+      __sync_fetch_and_add(&batch->done, 1);
+    }
+    if (counts)
+    {
+      countShed(grid.view_shed, counts, grid.cols, weight);
+      continue;
+    }
+
+    //The viewshed is written the size of the grid unless it is cropped
+    Grid out = grid;
+    int outRow = row, outCol = col;
+    if (batch->opts.radius > 0 && batch->opts.crop)
+    {
+      out = shedCropped(&grid);
+      outRow -= grid.view_shed->row0;
+      outCol -= grid.view_shed->col0;
+    }
+    else if (grid.view_shed->rows != grid.rows ||
+             grid.view_shed->cols != grid.cols)
+    {
+      if (full == NULL) {full = shedAlloc(grid.rows, grid.cols);}
+      shedCopyInto(grid.view_shed, full);
+      out.view_shed = full;
+    }
+
+    //Records of the packed file are all the same size, so each goes at the
+    //place its number gives it whichever order they finish in
+    if (batch->packed)
+    {
+      pthread_mutex_lock(&batch->outLock);
+      if (fseek(batch->packed, sizeof(PackedHeader) +
+                index * batch->recordBytes, SEEK_SET) != 0)
+      {
+        printf("cannot write record %ld to %s\n", index, batch->newfile);
+        exit(1);
+      }
+      packedRecord(batch->packed, out.view_shed, outRow, outCol);
+      pthread_mutex_unlock(&batch->outLock);
+    }
+    else
+    {
+      batchName(name, sizeof(name), batch->newfile, index);
+      shedIntoFile(&out, name, 1);
+    }
+  }
+  if (grid.view_shed) {shedFree(grid.view_shed);}
+  if (full) {shedFree(full);}
+  return NULL;
+}
+
+//Adds the count grids step apart together, pairs start to end of them
+static void mergeCounts(void *arg, long start, long end)
+{
+  Merge *merge = (Merge*) arg;
+  for (long pair = start; pair < end; pair++)
+  {
+    float *into = merge->batch->counts[pair * 2 * merge->step];
+    float *from = merge->batch->counts[pair * 2 * merge->step + merge->step];
+    for (long i = 0; i < merge->cells; i++) {into[i] += from[i];}
+    free(from);
+  }
+}
+
+//Blocks the grid, and works out the rays for a radius, once for every thread
+//before any of them start
+static void batchPrepare(Batch *batch, Grid *grid, Options *opts)
+{
+  if (opts->blockSize > 0 && grid->data_blocked == NULL)
+  {
+    blockGrid(grid, opts->blockSize);
+  }
+  if (opts->engine == ENGINE_R2 && opts->radius > 0 && opts->rays == NULL)
+  {
+    batch->opts.rays = rayTemplate(opts->radius);
+  }
+}
+
+//Runs the viewpoints of a batch on opts->threads threads
+static void runWorkers(Batch *batch, Grid *grid, Options *opts)
+{
+  batchPrepare(batch, grid, opts);
+
+  int threads = opts->threads;
+  pthread_t *workers = (pthread_t*) malloc(threads * sizeof(pthread_t));
+  for (int t = 1; t < threads; t++)
+  {
+    pthread_create(&workers[t], NULL, batchWorker, batch);
+  }
+  batchWorker(batch);
+  for (int t = 1; t < threads; t++) {pthread_join(workers[t], NULL);}
+  free(workers);
+
+  if (batch->opts.rays != opts->rays) {rayTemplateFree(batch->opts.rays);}
+  if (batch->points != stdin) {fclose(batch->points);}
+  pthread_mutex_destroy(&batch->inLock);
+  pthread_mutex_destroy(&batch->outLock);
+  fprintf(stderr, "viewshed: %ld viewsheds computed, %ld left empty\n",
+          batch->done, batch->skipped);
+}
+
+//Sets up a batch reading its viewpoints from the file viewpoints, or stdin
+//for "-"
+static void batchInit(Batch *batch, Grid *grid, char *viewpoints,
+                      char *newfile, Options *opts)
+{
+  batch->grid = grid;
+  batch->opts = *opts;
+  batch->opts.threads = 1;
+  batch->next = 0;
+  batch->done = 0;
+  batch->skipped = 0;
+  batch->newfile = newfile;
+  batch->packed = NULL;
+  batch->cumulative = 0;
+  batch->counts = NULL;
+  batch->counted = 0;
+  pthread_mutex_init(&batch->inLock, NULL);
+  pthread_mutex_init(&batch->outLock, NULL);
+
+  if (strcmp(viewpoints, "-") == 0) {batch->points = stdin;}
+  else {batch->points = fopen(viewpoints, "r");}
+  if (batch->points == NULL) {
+     printf("cannot open files...");
+     exit(1);
+  }
+}
+
+//Computes the viewshed of every viewpoint in the file viewpoints ("-" for
+//stdin), given as a row and a column each, with opts->threads threads each
+//working on its own viewpoint. With --format packed every viewshed is a
+//record of one packed file, in the order the viewpoints were given; otherwise
+//each is an ascii file named by batchName.
+void runBatch(Grid *grid, char *viewpoints, char *newfile, Options *opts)
+{
+  Batch batch;
+  batchInit(&batch, grid, viewpoints, newfile, opts);
+  if (opts->packed)
+  {
+    //Cropped records would each be a different size
+    if (opts->crop)
+    {
+      printf("--crop cannot be used with --format packed in a batch\n");
+      exit(1);
+    }
+    batch.packed = fopen(newfile, "wb");
+    if (batch.packed == NULL) {
+       printf("cannot open files...");
+       exit(1);
+    }
+    packedHeader(batch.packed, grid);
+    batch.recordBytes = 2 * sizeof(int) + (long) grid->rows *
+                        ((grid->cols + 7) / 8);
+  }
+
+  runWorkers(&batch, grid, opts);
+  if (batch.packed) {fclose(batch.packed);}
+}
+
+//Computes the cumulative viewshed of the viewpoints in the file viewpoints
+//("-" for stdin): how many of them see each cell, or the sum of their
+//weights when a viewpoint has a third number. Each of the opts->threads
+//threads counts the viewpoints it computed into its own grid, holding only
+//its one viewshed at a time, and the grids are then added together in pairs,
+//log2(threads) rounds of them. The counts are written as an asc grid, with
+//the cells of the terrain that have no data left as no data. That is written
+//as the terrain's nodata value unless a count comes out the same, as one can
+//when the value is 0 or more, and then as a value below every count.
+void runCumulative(Grid *grid, char *viewpoints, char *newfile, Options *opts)
+{
+  Batch batch;
+  batchInit(&batch, grid, viewpoints, newfile, opts);
+  batch.cumulative = 1;
+  batch.counts = (float**) calloc(opts->threads, sizeof(float*));
+  FILE *n = fopen(newfile, "w");
+  if (n == NULL) {
+     printf("cannot open files...");
+     exit(1);
+  }
+  runWorkers(&batch, grid, opts);
+
+  Merge merge = {&batch, 1, (long) grid->rows * grid->cols};
+  for (; merge.step < batch.counted; merge.step *= 2)
+  {
+    long pairs = (batch.counted - merge.step + 2 * merge.step - 1) /
+                 (2 * merge.step);
+    parallelFor(opts->threads, pairs, 1, mergeCounts, &merge);
+  }
+  float *counts = batch.counts[0];
+  float nodata = grid->ndvalue, lowest = 0;
+  int collides = 0;
+  for (int row = 0; row < grid->rows; row++)
+  {
+    for (int col = 0; col < grid->cols; col++)
+    {
+      float count = counts[(long) row * grid->cols + col];
+      if (getHeight(grid, row, col) == grid->ndvalue) {continue;}
+      if (count == nodata) {collides = 1;}
+      if (count < lowest) {lowest = count;}
+    }
+  }
+  if (collides)
+  {
+    nodata = lowest - 1 < -9999 ? floorf(lowest) - 1 : -9999;
+    fprintf(stderr, "viewshed: a count is the terrain's nodata value %d, so "
+            "nodata is written as %g\n", grid->ndvalue, nodata);
+  }
+  for (int row = 0; row < grid->rows; row++)
+  {
+    for (int col = 0; col < grid->cols; col++)
+    {
+      if (getHeight(grid, row, col) == grid->ndvalue)
+      {
+        counts[(long) row * grid->cols + col] = nodata;
+      }
+    }
+  }
+
+  GridioHeader header;
+  header.ncols = grid->cols;
+  header.nrows = grid->rows;
+  header.xllcorner = grid->xllcorner;
+  header.yllcorner = grid->yllcorner;
+  header.cellsize = grid->cellsize;
+  header.nodata_value = nodata;
+  gridio_write_asc(n, &header, counts, gridio_default_threads());
+  fclose(n);
+  free(counts);
+  free(batch.counts);
+}
+
+//The viewpoints of a path, and the union they are added to
+typedef struct _path {
+
+     Batch *batch;
+     int *points;             //row and column of each viewpoint in turn
+     Shed *all;               //the union of the viewsheds
+     pthread_mutex_t lock;    //held while adding to it
+
+} Path;
+
+//Adds the viewsheds of the viewpoints start to end of a path to its union.
+//Neighbouring viewpoints see mostly the same cells, so the union so far is
+//handed to the engine as the cells it need not test again, which the exact
+//and simd engines skip; R2 casts its rays in full regardless, since each ray
+//needs the heights along it. A viewpoint the same as the one before it is
+//not computed at all.
+static void pathRange(void *arg, long start, long end)
+{
+  Path *path = (Path*) arg;
+  Batch *batch = path->batch;
+  Grid grid = *batch->grid;
+  grid.view_shed = NULL;
+  Shed *seen = shedAlloc(grid.rows, grid.cols);
+  Options opts = batch->opts;
+  opts.known = seen;
+  for (long k = start; k < end; k++)
+  {
+    int row = path->points[2 * k], col = path->points[2 * k + 1];
+    if (row < 0 || row >= grid.rows || col < 0 || col >= grid.cols)
+    {
+      fprintf(stderr, "viewshed: viewpoint %ld (%d %d) is off the grid\n",
+              k, row, col);
+      __sync_fetch_and_add(&batch->skipped, 1);
+      continue;
+    }
+    if (k > start && row == path->points[2 * k - 2] &&
+        col == path->points[2 * k - 1])
+    {
+      continue;
+    }
+    createViewshed(&grid, row, col, &opts);
+    shedUnion(seen, grid.view_shed);
+    __sync_fetch_and_add(&batch->done, 1);
+  }
+  pthread_mutex_lock(&path->lock);
+  shedUnion(path->all, seen);
+  pthread_mutex_unlock(&path->lock);
+  if (grid.view_shed) {shedFree(grid.view_shed);}
+  shedFree(seen);
+}
+
+//Computes the union of the viewsheds of the viewpoints along a path, given in
+//order in the file viewpoints ("-" for stdin), and writes it the same as a
+//single viewshed. Each of the opts->threads threads takes one stretch of the
+//path and works along it, so that consecutive viewpoints share the cells
+//already found visible (see pathRange). For the viewshed of each viewpoint
+//of a path, use runBatch.
+void runPath(Grid *grid, char *viewpoints, char *newfile, Options *opts)
+{
+  //The union is of viewpoints all over the grid, so there is no one window
+  //to crop it to
+  if (opts->crop)
+  {
+    printf("--crop cannot be used with --path\n");
+    exit(1);
+  }
+  Batch batch;
+  batchInit(&batch, grid, viewpoints, newfile, opts);
+  Path path;
+  path.batch = &batch;
+  long count = 0, size = 1024;
+  path.points = (int*) malloc(2 * size * sizeof(int));
+  int row, col;
+  float weight;
+  while (nextViewpoint(&batch, &row, &col, &weight) >= 0)
+  {
+    if (count == size)
+    {
+      size *= 2;
+      path.points = (int*) realloc(path.points, 2 * size * sizeof(int));
+    }
+    path.points[2 * count] = row;
+    path.points[2 * count + 1] = col;
+    count++;
+  }
+  if (batch.points != stdin) {fclose(batch.points);}
+  if (count == 0)
+  {
+    printf("%s holds no viewpoints\n", viewpoints);
+    exit(1);
+  }
+
+  batchPrepare(&batch, grid, opts);
+  path.all = shedAlloc(grid->rows, grid->cols);
+  pthread_mutex_init(&path.lock, NULL);
+  long stretch = (count + opts->threads - 1) / opts->threads;
+  parallelFor(opts->threads, count, stretch, pathRange, &path);
+  pthread_mutex_destroy(&path.lock);
+  if (batch.opts.rays != opts->rays) {rayTemplateFree(batch.opts.rays);}
+  fprintf(stderr, "viewshed: %ld viewsheds computed along %ld viewpoints, "
+          "%ld off the grid\n", batch.done, count, batch.skipped);
+
+  Grid out = *grid;
+  out.view_shed = path.all;
+  if (opts->packed)
+  {
+    shedIntoPacked(&out, newfile, path.points[0], path.points[1]);
+  }
+  else {shedIntoFile(&out, newfile, gridio_default_threads());}
+  shedFree(path.all);
+  free(path.points);
+}
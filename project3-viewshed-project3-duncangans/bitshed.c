@@ -0,0 +1,202 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//This file holds the bit-packed viewshed: allocating it, counting it, and
+//writing it in the packed file format that unpackshed turns back into ascii.
+
+//Allocates a viewshed of the given size with every cell not visible
+Shed *shedAlloc(int rows, int cols)
+{
+  return shedWindow(0, 0, rows, cols);
+}
+
+//Allocates a viewshed that only covers the window of the grid starting at
+//row0, col0, with every cell not visible
+Shed *shedWindow(int row0, int col0, int rows, int cols)
+{
+  return shedReuse(NULL, row0, col0, rows, cols);
+}
+
+//Makes a viewshed cover the given window with every cell not visible, reusing
+//its bits when they are big enough. A NULL shed gets a new viewshed. This lets
+//the same viewshed be filled in for one viewpoint after another.
+Shed *shedReuse(Shed *shed, int row0, int col0, int rows, int cols)
+{
+  if (shed == NULL)
+  {
+    shed = (Shed*) malloc(sizeof(Shed));
+    shed->bits = NULL;
+    shed->capacity = 0;
+  }
+  shed->rows = rows;
+  shed->cols = cols;
+  shed->row0 = row0;
+  shed->col0 = col0;
+  shed->wordsPerRow = (cols + 63) / 64;
+  long words = (long) rows * shed->wordsPerRow;
+  if (words > shed->capacity)
+  {
+    free(shed->bits);
+    shed->bits = (uint64_t*) calloc(words, sizeof(uint64_t));
+    shed->capacity = words;
+    if (shed->bits == NULL)
+    {
+      printf("cannot allocate viewshed\n");
+      exit(1);
+    }
+  }
+  else {memset(shed->bits, 0, words * sizeof(uint64_t));}
+  return shed;
+}
+
+//Frees a viewshed and its bits
+void shedFree(Shed *shed)
+{
+  free(shed->bits);
+  free(shed);
+}
+
+//Returns the number of visible cells. The bits past the end of each row are
+//never set, so every word can simply be counted.
+long shedCount(Shed *shed)
+{
+  long count = 0;
+  long words = (long) shed->rows * shed->wordsPerRow;
+  for (long i = 0; i < words; i++)
+  {
+    count += __builtin_popcountll(shed->bits[i]);
+  }
+  return count;
+}
+
+//Copies the visible cells of one viewshed into another that covers its
+//window, every other cell of which is left not visible
+void shedCopyInto(Shed *from, Shed *to)
+{
+  memset(to->bits, 0, (long) to->rows * to->wordsPerRow * sizeof(uint64_t));
+  for (int row = from->row0; row < from->row0 + from->rows; row++)
+  {
+    for (int col = from->col0; col < from->col0 + from->cols; col++)
+    {
+      if (shedGet(from, row, col)) {shedSet(to, row, col);}
+    }
+  }
+}
+
+//Marks visible every cell that is visible in from, which may cover a window
+//of the viewshed into. Each word of from is shifted into the one or two words
+//of into that it lands on.
+void shedUnion(Shed *into, Shed *from)
+{
+  int shift = (from->col0 - into->col0) & 63;
+  for (int row = 0; row < from->rows; row++)
+  {
+    uint64_t *words = from->bits + (long) row * from->wordsPerRow;
+    uint64_t *to = into->bits +
+                   (long) (from->row0 + row - into->row0) * into->wordsPerRow +
+                   ((from->col0 - into->col0) >> 6);
+    for (int w = 0; w < from->wordsPerRow; w++)
+    {
+      if (words[w] == 0) {continue;}
+      to[w] |= words[w] << shift;
+      if (shift) {
+        uint64_t carry = words[w] >> (64 - shift);
+        if (carry) {to[w + 1] |= carry;}
+      }
+    }
+  }
+}
+
+//A viewshed that only covers a window is swapped for one covering the whole
+//grid, with every cell outside the window not visible
+void shedExpand(Grid *grid)
+{
+  Shed *window = grid->view_shed;
+  if (window->rows == grid->rows && window->cols == grid->cols) {return;}
+  Shed *full = shedAlloc(grid->rows, grid->cols);
+  shedCopyInto(window, full);
+  shedFree(window);
+  grid->view_shed = full;
+}
+
+//Returns a copy of the grid whose header only describes the window its
+//viewshed covers, for writing the viewshed cropped. Rows count down from the
+//top of the grid, so the lower left corner moves up by the rows below the
+//window. The copy shares the viewshed.
+Grid shedCropped(Grid *grid)
+{
+  Grid crop = *grid;
+  Shed *shed = grid->view_shed;
+  crop.rows = shed->rows;
+  crop.cols = shed->cols;
+  crop.xllcorner += shed->col0 * grid->cellsize;
+  crop.yllcorner += (grid->rows - shed->row0 - shed->rows) * grid->cellsize;
+  return crop;
+}
+
+//Buffer each thread packs the rows of a record into, kept between records
+static __thread unsigned char *recordRow = NULL;
+static __thread int recordRowSize = 0;
+
+//Writes one record of the packed format: the viewpoint, then each row of the
+//viewshed in (cols+7)/8 bytes, lowest bit first
+void packedRecord(FILE *f, Shed *shed, int testRow, int testCol)
+{
+  int viewpoint[2] = {testRow, testCol};
+  int rowBytes = (shed->cols + 7) / 8;
+  if (recordRowSize < shed->wordsPerRow * 8)
+  {
+    free(recordRow);
+    recordRowSize = shed->wordsPerRow * 8;
+    recordRow = (unsigned char*) malloc(recordRowSize);
+    if (recordRow == NULL)
+    {
+      printf("cannot allocate packed row\n");
+      exit(1);
+    }
+  }
+  unsigned char *out = recordRow;
+  fwrite(viewpoint, sizeof(int), 2, f);
+  for (int row = 0; row < shed->rows; row++)
+  {
+    uint64_t *words = shed->bits + (long) row * shed->wordsPerRow;
+    for (int w = 0; w < shed->wordsPerRow; w++)
+    {
+      for (int b = 0; b < 8; b++) {out[w * 8 + b] = words[w] >> (8 * b);}
+    }
+    fwrite(out, 1, rowBytes, f);
+  }
+}
+
+//Writes the header of the packed format, with the size and georeference of the
+//grid
+void packedHeader(FILE *f, Grid *grid)
+{
+  PackedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PACKED_MAGIC, 4);
+  header.version = PACKED_VERSION;
+  header.rows = grid->rows;
+  header.cols = grid->cols;
+  header.ndvalue = grid->ndvalue;
+  header.xllcorner = grid->xllcorner;
+  header.yllcorner = grid->yllcorner;
+  header.cellsize = grid->cellsize;
+  fwrite(&header, sizeof(header), 1, f);
+}
+
+//Viewshed grid is written packed: the header, then a single record for the
+//viewpoint
+void shedIntoPacked(Grid *grid, char * newfile, int testRow, int testCol)
+{
+  FILE* n = fopen(newfile, "wb");
+  if (n == NULL) {
+     printf("cannot open files...");
+     exit(1);
+  }
+  packedHeader(n, grid);
+  packedRecord(n, grid->view_shed, testRow, testCol);
+  fclose(n);
+}
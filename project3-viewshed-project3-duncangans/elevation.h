@@ -0,0 +1,58 @@
+//This file compiles a set of kernels once for each type a grid's heights can
+//be stored as. The kernels are written in a template header that reads the
+//grid with HEIGHT_AT(ELEV, ...) and names each function TYPED(name); define
+//KERNELS as that header and include this file, and isVisible for instance
+//comes out as isVisibleInt16, isVisibleUint16, isVisibleFloat and
+//isVisibleDouble. TYPED_FOR (viewshed.h) then picks the copy for a grid's
+//dtype once per viewshed, so the loops themselves never switch on it, and a
+//grid of 16 bit heights is read as half the bytes of a float one. ELEV_FLOAT
+//and ELEV_SHORT are 1 for the float and 16 bit copies, which the simd kernel
+//gathers in their own ways.
+//The name given to TYPED is expanded before the type is pasted on, so it may
+//itself be a macro (simdlos.c names its copies for each instruction set so).
+//There is no include guard; each kernel file includes it once.
+
+#define ELEV_NAME(name, type) ELEV_PASTE(name, type)
+#define ELEV_PASTE(name, type) name##type
+
+#define ELEV int16_t
+#define ELEV_FLOAT 0
+#define ELEV_SHORT 1
+#define TYPED(name) ELEV_NAME(name, Int16)
+#include KERNELS
+#undef ELEV
+#undef ELEV_FLOAT
+#undef ELEV_SHORT
+#undef TYPED
+
+#define ELEV uint16_t
+#define ELEV_FLOAT 0
+#define ELEV_SHORT 1
+#define TYPED(name) ELEV_NAME(name, Uint16)
+#include KERNELS
+#undef ELEV
+#undef ELEV_FLOAT
+#undef ELEV_SHORT
+#undef TYPED
+
+#define ELEV float
+#define ELEV_FLOAT 1
+#define ELEV_SHORT 0
+#define TYPED(name) ELEV_NAME(name, Float)
+#include KERNELS
+#undef ELEV
+#undef ELEV_FLOAT
+#undef ELEV_SHORT
+#undef TYPED
+
+#define ELEV double
+#define ELEV_FLOAT 0
+#define ELEV_SHORT 0
+#define TYPED(name) ELEV_NAME(name, Double)
+#include KERNELS
+#undef ELEV
+#undef ELEV_FLOAT
+#undef ELEV_SHORT
+#undef TYPED
+
+#undef KERNELS
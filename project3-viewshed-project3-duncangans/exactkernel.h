@@ -0,0 +1,125 @@
+//The exact engine, included by viewshed.c through elevation.h once for each
+//type the heights can be stored as. ExactWork is defined by viewshed.c.
+
+//When given a test row and a single column it tests whether the point is
+//visible from the other point. To do this it iterates through each column/row
+//between the two and finds the point that could theoretically block the view.
+//If said point is lower than the visibility line it is all good. Otherwise,
+//a 0 is returned indicating the point is not visible. The crossings looked at
+//are counted in losCounts on the way out.
+int TYPED(isVisible)(Grid *grid, int row, int col, int testrow, int testcol)
+{
+  //Distance and slopes from the viewpoint (testrow, testcol) to the point 
+  //being tested (row and col) is calculated
+  int deltaX = col - testcol;
+  int deltaY = testrow - row;
+  double delta = sqrt((deltaX*deltaX)+(deltaY*deltaY));
+  float viewHeight = HEIGHT_AT(ELEV, grid, testrow, testcol) + grid->observer;
+  float visSlope = (HEIGHT_AT(ELEV, grid, row, col) - viewHeight) / delta;
+  double slope = (double)(testrow - row) / (double)(col - testcol);
+  
+  //Upper and Lower bounds for rows ints are created, and colChange created
+  int ltempRow, htempRow, colChange;
+  if (col >= testcol) {colChange = 1;} else {colChange = -1;}
+  int colCrossings = deltaX ? abs(deltaX) - 1 : 0;
+  double midPoint, height, tempDelta, tempSlopeVis;
+
+  //For each line intersection through the columns, the intersection point is
+  //created and tested for visibility
+  for (int i = testcol; i != col; i+=colChange)
+  {
+    //The viewpoint's own column can't block the view
+    if (i == testcol) {continue;}
+    //Point between rows is created, the height at that location is calculated
+    //Finally the slope to that point is checked for visibility. The upper row
+    //is only read when it has some weight, since it can be off the grid.
+    midPoint = slope * (i - testcol) - floor(slope * (i - testcol));
+    ltempRow = testrow - floor(slope * (i - testcol));
+    htempRow = ltempRow - 1;
+    height = (midPoint == 0 ? 0 :
+              midPoint * HEIGHT_AT(ELEV, grid, htempRow, i)) +
+             (1-midPoint) * HEIGHT_AT(ELEV, grid, ltempRow, i);
+    tempDelta = sqrt((pow(i-testcol, 2)+pow(testrow - (ltempRow-midPoint), 2)));
+    tempSlopeVis = (height - viewHeight) / tempDelta; 
+    if (tempSlopeVis > visSlope+.0001)
+    {
+      losCounts.crossings += abs(i - testcol);
+      losCounts.earlyExits++;
+      return 0;
+    }
+  }
+
+  //The code below mirrors the code above, but does so for iterating through
+  //the rows instead of the columns.
+  double invSlope = (double)(col - testcol) / (double)(testrow - row);
+  int ltempCol, htempCol, rowChange;
+  if (row >= testrow) {rowChange = 1;} else {rowChange = -1;}
+  for (int i = testrow; i!= row; i+=rowChange)
+  {
+    if (i == testrow) {continue;}
+    midPoint = invSlope * (testrow - i) - floor(invSlope * (testrow - i));
+    htempCol = testcol - floor(invSlope*(i - testrow));
+    ltempCol = htempCol - 1;
+    height = (midPoint == 0 ? 0 :
+              midPoint * HEIGHT_AT(ELEV, grid, i, htempCol)) +
+		(1-midPoint) * HEIGHT_AT(ELEV, grid, i, ltempCol);
+    tempDelta = sqrt((pow(i-testrow, 2)+pow(testcol-(ltempCol + midPoint), 2)));
+    tempSlopeVis = (height - viewHeight) / tempDelta;
+    if (tempSlopeVis > visSlope+.0001)
+    {
+      losCounts.crossings += colCrossings + abs(i - testrow);
+      losCounts.earlyExits++;
+      return 0;
+    }
+  }
+  //If the function makes it to this point, it means nothing blocks the view
+  //and the point IS visible 
+  losCounts.crossings += colCrossings + (deltaY ? abs(deltaY) - 1 : 0);
+  return 1;
+}
+
+//Each row and column in the given rows of the viewshed's window is tested
+//against the testrow and the testcol for visibility. Rows are only ever
+//written by one thread and start on their own word of the viewshed, so the
+//output does not depend on how many threads there are. Cells already known to
+//be visible are left for the caller. The cells tested and skipped are counted
+//as the rows go, and added to the run's stats at the end.
+static void TYPED(shedRows)(void *arg, long start, long end)
+{
+  ExactWork *work = (ExactWork*) arg;
+  int (*visible)(Grid*, int, int, int, int) = work->visible;
+  Grid *grid = work->grid;
+  Shed *shed = grid->view_shed;
+  int testRow = work->testRow;
+  int testCol = work->testCol;
+  long tested = 0, skipped = 0;
+  for (int row = shed->row0 + start; row < shed->row0 + end; row++)
+  {
+    for (int col = shed->col0; col < shed->col0 + shed->cols; col++)
+    {
+      long dRow = row - testRow, dCol = col - testCol;
+      if (work->known && shedGet(work->known, row, col)) {continue;}
+      //If the value is out of range or a ndvalue, it is left NOT visible
+      if (work->radius2 && dRow*dRow + dCol*dCol > work->radius2) {continue;}
+      if (HEIGHT_AT(ELEV, grid, row, col) == grid->ndvalue)
+      {
+        skipped++;
+        continue;
+      }
+      if (testRow == row && testCol == col)
+      {
+        shedSet(grid->view_shed, row, col);
+        continue;
+      }
+      tested++;
+      if (visible(grid, row, col, testRow, testCol))
+      {
+        shedSet(grid->view_shed, row, col);
+      }
+    }
+  }
+  losCounts.cellsTested += tested;
+  losCounts.nodataSkips += skipped;
+  statsFlush(work->stats);
+}
+
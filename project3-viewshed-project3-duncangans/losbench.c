@@ -0,0 +1,131 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include "render/gridio.h"
+
+//This program times the scalar isVisible loop against the batched kernel in
+//simdlos.c. Every cell of a grid is tested from a viewpoint in the middle and
+//from one near a corner, once with each kernel, and the time, speedup and number
+//of cells where the two disagree are printed. The grid is then run again with
+//the batched kernel made to find cells by long index, as it does on grids over
+//2^31 cells, in row-major and blocked layout, so that path is checked against
+//isVisible without a grid that big.
+
+//Wall clock time in seconds
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Fills a grid with rolling hills from a sum of sine waves. bowl tips the
+//hills into a basin, which keeps most cells visible so that rays are long.
+static void makeTerrain(Grid *grid, int size, int bowl)
+{
+  grid->rows = size;
+  grid->cols = size;
+  grid->ndvalue = -9999;
+  grid->dtype = GRIDIO_DTYPE_FLOAT32;
+  grid->data_blocked = NULL;
+  grid->mapSize = 0;
+  grid->observer = 0;
+  float *data = (float*) malloc((long) size * size * sizeof(float));
+  grid->data_rowmajor = data;
+  for (int row = 0; row < size; row++)
+  {
+    for (int col = 0; col < size; col++)
+    {
+      double height = 500;
+      for (int w = 1; w <= 6; w++)
+      {
+        height += 40.0 / w * sin(w * 0.013 * row + w) * cos(w * 0.017 * col);
+      }
+      if (bowl)
+      {
+        double dr = row - size / 2.0, dc = col - size / 2.0;
+        height += (dr * dr + dc * dc) / size;
+      }
+      data[row * size + col] = floor(height);
+    }
+  }
+}
+
+//Times one kernel over every cell of the grid, leaving the answers in shed
+static double timeKernel(Grid *grid, int testRow, int testCol, int *shed,
+                         int (*visible)(Grid*, int, int, int, int))
+{
+  double start = now();
+  for (int row = 0; row < grid->rows; row++)
+  {
+    for (int col = 0; col < grid->cols; col++)
+    {
+      shed[row * grid->cols + col] = (row == testRow && col == testCol) ? 1 :
+        visible(grid, row, col, testRow, testCol);
+    }
+  }
+  return now() - start;
+}
+
+//Returns the first cell on the diagonal from the top left corner that is not
+//nodata, so that the corner viewpoint has a real height
+static int cornerCell(Grid *grid)
+{
+  int i = 0;
+  while (i + 1 < grid->rows && i + 1 < grid->cols &&
+         getRowMajor(grid, i, i) == grid->ndvalue) {i++;}
+  return i;
+}
+
+//Runs both kernels from one viewpoint and prints a line for it
+static void compare(char *name, Grid *grid, int testRow, int testCol)
+{
+  long cells = (long) grid->rows * grid->cols;
+  int *exact = (int*) malloc(cells * sizeof(int));
+  int *simd = (int*) malloc(cells * sizeof(int));
+  double scalarTime = timeKernel(grid, testRow, testCol, exact, isVisible);
+  double simdTime = timeKernel(grid, testRow, testCol, simd, isVisibleSimd);
+  long visible = 0, mismatches = 0;
+  for (long i = 0; i < cells; i++)
+  {
+    visible += exact[i];
+    mismatches += exact[i] != simd[i];
+  }
+  printf("%-14s %5dx%-5d from %5d %5d  visible %9ld  scalar %8.3fs  "
+         "simd %8.3fs  speedup %5.2fx  mismatches %ld\n",
+         name, grid->rows, grid->cols, testRow, testCol, visible,
+         scalarTime, simdTime, scalarTime / simdTime, mismatches);
+  free(exact);
+  free(simd);
+}
+
+int main(int argc, char **argv)
+{
+  char *file = argc > 1 ? argv[1] : "render/set1.asc";
+  int size = argc > 2 ? atol(argv[2]) : 2000;
+
+  Grid grid;
+  readGridfromFile(file, &grid);
+  compare(file, &grid, grid.rows / 2, grid.cols / 2);
+  compare(file, &grid, cornerCell(&grid), cornerCell(&grid));
+  simdIndexLimit = -1;
+  compare("long index", &grid, grid.rows / 2, grid.cols / 2);
+  blockGrid(&grid, 64);
+  compare("long blocked", &grid, grid.rows / 2, grid.cols / 2);
+  simdIndexLimit = INT_MAX;
+  compare("blocked", &grid, grid.rows / 2, grid.cols / 2);
+  free((char*) grid.data_blocked - gridio_dtype_size(grid.dtype));
+
+  makeTerrain(&grid, size, 0);
+  compare("synthetic", &grid, size / 2, size / 2);
+  compare("synthetic", &grid, 0, 0);
+  free(grid.data_rowmajor);
+
+  makeTerrain(&grid, size, 1);
+  compare("synthetic bowl", &grid, size / 2, size / 2);
+  free(grid.data_rowmajor);
+  return 0;
+}
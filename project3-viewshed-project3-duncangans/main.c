@@ -0,0 +1,116 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "render/gridio.h"
+
+//This function reads in a asci file representing a terrain and computes the
+//viewshed from a specific point. After reading in the grid and computing the
+//viewshed, the viewshed, represented by 0s and 1s is then scanned into a file
+//of the users choice
+
+int main(int argc, char **argv)
+{
+  if (argc < 5) {
+    printf("usage: viewshed <filename> <newfile> <testrow> <testcol> "
+           "[--engine r2|exact|simd] [--threads n]\n"
+           "       [--layout rowmajor|blocked] [--block n]\n"
+           "       [--format ascii|packed] [--radius n [--crop]] [--height h]\n"
+           "       [--stats]\n"
+           "       viewshed <filename> <newfile> --batch <viewpoints|-> "
+           "[options]\n"
+           "       viewshed <filename> <newfile> --cumulative <viewpoints|-> "
+           "[options]\n"
+           "       viewshed <filename> <newfile> --path <viewpoints|-> "
+           "[options]\n"
+           "       (--path skips cells already seen only with --engine "
+           "exact|simd; with r2\n"
+           "       it only saves writing each viewshed. It takes no --crop)\n");
+    exit(0); 
+  }
+
+  //In the batch modes the viewpoints come from a file instead of the command
+  //line
+  int cumulative = strcmp(argv[3], "--cumulative") == 0;
+  int path = strcmp(argv[3], "--path") == 0;
+  int batch = cumulative || path || strcmp(argv[3], "--batch") == 0;
+  int testrow = batch ? 0 : atol(argv[3]);
+  int testcol = batch ? 0 : atol(argv[4]);
+
+  //Options default to the R2 engine, the exact engine is kept as a reference
+  Options opts;
+  optionsDefault(&opts);
+  int i = parseOptions(argc, argv, 5, &opts);
+  if (i < argc)
+  {
+    printf("unknown option %s\n", argv[i]);
+    exit(1);
+  }
+
+  //Grid is created
+  Grid grid;
+  Stats *stats = opts.stats;
+  Rtimer rt;
+  long written = 0;
+  
+  //Grid's values are entered from the file entered
+  //The arguments represent the files and the grid adress
+  if (stats) {rt_start(rt);}
+  readGridfromFile (argv[1], &grid);
+  if (stats)
+  {
+    rt_stop(rt);
+    statsPhase(stats, PHASE_READ, &rt);
+    stats->bytesRead = statsFileSize(argv[1]);
+    written = statsBytesWritten();
+    rt_start(rt);
+  }
+  if (batch)
+  {
+    //The batch modes compute and write viewpoints on every thread at once,
+    //so the whole run is timed as compute
+    if (path) {runPath(&grid, argv[4], argv[2], &opts);}
+    else if (cumulative) {runCumulative(&grid, argv[4], argv[2], &opts);}
+    else {runBatch(&grid, argv[4], argv[2], &opts);}
+    if (stats)
+    {
+      rt_stop(rt);
+      statsPhase(stats, PHASE_COMPUTE, &rt);
+      stats->bytesWritten = written < 0 ? statsFileSize(argv[2]) :
+                                          statsBytesWritten() - written;
+      statsWrite(stdout, stats, &grid, &opts, argv[1], argv[3] + 2, -1, -1);
+    }
+    return 0;
+  }
+  //The viewshed is created, with its allocation and compute timed inside
+  if (stats) {stats->phased = 1;}
+  createViewshed(&grid, testrow, testcol, &opts);
+  if (stats) {rt_start(rt);}
+  //The viewshed is visualized and printed, (commented out for now)
+  //printGrid(&grid);
+  //A viewshed limited to a radius only covers the window around the
+  //viewpoint. It is written as that window with --crop, and otherwise put
+  //back into a viewshed the size of the grid.
+  Grid out = grid;
+  int outRow = testrow, outCol = testcol;
+  if (opts.radius > 0 && opts.crop)
+  {
+    out = shedCropped(&grid);
+    outRow -= grid.view_shed->row0;
+    outCol -= grid.view_shed->col0;
+  }
+  else {shedExpand(&out);}
+  //The viewshed is then read into the file
+  if (opts.packed) {shedIntoPacked(&out, argv[2], outRow, outCol);}
+  else {shedIntoFile(&out, argv[2], gridio_default_threads());}
+  if (stats)
+  {
+    rt_stop(rt);
+    statsPhase(stats, PHASE_WRITE, &rt);
+    stats->bytesWritten = written < 0 ? statsFileSize(argv[2]) :
+                                        statsBytesWritten() - written;
+    statsWrite(stdout, stats, &grid, &opts, argv[1], "single", testrow,
+               testcol);
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+//This file holds the small thread pool the engines share. Work is a range of
+//indices that the threads pull from in chunks, so a thread that drew cheap
+//work (cells near the viewpoint) just comes back for more.
+
+typedef struct _loop {
+
+     long next, count, chunk;   //the next index to hand out, and the range
+     void (*task)(void *arg, long start, long end);
+     void *arg;
+
+} Loop;
+
+//Each thread keeps pulling the next chunk until the range runs out
+static void *loopWorker(void *data)
+{
+  Loop *loop = (Loop*) data;
+  for (;;)
+  {
+    long start = __sync_fetch_and_add(&loop->next, loop->chunk);
+    if (start >= loop->count) {break;}
+    long end = start + loop->chunk;
+    if (end > loop->count) {end = loop->count;}
+    loop->task(loop->arg, start, end);
+  }
+  return NULL;
+}
+
+//Runs task over [0, count) in chunks on the given number of threads. With one
+//thread the task simply runs in order on the calling thread.
+void parallelFor(int threads, long count, long chunk,
+                 void (*task)(void *arg, long start, long end), void *arg)
+{
+  if (threads <= 1)
+  {
+    task(arg, 0, count);
+    return;
+  }
+  Loop loop = {0, count, chunk > 0 ? chunk : 1, task, arg};
+  pthread_t *ids = (pthread_t*) malloc(threads * sizeof(pthread_t));
+  for (int i = 1; i < threads; i++)
+  {
+    if (pthread_create(&ids[i], NULL, loopWorker, &loop) != 0)
+    {
+      printf("cannot create thread\n");
+      exit(1);
+    }
+  }
+  loopWorker(&loop);
+  for (int i = 1; i < threads; i++) {pthread_join(ids[i], NULL);}
+  free(ids);
+}
@@ -0,0 +1,215 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+//This file holds the R2 engine. Instead of walking back to the viewpoint for
+//every cell like isVisible does, rays are cast from the viewpoint out to a
+//square boundary that encloses the whole grid, or the radius asked for. Each
+//ray carries the steepest slope it has crossed so far, so a cell's visibility
+//is a single comparison against that running max. Every cell is owned by
+//exactly one ray (the one passing closest to its center), so each cell is
+//written exactly once.
+
+//One step out along a ray. None of it depends on the viewpoint, only on the
+//ray and its reach, so the steps can be worked out once and kept in a
+//RayTemplate for every viewpoint with the same radius.
+typedef struct _rayStep {
+
+     int near;       //minor offset of the cell nearest the ray at this step
+
+     int lo;         //minor offset of the cell just below the crossing
+
+     int owned;      //the cell at near is this ray's to write, and in range
+
+     double frac;    //how far past lo the crossing is
+
+     double dist;    //distance from the viewpoint to the cell at near
+
+} RayStep;
+
+//The steps of all 4*(2*reach+1) rays out to a radius of reach
+struct _rayTemplate {
+
+     long long reach;
+
+     RayStep *steps;    //reach steps for each ray, ray after ray
+
+};
+
+//Works out the steps of one ray. The ray steps one cell at a time along the
+//major axis (columns if colMajor, rows otherwise) and drifts toward minor
+//offset B on the other axis by the time it is reach steps out. Cells on the
+//diagonal are owned by the column major rays, and cells further than radius
+//from the viewpoint by none of them (a radius of 0 is no limit). Only the
+//first count steps are worked out.
+static void planRay(RayStep *steps, long long count, int colMajor,
+                    long long B, long long reach, long long radius)
+{
+  double invReach = 1.0 / (double) reach;
+
+  //The minor position of the ray is B*i/reach. It is tracked as floor and
+  //remainder (lo, loRem) for the interpolation, and rounded to the nearest cell
+  //(near, nearRem) from the numerator 2*B*i + reach over 2*reach.
+  long long lo = 0, loRem = 0;
+  long long near = 0, nearRem = reach;
+  for (long long i = 1; i <= count; i++)
+  {
+    loRem += B;
+    while (loRem >= reach) {loRem -= reach; lo++;}
+    while (loRem < 0) {loRem += reach; lo--;}
+    nearRem += 2 * B;
+    while (nearRem >= 2 * reach) {nearRem -= 2 * reach; near++;}
+    while (nearRem < 0) {nearRem += 2 * reach; near--;}
+
+    //The cell is only written by the ray that owns it, which is the ray whose
+    //offset B rounds from near*reach/i, i.e. 2*i*B <= 2*near*reach + i < 2*i*(B+1)
+    long long num = 2 * near * reach + i;
+    int owned = 2 * i * B <= num && num < 2 * i * (B + 1);
+    if (!colMajor && (near == i || near == -i)) {owned = 0;}
+    if (radius > 0 && i*i + near*near > radius*radius) {owned = 0;}
+
+    RayStep *step = &steps[i - 1];
+    step->near = near;
+    step->lo = lo;
+    step->owned = owned;
+    step->frac = loRem * invReach;
+    step->dist = sqrt((double) (i*i + near*near));
+  }
+}
+
+//rayHeight and castRay are compiled for each type the heights can be stored
+//as (see raykernel.h)
+#define KERNELS "raykernel.h"
+#include "elevation.h"
+
+//The viewpoint and grid the rays are cast over, shared by the threads
+typedef struct _rayWork {
+
+     Grid *grid;
+     int testRow, testCol;
+     long long reach;
+     long long radius;
+     RayTemplate *rays;  //the rays' steps, or NULL to plan each ray as it goes
+     int shared;      //more than one thread is casting rays
+     void (*cast)(Grid*, int, int, int, int, long long, long long,
+                  const RayStep*, int);   //the copy of castRay for the
+                                          //grid's type
+     Stats *stats;    //where the threads add their counts, or NULL
+
+} RayWork;
+
+//Ray k goes to offset B = k/4 - reach on the boundary, and k%4 picks the axis
+//and the direction along it
+#define RAY_B(k, reach) ((long long) (k) / 4 - (reach))
+#define RAY_COLMAJOR(k) ((k) % 2)
+#define RAY_DIR(k)      (((k) / 2) % 2 ? 1 : -1)
+
+//Buffer each thread plans its rays into. It is kept from one call to the next
+//and only grows, so a thread computing viewshed after viewshed (see batch.c)
+//allocates it once.
+static __thread RayStep *rayScratch = NULL;
+static __thread long long rayScratchSize = 0;
+
+//Casts the rays numbered start to end. Without a template the steps of each
+//ray are planned into a buffer first, as far as the ray stays on the grid.
+static void castRays(void *arg, long start, long end)
+{
+  RayWork *work = (RayWork*) arg;
+  Grid *grid = work->grid;
+  RayStep *scratch = NULL;
+  if (work->rays == NULL)
+  {
+    if (rayScratchSize < work->reach)
+    {
+      free(rayScratch);
+      rayScratch = (RayStep*) malloc(work->reach * sizeof(RayStep));
+      rayScratchSize = work->reach;
+      if (rayScratch == NULL)
+      {
+        printf("cannot allocate rays\n");
+        exit(1);
+      }
+    }
+    scratch = rayScratch;
+  }
+  for (long k = start; k < end; k++)
+  {
+    long long B = RAY_B(k, work->reach);
+    const RayStep *steps;
+    if (work->rays) {steps = work->rays->steps + k * work->reach;}
+    else
+    {
+      int colMajor = RAY_COLMAJOR(k);
+      long long count = colMajor ? work->testCol : work->testRow;
+      if (RAY_DIR(k) > 0)
+      {
+        count = (colMajor ? grid->cols : grid->rows) - 1 - count;
+      }
+      if (count > work->reach) {count = work->reach;}
+      planRay(scratch, count, colMajor, B, work->reach, work->radius);
+      steps = scratch;
+    }
+    work->cast(work->grid, work->testRow, work->testCol, RAY_COLMAJOR(k),
+               RAY_DIR(k), B, work->reach, steps, work->shared);
+  }
+  statsFlush(work->stats);
+}
+
+//Works out the steps of every ray out to radius, for createViewshedR2 to share
+//between viewpoints. It takes 32*(8*radius+4)*radius bytes, about 7MB for a
+//radius of 167 cells (5km at 30m).
+RayTemplate *rayTemplate(int radius)
+{
+  RayTemplate *rays = (RayTemplate*) malloc(sizeof(RayTemplate));
+  long count = 4 * (2 * (long) radius + 1);
+  rays->reach = radius;
+  rays->steps = (RayStep*) malloc(count * radius * sizeof(RayStep));
+  if (rays->steps == NULL)
+  {
+    printf("cannot allocate rays for radius %d\n", radius);
+    exit(1);
+  }
+  for (long k = 0; k < count; k++)
+  {
+    planRay(rays->steps + k * radius, radius, RAY_COLMAJOR(k), RAY_B(k, radius),
+            radius, radius);
+  }
+  return rays;
+}
+
+//Frees the rays made by rayTemplate
+void rayTemplateFree(RayTemplate *rays)
+{
+  free(rays->steps);
+  free(rays);
+}
+
+//Viewshed is computed by casting rays to every cell of a square boundary of
+//radius reach around the viewpoint. Without a radius, reach is large enough
+//that the square encloses the grid; with one, reach is the radius and the
+//cells outside the circle are left not visible. Rays stop as soon as they
+//leave the grid. Since every cell has a single owning ray, the threads never
+//write the same cell, though they do share words of the viewshed. rays, if
+//given, must have been made by rayTemplate for the same radius. The rays'
+//counts go to stats, if given.
+void createViewshedR2(Grid * grid, int testRow, int testCol, int threads,
+                      int radius, RayTemplate *rays, Stats *stats)
+{
+  RayWork work;
+  work.grid = grid;
+  work.testRow = testRow;
+  work.testCol = testCol;
+  work.radius = radius;
+  work.reach = grid->rows > grid->cols ? grid->rows : grid->cols;
+  if (radius > 0) {work.reach = radius;}
+  work.rays = (rays && rays->reach == work.reach) ? rays : NULL;
+  work.shared = threads > 1;
+  work.cast = TYPED_FOR(grid->dtype, castRay);
+  work.stats = stats;
+  if (getHeight(grid, testRow, testCol) != grid->ndvalue)
+  {
+    shedSet(grid->view_shed, testRow, testCol);
+  }
+  parallelFor(threads, 4 * (2 * work.reach + 1), 64, castRays, &work);
+}
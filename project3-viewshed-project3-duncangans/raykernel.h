@@ -0,0 +1,88 @@
+//The R2 engine's walk along a ray, included by raycast.c through elevation.h
+//once for each type the heights can be stored as. RayStep is defined by
+//raycast.c.
+
+//Returns the height at a point on the grid that sits between two cells on the
+//minor axis. lo is the lower cell on that axis and frac is how far past it the
+//point is. Cells that fall off the grid are ignored.
+static double TYPED(rayHeight)(Grid *grid, int colMajor, int major, int lo,
+                               double frac, int minorSize)
+{
+  int hi = lo + 1;
+  if (lo < 0 || frac == 0 || hi >= minorSize)
+  {
+    int cell = (lo < 0 || (frac != 0 && hi < minorSize)) ? hi : lo;
+    return colMajor ? HEIGHT_AT(ELEV, grid, cell, major) :
+                      HEIGHT_AT(ELEV, grid, major, cell);
+  }
+  if (colMajor)
+  {
+    return (1-frac) * HEIGHT_AT(ELEV, grid, lo, major) +
+           frac * HEIGHT_AT(ELEV, grid, hi, major);
+  }
+  return (1-frac) * HEIGHT_AT(ELEV, grid, major, lo) +
+         frac * HEIGHT_AT(ELEV, grid, major, hi);
+}
+
+//Casts one ray from the viewpoint in direction dir along its major axis,
+//following the steps planRay worked out for it. Each step tests the cell the
+//ray owns there against the steepest slope crossed so far, then adds the
+//crossing itself to the horizon. shared is set when other threads are casting
+//rays into the same viewshed. The steps taken and the cells tested and skipped
+//are added to losCounts at the end; a ray never stops early.
+static void TYPED(castRay)(Grid *grid, int testRow, int testCol,
+                           int colMajor, int dir, long long B, long long reach,
+                           const RayStep *steps, int shared)
+{
+  int majorStart = colMajor ? testCol : testRow;
+  int minorStart = colMajor ? testRow : testCol;
+  int majorSize = colMajor ? grid->cols : grid->rows;
+  int minorSize = colMajor ? grid->rows : grid->cols;
+  double viewHeight = HEIGHT_AT(ELEV, grid, testRow, testCol) + grid->observer;
+  double invReach = 1.0 / (double) reach;
+  double invK = 1.0 / sqrt(1.0 + (double) (B * B) * invReach * invReach);
+  double maxSlope = -HUGE_VAL;
+  long long i;
+  long tested = 0, skipped = 0;
+
+  for (i = 1; i <= reach; i++)
+  {
+    const RayStep *step = &steps[i - 1];
+    int major = majorStart + dir * i;
+    if (major < 0 || major >= majorSize) {break;}
+    int minor = minorStart + step->near;
+    if (minor < 0 || minor >= minorSize) {break;}
+
+    if (step->owned)
+    {
+      int row = colMajor ? minor : major;
+      int col = colMajor ? major : minor;
+      float height = HEIGHT_AT(ELEV, grid, row, col);
+      //Cells that are nodata are left not visible
+      if (height == grid->ndvalue) {skipped++;}
+      else
+      {
+        tested++;
+        double visSlope = (height - viewHeight) / step->dist;
+        if (maxSlope <= visSlope + .0001)
+        {
+          //Cells on other rays can share this cell's word of the viewshed
+          if (shared) {shedSetShared(grid->view_shed, row, col);}
+          else {shedSet(grid->view_shed, row, col);}
+        }
+      }
+    }
+
+    //The crossing at this step then becomes part of the horizon for the cells
+    //further out on the ray
+    double height = TYPED(rayHeight)(grid, colMajor, major,
+                                     minorStart + step->lo, step->frac,
+                                     minorSize);
+    double slope = (height - viewHeight) * invK / (double) i;
+    if (slope > maxSlope) {maxSlope = slope;}
+  }
+  losCounts.crossings += i - 1;
+  losCounts.nodataSkips += skipped;
+  losCounts.cellsTested += tested;
+}
+
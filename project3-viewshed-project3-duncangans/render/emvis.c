@@ -0,0 +1,594 @@
+/* The viewshed of vis_compute_vshed_within for grids too big to hold, in the
+ * manner of ioviewshed. The grid is read a row at a time and the start, query
+ * and end events of its cells are written to disk in sorted runs, which are
+ * then merged and swept in order of angle. Only the active list is kept in
+ * memory during the sweep. The answers of the queries come out in order of
+ * angle, so each goes to the spill file of the band of rows (tile) it is in,
+ * and a tile is written out once all its cells have been answered and the
+ * tiles above it have been written. Everything is held to a memory budget:
+ * the runs are as long as the budget allows, as many runs are merged at once
+ * as half of it has room for buffers, and tiles are as tall as a quarter of
+ * it. The runs all go one after another in a single file, so that however
+ * many there are they take one open file besides the tiles' spill files. */
+
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include "emvis.h"
+#include "gridio.h"
+#include "vis.h"
+#include "utils.h"
+
+// Events merged from each run are read this many at a time, at least.
+#define EMVIS_MIN_BUFFER 4096
+
+// At most this many tiles, so that their spill files can all be open.
+#define EMVIS_MAX_TILES 256
+
+// An event as it is written to disk. The gradient needs the viewpoint's
+// elevation, which may not have been read yet, so the cell's elevation is
+// kept instead and the gradient worked out in the sweep.
+typedef struct emvis_event_t {
+  float   alpha;
+  float   distance;
+  float   elev;
+  int32_t t_r;
+  int32_t t_c;
+  char    event_type;
+} EmvisEvent;
+
+// The answer to a query, written to the spill file of its tile.
+typedef struct emvis_answer_t {
+  int32_t t_r;
+  int32_t t_c;
+  float   value;
+} EmvisAnswer;
+
+// A run of sorted events on disk, and the events of it read but not merged.
+// The runs share a file, so each seeks to its own place before reading.
+typedef struct emvis_run_t {
+  FILE*       file;
+  long        offset;     // where the events still on disk start, in bytes
+  long long   left;       // events still on disk
+  EmvisEvent* buf;
+  int         cap;
+  int         len;
+  int         pos;
+} EmvisRun;
+
+// A node of the active list: a treap keyed by distance and then cell, each
+// node holding the largest gradient in its subtree.
+typedef struct emvis_node_t {
+  float    key;
+  int32_t  t_r;
+  int32_t  t_c;
+  float    gradient;
+  float    max_gradient;
+  uint32_t priority;
+  int      left;
+  int      right;
+} EmvisNode;
+
+typedef struct emvis_tree_t {
+  EmvisNode* nodes;       // a pool; free nodes are chained through left
+  int        cap;
+  int        free;
+  int        root;
+  long       size;
+  uint32_t   seed;
+} EmvisTree;
+
+// Orders events the same as vis_events_in_increasing_alpha, then by cell so
+// that the order does not depend on how the events were split into runs.
+static int emvis_compare(const EmvisEvent* a, const EmvisEvent* b) {
+  if (a->alpha != b->alpha) return a->alpha < b->alpha ? -1 : 1;
+  if (a->distance != b->distance) return a->distance < b->distance ? -1 : 1;
+  if (a->event_type != b->event_type) return a->event_type - b->event_type;
+  if (a->t_r != b->t_r) return a->t_r - b->t_r;
+  return a->t_c - b->t_c;
+}
+
+static int emvis_compare_qsort(const void* a, const void* b) {
+  return emvis_compare(a, b);
+}
+
+// Returns a new temporary file in tmp_dir, already unlinked so that it goes
+// away when closed.
+static FILE* emvis_tmpfile(const char* tmp_dir) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/emvisXXXXXX", tmp_dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "emvis: cannot make a temporary file in %s\n", tmp_dir);
+    exit(1);
+  }
+  unlink(path);
+  FILE* file = fdopen(fd, "w+b");
+  assert(file);
+  return file;
+}
+
+// Sorts the events in buf and writes them as a new run at the end of file.
+static void emvis_write_run(FILE* file, EmvisEvent* buf, size_t n,
+                            const char* tmp_dir) {
+  qsort(buf, n, sizeof(EmvisEvent), emvis_compare_qsort);
+  if (fwrite(buf, sizeof(EmvisEvent), n, file) != n) {
+    fprintf(stderr, "emvis: cannot write a run to %s\n", tmp_dir);
+    exit(1);
+  }
+}
+
+// Returns the next event of a run without taking it, or NULL once it is done.
+static EmvisEvent* emvis_run_peek(EmvisRun* run) {
+  if (run->pos == run->len) {
+    if (run->left == 0) return NULL;
+    run->len = run->left < run->cap ? run->left : run->cap;
+    if (fseek(run->file, run->offset, SEEK_SET) != 0 ||
+        fread(run->buf, sizeof(EmvisEvent), run->len, run->file) != (size_t) run->len) {
+      fprintf(stderr, "emvis: a run is cut short\n");
+      exit(1);
+    }
+    run->left -= run->len;
+    run->offset += (long) run->len * sizeof(EmvisEvent);
+    run->pos = 0;
+  }
+  return &run->buf[run->pos];
+}
+
+// Merges runs into one sorted stream of events, a heap of the runs ordered by
+// their next event.
+typedef struct emvis_merge_t {
+  EmvisRun*  runs;
+  int*       heap;
+  int        n;
+} EmvisMerge;
+
+static void emvis_sift_down(EmvisMerge* merge, int i) {
+  while (1) {
+    int least = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < merge->n && emvis_compare(emvis_run_peek(&merge->runs[merge->heap[l]]),
+                                      emvis_run_peek(&merge->runs[merge->heap[least]])) < 0) {
+      least = l;
+    }
+    if (r < merge->n && emvis_compare(emvis_run_peek(&merge->runs[merge->heap[r]]),
+                                      emvis_run_peek(&merge->runs[merge->heap[least]])) < 0) {
+      least = r;
+    }
+    if (least == i) return;
+    int t = merge->heap[i];
+    merge->heap[i] = merge->heap[least];
+    merge->heap[least] = t;
+    i = least;
+  }
+}
+
+// Sets up the merge of the given runs of file, each of count events from
+// its start (in events), with buffers taking up to buf_bytes between them.
+static void emvis_merge_init(EmvisMerge* merge, FILE* file, long long* starts,
+                             long long* counts, int n, size_t buf_bytes) {
+  int i, cap = buf_bytes / n / sizeof(EmvisEvent);
+  if (cap < EMVIS_MIN_BUFFER) cap = EMVIS_MIN_BUFFER;
+  merge->runs = malloc(n * sizeof(EmvisRun));
+  merge->heap = malloc(n * sizeof(int));
+  assert(merge->runs && merge->heap);
+  merge->n = 0;
+  for (i = 0; i < n; i++) {
+    EmvisRun* run = &merge->runs[i];
+    run->file = file;
+    run->offset = starts[i] * (long) sizeof(EmvisEvent);
+    run->left = counts[i];
+    run->cap = cap;
+    run->buf = malloc(cap * sizeof(EmvisEvent));
+    assert(run->buf);
+    run->len = run->pos = 0;
+    if (emvis_run_peek(run)) merge->heap[merge->n++] = i;
+  }
+  for (i = merge->n / 2 - 1; i >= 0; i--) {
+    emvis_sift_down(merge, i);
+  }
+}
+
+// Takes the next event of the merge, and returns 0 once they are all taken.
+static int emvis_merge_next(EmvisMerge* merge, EmvisEvent* event) {
+  if (merge->n == 0) return 0;
+  EmvisRun* run = &merge->runs[merge->heap[0]];
+  *event = run->buf[run->pos++];
+  if (!emvis_run_peek(run)) {
+    merge->heap[0] = merge->heap[--merge->n];
+  }
+  emvis_sift_down(merge, 0);
+  return 1;
+}
+
+static void emvis_merge_free(EmvisMerge* merge, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    free(merge->runs[i].buf);
+  }
+  free(merge->runs);
+  free(merge->heap);
+}
+
+// Returns a new node of the active list.
+static int emvis_node_new(EmvisTree* tree, float key, int t_r, int t_c, float gradient) {
+  if (tree->free < 0) {
+    int i, old = tree->cap;
+    tree->cap = tree->cap ? 2 * tree->cap : 1024;
+    tree->nodes = realloc(tree->nodes, tree->cap * sizeof(EmvisNode));
+    assert(tree->nodes);
+    for (i = old; i < tree->cap; i++) {
+      tree->nodes[i].left = (i + 1 < tree->cap) ? i + 1 : -1;
+    }
+    tree->free = old;
+  }
+  int n = tree->free;
+  EmvisNode* node = &tree->nodes[n];
+  tree->free = node->left;
+  tree->seed = tree->seed * 1664525 + 1013904223;
+  node->key = key;
+  node->t_r = t_r;
+  node->t_c = t_c;
+  node->gradient = node->max_gradient = gradient;
+  node->priority = tree->seed;
+  node->left = node->right = -1;
+  return n;
+}
+
+// Orders nodes by distance and then cell.
+static int emvis_node_compare(EmvisNode* a, float key, int t_r, int t_c) {
+  if (a->key != key) return a->key < key ? -1 : 1;
+  if (a->t_r != t_r) return a->t_r - t_r;
+  return a->t_c - t_c;
+}
+
+static void emvis_node_update(EmvisTree* tree, int n) {
+  EmvisNode* node = &tree->nodes[n];
+  float m = node->gradient;
+  if (node->left >= 0) m = maxf(m, tree->nodes[node->left].max_gradient);
+  if (node->right >= 0) m = maxf(m, tree->nodes[node->right].max_gradient);
+  node->max_gradient = m;
+}
+
+// Splits the subtree at n into the nodes before (key, t_r, t_c) and the rest.
+static void emvis_split(EmvisTree* tree, int n, float key, int t_r, int t_c,
+                        int* before, int* rest) {
+  if (n < 0) {
+    *before = *rest = -1;
+    return;
+  }
+  EmvisNode* node = &tree->nodes[n];
+  if (emvis_node_compare(node, key, t_r, t_c) < 0) {
+    emvis_split(tree, node->right, key, t_r, t_c, &tree->nodes[n].right, rest);
+    *before = n;
+  } else {
+    emvis_split(tree, node->left, key, t_r, t_c, before, &tree->nodes[n].left);
+    *rest = n;
+  }
+  emvis_node_update(tree, n);
+}
+
+// Joins two subtrees, every node of a before every node of b.
+static int emvis_join(EmvisTree* tree, int a, int b) {
+  if (a < 0) return b;
+  if (b < 0) return a;
+  if (tree->nodes[a].priority > tree->nodes[b].priority) {
+    tree->nodes[a].right = emvis_join(tree, tree->nodes[a].right, b);
+    emvis_node_update(tree, a);
+    return a;
+  }
+  tree->nodes[b].left = emvis_join(tree, a, tree->nodes[b].left);
+  emvis_node_update(tree, b);
+  return b;
+}
+
+static void emvis_insert(EmvisTree* tree, float key, int t_r, int t_c, float gradient) {
+  int before, rest;
+  int n = emvis_node_new(tree, key, t_r, t_c, gradient);
+  emvis_split(tree, tree->root, key, t_r, t_c, &before, &rest);
+  tree->root = emvis_join(tree, emvis_join(tree, before, n), rest);
+  tree->size++;
+}
+
+static void emvis_delete(EmvisTree* tree, float key, int t_r, int t_c) {
+  int before, rest, node, after;
+  emvis_split(tree, tree->root, key, t_r, t_c, &before, &rest);
+  // the node is the first of the rest; split it off by the cell after it
+  emvis_split(tree, rest, key, t_r, t_c + 1, &node, &after);
+  if (node >= 0) {
+    tree->nodes[node].left = tree->free;
+    tree->free = node;
+    tree->size--;
+  }
+  tree->root = emvis_join(tree, before, after);
+}
+
+// Returns the largest gradient of the nodes nearer than key, -INFINITY if
+// there are none, walking down the tree once.
+static float emvis_max_within(EmvisTree* tree, float key) {
+  float m = -INFINITY;
+  int n = tree->root;
+  while (n >= 0) {
+    EmvisNode* node = &tree->nodes[n];
+    if (node->key < key) {
+      m = maxf(m, node->gradient);
+      if (node->left >= 0) m = maxf(m, tree->nodes[node->left].max_gradient);
+      n = node->right;
+    } else {
+      n = node->left;
+    }
+  }
+  return m;
+}
+
+// Writes the rows of a tile, filled in from the answers in its spill file.
+static void emvis_write_tile(FILE* out_file, FILE* spill, long num_answers,
+                             float* cells, char* buf, int r0, int nrows, int ncols,
+                             int v_r, int v_c) {
+  EmvisAnswer answer;
+  long i;
+  int r;
+  memset(cells, 0, (size_t) nrows * ncols * sizeof(float));
+  if (v_r >= r0 && v_r < r0 + nrows) {
+    cells[(long) (v_r - r0) * ncols + v_c] = vis_grid_visible;
+  }
+  if (spill) {
+    rewind(spill);
+    for (i = 0; i < num_answers; i++) {
+      if (fread(&answer, sizeof(answer), 1, spill) != 1) {
+        fprintf(stderr, "emvis: a tile is cut short\n");
+        exit(1);
+      }
+      cells[(long) (answer.t_r - r0) * ncols + answer.t_c] = answer.value;
+    }
+    fclose(spill);
+  }
+  for (r = 0; r < nrows; r++) {
+    size_t len = gridio_format_floats(buf, cells + (long) r * ncols, ncols);
+    fwrite(buf, 1, len, out_file);
+  }
+}
+
+// Computes the viewshed of (v_r, v_c), out to radius (0 for no limit), of the
+// grid in in_file, asc or binary, and writes it to out_file as an asc grid the
+// size of the grid. It gives the same answers as vis_compute_vshed_within but
+// keeps no more than about mem_budget bytes in memory besides the active
+// list, using temporary files in tmp_dir. Returns 0, after saying why on
+// stderr, if the grid cannot be read or the viewpoint has no data.
+int emvis_compute_vshed(FILE* in_file, FILE* out_file, int v_r, int v_c,
+                        int radius, size_t mem_budget, const char* tmp_dir,
+                        EmvisStats* stats) {
+  GridioRows rows;
+  if (!gridio_open_rows(in_file, &rows)) return 0;
+  GridioHeader* header = &rows.header;
+  int nrows = header->nrows, ncols = header->ncols;
+  int t_r, t_c, i;
+  if (v_r < 0 || v_r >= nrows || v_c < 0 || v_c >= ncols) {
+    fprintf(stderr, "emvis: the viewpoint is off the grid\n");
+    return 0;
+  }
+  memset(stats, 0, sizeof(EmvisStats));
+
+  // the window of cells the radius reaches
+  int r0 = 0, c0 = 0, r1 = nrows, c1 = ncols;
+  if (radius > 0) {
+    r0 = maxi(r0, v_r - radius);
+    c0 = maxi(c0, v_c - radius);
+    r1 = mini(r1, v_r + radius + 1);
+    c1 = mini(c1, v_c + radius + 1);
+  }
+
+  // tiles are bands of rows, as tall as a quarter of the budget holds
+  int tile_rows = mem_budget / 4 / ((size_t) ncols * sizeof(float));
+  tile_rows = maxi(tile_rows, (nrows + EMVIS_MAX_TILES - 1) / EMVIS_MAX_TILES);
+  tile_rows = maxi(tile_rows, 1);
+  int num_tiles = (nrows + tile_rows - 1) / tile_rows;
+  long* tile_left = calloc(num_tiles, sizeof(long));
+  long* tile_answers = calloc(num_tiles, sizeof(long));
+  FILE** tile_spill = calloc(num_tiles, sizeof(FILE*));
+  assert(tile_left && tile_answers && tile_spill);
+  stats->num_tiles = num_tiles;
+
+  // read the grid a row at a time, writing the events of its cells in sorted
+  // runs as long as the budget holds. the cells on the initial sweep line are
+  // kept aside to seed the active list
+  size_t run_cap = maxi(mem_budget / sizeof(EmvisEvent), 3 * EMVIS_MIN_BUFFER);
+  EmvisEvent* events = malloc(run_cap * sizeof(EmvisEvent));
+  float* row = malloc(ncols * sizeof(float));
+  EmvisEvent* seeds = malloc(maxi(v_c, 1) * sizeof(EmvisEvent));
+  assert(events && row && seeds);
+  int num_seeds = 0, cap_runs = 16;
+  FILE* run_file = NULL;
+  long long* run_starts = malloc(cap_runs * sizeof(long long));
+  long long* run_counts = malloc(cap_runs * sizeof(long long));
+  long long run_end = 0;
+  size_t n = 0;
+  float v_elev = 0;
+  float v_r_f = (float) v_r;
+  float v_c_f = (float) v_c;
+  for (t_r = 0; t_r < r1; t_r++) {
+    if (!gridio_read_row(&rows, row)) return 0;
+    if (t_r == v_r) v_elev = row[v_c];
+    if (t_r < r0) continue;
+    for (t_c = c0; t_c < c1; t_c++) {
+      float t_r_f = (float) t_r;
+      float t_c_f = (float) t_c;
+      float alpha_ll, alpha_lr, alpha_ul, alpha_ur, alpha_min, alpha_ct, alpha_max;
+      if ((t_r == v_r && t_c == v_c) || !vis_within_radius(v_r, v_c, t_r, t_c, radius)) {
+        continue;
+      }
+      alpha_ll = vis_swept_alpha(v_r_f, v_c_f, t_r_f - 0.5, t_c_f - 0.5);
+      alpha_lr = vis_swept_alpha(v_r_f, v_c_f, t_r_f - 0.5, t_c_f + 0.5);
+      alpha_ul = vis_swept_alpha(v_r_f, v_c_f, t_r_f + 0.5, t_c_f - 0.5);
+      alpha_ur = vis_swept_alpha(v_r_f, v_c_f, t_r_f + 0.5, t_c_f + 0.5);
+      alpha_ct = vis_swept_alpha(v_r_f, v_c_f, t_r_f, t_c_f);
+      alpha_min = min4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
+      alpha_max = max4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
+
+      EmvisEvent event = {0, dist2di(v_r, v_c, t_r, t_c), row[t_c], t_r, t_c, 0};
+      if (n + 3 > run_cap) {
+        if (stats->num_runs == cap_runs) {
+          cap_runs *= 2;
+          run_starts = realloc(run_starts, cap_runs * sizeof(long long));
+          run_counts = realloc(run_counts, cap_runs * sizeof(long long));
+          assert(run_starts && run_counts);
+        }
+        if (!run_file) run_file = emvis_tmpfile(tmp_dir);
+        emvis_write_run(run_file, events, n, tmp_dir);
+        run_starts[stats->num_runs] = run_end;
+        run_counts[stats->num_runs++] = n;
+        run_end += n;
+        n = 0;
+      }
+      // the cells on the initial sweep line start in the active list
+      if (t_r == v_r && t_c < v_c) {
+        event.event_type = vis_query_event; event.alpha = alpha_ct; events[n++] = event;
+        event.event_type = vis_end_event;   event.alpha = alpha_min; events[n++] = event;
+        event.event_type = vis_start_event; event.alpha = alpha_max; events[n++] = event;
+        seeds[num_seeds++] = event;
+      } else {
+        event.event_type = vis_start_event; event.alpha = alpha_min; events[n++] = event;
+        event.event_type = vis_query_event; event.alpha = alpha_ct; events[n++] = event;
+        event.event_type = vis_end_event;   event.alpha = alpha_max; events[n++] = event;
+      }
+      stats->num_events += 3;
+      tile_left[t_r / tile_rows]++;
+    }
+  }
+  free(row);
+  if (v_elev == header->nodata_value) {
+    fprintf(stderr, "emvis: the viewpoint has no data\n");
+    return 0;
+  }
+
+  // the last run stays in memory when it is the only one; otherwise it is
+  // written too, and the runs are merged, as many at a time as half the
+  // budget has buffers for, until one pass can merge them all into the sweep.
+  // each pass writes its longer runs one after another in a new file, and
+  // the file of the pass before is closed
+  EmvisMerge merge;
+  size_t merge_budget = mem_budget / 2;
+  int fan_in = maxi(2, merge_budget / (EMVIS_MIN_BUFFER * sizeof(EmvisEvent)));
+  int num_runs = 0;
+  if (stats->num_runs > 0) {
+    if (n > 0) {
+      if (stats->num_runs == cap_runs) {
+        cap_runs *= 2;
+        run_starts = realloc(run_starts, cap_runs * sizeof(long long));
+        run_counts = realloc(run_counts, cap_runs * sizeof(long long));
+        assert(run_starts && run_counts);
+      }
+      emvis_write_run(run_file, events, n, tmp_dir);
+      run_starts[stats->num_runs] = run_end;
+      run_counts[stats->num_runs++] = n;
+    }
+    free(events);
+    events = NULL;
+    num_runs = stats->num_runs;
+    while (num_runs > fan_in) {
+      int merged = 0;
+      long long merged_end = 0;
+      FILE* file = emvis_tmpfile(tmp_dir);
+      for (i = 0; i < num_runs; i += fan_in) {
+        int k = mini(fan_in, num_runs - i);
+        long long count = 0;
+        EmvisEvent event;
+        emvis_merge_init(&merge, run_file, run_starts + i, run_counts + i, k,
+                         merge_budget);
+        while (emvis_merge_next(&merge, &event)) {
+          fwrite(&event, sizeof(event), 1, file);
+          count++;
+        }
+        emvis_merge_free(&merge, k);
+        run_starts[merged] = merged_end;
+        run_counts[merged++] = count;
+        merged_end += count;
+      }
+      if (fflush(file) != 0) {
+        fprintf(stderr, "emvis: cannot write a run to %s\n", tmp_dir);
+        exit(1);
+      }
+      fclose(run_file);
+      run_file = file;
+      num_runs = merged;
+      stats->merge_passes++;
+    }
+    emvis_merge_init(&merge, run_file, run_starts, run_counts, num_runs,
+                     merge_budget);
+  } else {
+    qsort(events, n, sizeof(EmvisEvent), emvis_compare_qsort);
+  }
+
+  // seed the active list, then sweep
+  EmvisTree tree = {NULL, 0, -1, -1, 0, 12345};
+  for (i = 0; i < num_seeds; i++) {
+    emvis_insert(&tree, seeds[i].distance, seeds[i].t_r, seeds[i].t_c,
+                 (seeds[i].elev - v_elev) / seeds[i].distance);
+  }
+  stats->max_active = tree.size;
+  free(seeds);
+
+  GridioHeader out_header = *header;
+  gridio_write_asc_header(out_file, &out_header);
+  float* tile_cells = malloc((size_t) tile_rows * ncols * sizeof(float));
+  char* buf = malloc((size_t) ncols * GRIDIO_FLOAT_CHARS + 1);
+  assert(tile_cells && buf);
+  int next_tile = 0;
+  size_t e = 0;
+  EmvisEvent event;
+  while (1) {
+    // tiles whose cells have all been answered are written, in order
+    while (next_tile < num_tiles && tile_left[next_tile] == 0) {
+      emvis_write_tile(out_file, tile_spill[next_tile], tile_answers[next_tile],
+                       tile_cells, buf, next_tile * tile_rows,
+                       mini(tile_rows, nrows - next_tile * tile_rows), ncols, v_r, v_c);
+      next_tile++;
+    }
+    if (num_runs > 0) {
+      if (!emvis_merge_next(&merge, &event)) break;
+    } else {
+      if (e == n) break;
+      event = events[e++];
+    }
+
+    if (event.event_type == vis_start_event) {
+      emvis_insert(&tree, event.distance, event.t_r, event.t_c,
+                   (event.elev - v_elev) / event.distance);
+      if (tree.size > stats->max_active) stats->max_active = tree.size;
+    } else if (event.event_type == vis_end_event) {
+      emvis_delete(&tree, event.distance, event.t_r, event.t_c);
+    } else {
+      EmvisAnswer answer = {event.t_r, event.t_c, vis_grid_occluded};
+      int tile = event.t_r / tile_rows;
+      if (event.elev == header->nodata_value) {
+        answer.value = header->nodata_value;
+      } else if ((event.elev - v_elev) / event.distance >=
+                 emvis_max_within(&tree, event.distance)) {
+        answer.value = vis_grid_visible;
+      }
+      // only answers that are not occluded need to be spilled
+      if (answer.value != vis_grid_occluded) {
+        if (!tile_spill[tile]) tile_spill[tile] = emvis_tmpfile(tmp_dir);
+        fwrite(&answer, sizeof(answer), 1, tile_spill[tile]);
+        tile_answers[tile]++;
+      }
+      tile_left[tile]--;
+    }
+  }
+
+  if (num_runs > 0) emvis_merge_free(&merge, num_runs);
+  if (run_file) fclose(run_file);
+  free(events);
+  free(run_starts);
+  free(run_counts);
+  free(tree.nodes);
+  free(tile_cells);
+  free(buf);
+  free(tile_left);
+  free(tile_answers);
+  free(tile_spill);
+  return 1;
+}
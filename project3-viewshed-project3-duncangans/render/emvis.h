@@ -0,0 +1,20 @@
+#ifndef __emvis_h
+#define __emvis_h
+
+#include <stdio.h>
+#include <stddef.h>
+
+// What an external-memory viewshed did, for the caller to report.
+typedef struct emvis_stats_t {
+  long long num_events;
+  int       num_runs;       // sorted runs written before merging
+  int       merge_passes;   // passes that merged runs into longer runs
+  int       num_tiles;      // bands of rows the output was written in
+  long      max_active;     // most cells in the active list at once
+} EmvisStats;
+
+int emvis_compute_vshed(FILE* in_file, FILE* out_file, int v_r, int v_c,
+                        int radius, size_t mem_budget, const char* tmp_dir,
+                        EmvisStats* stats);
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "emvis.h"
+#include "rtimer.h"
+
+// Compute the viewshed of a grid too big to read into memory, keeping to a
+// memory budget and putting what does not fit in temporary files. The
+// viewshed is the same as the sweep computes; see emvis.c.
+int main(int argc, char** argv) {
+  FILE* in_file;
+  FILE* out_file;
+  int v_r, v_c, radius = 0;
+  long memory_mb = 64;
+  const char* tmp_dir = "/tmp";
+  EmvisStats stats;
+  Rtimer rt;
+  char buf[1000];
+
+  // parse and validate command line parameters
+  if (argc < 5 || argc > 8) {
+    fprintf(stderr, "Usage: emvshed <grid-file> <out-file> <v-row> <v-col> [memory-mb] [radius] [tmp-dir]\n");
+    return 1;
+  }
+  v_r = atoi(argv[3]);
+  v_c = atoi(argv[4]);
+  if (argc > 5) memory_mb = atol(argv[5]);
+  if (argc > 6) radius = atoi(argv[6]);
+  if (argc > 7) tmp_dir = argv[7];
+  if (memory_mb < 1 || radius < 0) {
+    fprintf(stderr, "memory must be at least 1 MB and radius at least 0\n");
+    return 1;
+  }
+  if (!(in_file = fopen(argv[1], "rb"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[1]);
+    return 1;
+  }
+  if (!(out_file = fopen(argv[2], "w"))) {
+    fprintf(stderr, "Cannot open %s for writing\n", argv[2]);
+    return 1;
+  }
+
+  rt_start(rt);
+  if (!emvis_compute_vshed(in_file, out_file, v_r, v_c, radius,
+                           (size_t) memory_mb << 20, tmp_dir, &stats)) {
+    return 1;
+  }
+  rt_stop(rt);
+  rt_sprint(buf, rt);
+  printf("%lld events in %d runs, %d merge passes, %d tiles, "
+         "at most %ld active: %s\n", stats.num_events, stats.num_runs,
+         stats.merge_passes, stats.num_tiles, stats.max_active, buf);
+
+  fclose(in_file);
+  fclose(out_file);
+  return 0;
+}
@@ -4,8 +4,10 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <limits.h>
+#include <math.h>
 #include "utils.h"
 #include "grid.h"
+#include "gridio.h"
 
 // Returns an empty grid object.
 Grid* grid_init() {
@@ -13,21 +15,16 @@ Grid* grid_init() {
   grid = malloc(sizeof(Grid));
   assert(grid);
   grid->data = NULL;
+  grid->map_size = 0;
+  grid->qdata = NULL;
+  grid->q_offset = 0;
+  grid->q_scale = 1;
+  grid->q_error = 0;
   grid->min_value = INT_MAX;
   grid->max_value = -INT_MAX;
   return grid;
 }
 
-void grid_read_header(FILE* in_file, Grid* grid) {
-  float xllcornerf, yllcornerf, cellsizef;
-  assert(fscanf(in_file, "ncols %d\n",        &grid->ncols));
-  assert(fscanf(in_file, "nrows %d\n",        &grid->nrows));
-  assert(fscanf(in_file, "xllcorner %f\n",    &grid->xllcorner));
-  assert(fscanf(in_file, "yllcorner %f\n",    &grid->yllcorner));
-  assert(fscanf(in_file, "cellsize %f\n",     &grid->cellsize));
-  assert(fscanf(in_file, "NODATA_value %f\n", &grid->nodata_value));
-}
-
 void grid_write_header(FILE* out_file, Grid* grid) {
   fprintf(out_file, "ncols %d\n",        grid->ncols);
   fprintf(out_file, "nrows %d\n",        grid->nrows);
@@ -46,16 +43,23 @@ void grid_copy_header(Grid* grid, Grid* new_grid) {
   new_grid->nodata_value = grid->nodata_value;
 }
 
-// Ensure that we have allocated space for the grid data.
+// Points the rows of the grid into cells, a single row-major block.
+void grid_set_rows(Grid* grid, float* cells) {
+  grid->data = malloc(grid->nrows * sizeof(float*));
+  assert(grid->data);
+  int r;
+  for (r = 0; r < grid->nrows; r++) {
+    grid->data[r] = cells + (long) r * grid->ncols;
+  }
+}
+
+// Ensure that we have allocated space for the grid data. The cells are kept in
+// one block, so the rows lie one after the other.
 void grid_malloc_data(Grid* grid) {
   if (!grid->data) {
-    grid->data = malloc(grid->nrows * sizeof(float*));
-    assert(grid->data);
-    int r;
-    for (r = 0; r < grid->nrows; r++) {
-      grid->data[r] = malloc(grid->ncols * sizeof(float));
-      assert(grid->data[r]);
-    }
+    float* cells = malloc((long) grid->nrows * grid->ncols * sizeof(float));
+    assert(cells);
+    grid_set_rows(grid, cells);
   }
 }
 
@@ -79,22 +83,36 @@ Grid* grid_init_from_sized(Grid* grid, int nrows, int ncols) {
 
 // Free a grid and its associated malloced data;
 void grid_free(Grid* grid) {
-  int r;
-  for (r = 0; r < grid->nrows; r++) {
-    free(grid->data[r]);
+  if (grid->data && grid->nrows > 0) {
+    gridio_free(grid->data[0], grid->map_size);
+  }
+  if (grid->qdata && grid->nrows > 0) {
+    free(grid->qdata[0]);
   }
   free(grid->data);
+  free(grid->qdata);
   free(grid);
 }
 
-// Returns the value at the specified point in the grid.
-float grid_get(Grid* grid, int r, int c) {
-  return grid->data[r][c];
+// Returns the quantized value of val, rounded to the nearest step and kept
+// in range.
+static uint16_t grid_encode(Grid* grid, float val) {
+  if (val == grid->nodata_value) {
+    return GRID_QNODATA;
+  }
+  long q = lrintf((val - grid->q_offset) / grid->q_scale);
+  return (q < 0) ? 0 : (q > GRID_QNODATA - 1) ? GRID_QNODATA - 1 : q;
 }
 
-// Sets the value at the specified point in the grid.
+// Sets the value at the specified point in the grid. In a quantized grid the
+// value is rounded to the nearest step, and q_error grows if that moves it.
 void grid_set(Grid* grid, int r, int c, float val) {
-  grid->data[r][c] = val;
+  if (grid->qdata) {
+    grid->qdata[r][c] = grid_encode(grid, val);
+    grid->q_error = maxf(grid->q_error, fabsf(grid_get(grid, r, c) - val));
+  } else {
+    grid->data[r][c] = val;
+  }
   if (val != grid->nodata_value) {
     grid->min_value = minf(val, grid->min_value);
     grid->max_value = maxf(val, grid->max_value);
@@ -111,87 +129,210 @@ void grid_set_nodata(Grid* grid, int r, int c) {
   grid_set(grid, r, c, grid->nodata_value);
 }
 
-void grid_read_data(FILE* in_file, Grid* grid) {
-  int r, c;
-  float val;
-  for (r = 0; r < grid->nrows; r++) {
-    for (c = 0; c < grid->ncols; c++) {
-      assert(fscanf(in_file, "%f ", &val));
-      grid_set(grid, r, c, val);
-    }
-  }
-}
-
-// Returns a grid read in from a given asc file.
+// Returns a grid read in from a given asc or binary grid file, with its min
+// and max values. An asc file is read with gridio, which maps the file and
+// converts its values in parallel; a binary one is mapped and used in place.
 Grid* grid_read(FILE* in_file) {
+  GridioHeader header;
+  size_t map_size;
+  float* cells = gridio_read(in_file, &header, &map_size, 0);
+  if (!cells) {
+    exit(1);
+  }
   Grid* grid = grid_init();
-  grid_read_header(in_file, grid);
-  grid_malloc_data(grid);
-  grid_read_data(in_file, grid);
+  grid->ncols =        header.ncols;
+  grid->nrows =        header.nrows;
+  grid->xllcorner =    header.xllcorner;
+  grid->yllcorner =    header.yllcorner;
+  grid->cellsize =     header.cellsize;
+  grid->nodata_value = header.nodata_value;
+  grid->map_size =     map_size;
+  if (header.min_value <= header.max_value) {
+    grid->min_value = header.min_value;
+    grid->max_value = header.max_value;
+  }
+  grid_set_rows(grid, cells);
   return grid;
 }
 
-// Returns a sample of the grid read in from the given asc file. If either
-// nrows or ncols of the grid data is greater than max_side, downsamples the
+// Returns a sample of the grid read in from the given asc or binary file. If
+// either nrows or ncols of the grid data is greater than max_side, downsamples
 // the grid so that nrows and ncols are less than max_side in the returned
 // grid. If neither nrows or ncols of the grid data are greater than max_side,
-// this function returns the same valuea as grid_read.
+// this function returns the same value as grid_read.
 Grid* grid_read_simp(FILE* in_file, int max_side) {
+  GridioRows rows;
   Grid* grid;
   int r, c;
-  float val;
-  
-  grid = grid_init();
-  grid_read_header(in_file, grid);
-  
+  long start = ftell(in_file);
+
+  if (!gridio_open_rows(in_file, &rows)) {
+    exit(1);
+  }
+  int raw_nrows = rows.header.nrows;
+  int raw_ncols = rows.header.ncols;
+
   // ratio of actual to max {rows,cols}
-  float row_ratio = ((float) grid->nrows) / ((float) max_side);
-  float col_ratio = ((float) grid->ncols) / ((float) max_side);
-  
-  // fail fast to simple case of not needing simplification
+  float row_ratio = ((float) raw_nrows) / ((float) max_side);
+  float col_ratio = ((float) raw_ncols) / ((float) max_side);
+
+  // fail fast to simple case of not needing simplification, which is read
+  // whole and in parallel
   if (row_ratio <= 1.0 && col_ratio <= 1.0) {
-    grid_malloc_data(grid);
-    grid_read_data(in_file, grid);
-    return grid;
+    fseek(in_file, start, SEEK_SET);
+    return grid_read(in_file);
   }
 
   // otherwise we need to simplify
   // round up the largest ratio to get the size of the stride we will need
   // across both rows and colums to achieve the simplification while
-  // maintaining perspective. keep the number of raw {rows,cols} for reference
-  int raw_nrows = grid->nrows;
-  int raw_ncols = grid->ncols;
+  // maintaining perspective.
   int stride = ((int) maxf(row_ratio, col_ratio)) + 1;
-  grid->nrows = (grid->nrows / stride) + 1;
-  grid->ncols = (grid->ncols / stride) + 1;
+  grid = grid_init();
+  grid->ncols =        (raw_ncols / stride) + 1;
+  grid->nrows =        (raw_nrows / stride) + 1;
+  grid->xllcorner =    rows.header.xllcorner;
+  grid->yllcorner =    rows.header.yllcorner;
+  grid->cellsize =     rows.header.cellsize;
+  grid->nodata_value = rows.header.nodata_value;
 
-  // malloc data to hold only the simplified grid
+  // malloc data to hold only the simplified grid, and one raw row at a time.
+  // note that there is no getting around reading every elev value in the raw
+  // file, but only every stride'th row and column of it is kept
   grid_malloc_data(grid);
-
-  // do the actual reading and sample grid construction, being mindful of the
-  // stride. note that there is no getting around fscanf'ing every elev value in
-  // the  raw file
+  float* row = malloc(raw_ncols * sizeof(float));
+  assert(row);
   for (r = 0; r < raw_nrows; r++) {
-    for (c = 0; c < raw_ncols; c++) {
-      assert(fscanf(in_file, "%f ", &val));
-      if ((r % stride == 0) && (c % stride == 0)) {
-        grid_set(grid, r/stride, c/stride, val);
+    if (!gridio_read_row(&rows, row)) {
+      exit(1);
+    }
+    if (r % stride == 0) {
+      for (c = 0; c < raw_ncols; c += stride) {
+        grid_set(grid, r/stride, c/stride, row[c]);
       }
     }
   }
+  free(row);
   return grid;
 }
 
-// Write the complete asc file for a grid.
+// Formats row r of the grid for grid_write. The cells of a quantized grid are
+// decoded one at a time straight into buf, the writer's own buffer.
+size_t grid_format_row(void* arg, int r, char* buf) {
+  Grid* grid = arg;
+  if (!grid->qdata) {
+    return gridio_format_floats(buf, grid->data[r], grid->ncols);
+  }
+  char* p = buf;
+  int c;
+  for (c = 0; c < grid->ncols; c++) {
+    p = gridio_format_float(p, grid_get(grid, r, c));
+  }
+  *p++ = '\n';
+  return p - buf;
+}
+
+// Write the complete asc file for a grid. Each value is written in the fewest
+// digits that read back the same, so whole elevations stay whole numbers.
 void grid_write(FILE* out_file, Grid* grid) {
-  int r, c;
   grid_write_header(out_file, grid);
+  gridio_write_rows(out_file, grid->nrows,
+                    (size_t) grid->ncols * GRIDIO_FLOAT_CHARS + 1,
+                    grid_format_row, grid, 0);
+}
+
+// Chooses the step grid_quantize keeps the grid's cells in: q_offset is the
+// lowest value, and q_scale is the resolution asked for, or finer if the range
+// allows. Without a resolution (0) whole numbers that span fewer than 65535
+// steps are kept exactly with a step of 1, and anything else gets the finest
+// step that spans the range.
+static void grid_quantize_step(Grid* grid, float resolution) {
+  int r, c;
+  bool whole = true;
+  float lo = INFINITY, hi = -INFINITY;
   for (r = 0; r < grid->nrows; r++) {
     for (c = 0; c < grid->ncols; c++) {
-      fprintf(out_file, "%f ", grid_get(grid, r, c));
+      float val = grid->data[r][c];
+      if (val != grid->nodata_value) {
+        lo = minf(lo, val);
+        hi = maxf(hi, val);
+        whole = whole && (val == rintf(val));
+      }
     }
-    fprintf(out_file, "\n");
   }
+  if (lo > hi) {
+    lo = hi = 0;
+  }
+
+  // the finest step that fits the range into the values below GRID_QNODATA
+  float finest = (hi - lo) / (GRID_QNODATA - 1);
+  grid->q_offset = lo;
+  if (resolution > 0) {
+    grid->q_scale = maxf(resolution, finest);
+  } else if (whole && finest <= 1) {
+    grid->q_scale = 1;
+  } else {
+    grid->q_scale = (finest > 0) ? finest : 1;
+  }
+}
+
+// Keeps the elevations of the grid in 16 bits instead of a float, halving the
+// memory it takes: each cell becomes the number of steps of q_scale it is
+// above q_offset (see grid_quantize_step), and grid_get decodes it. Nodata
+// stays nodata. q_error is left as the most any cell moved; see
+// grid_quantize_safe for what that means for visibility.
+void grid_quantize(Grid* grid, float resolution) {
+  int r, c;
+  if (grid->qdata) {
+    return;
+  }
+  grid_quantize_step(grid, resolution);
+  uint16_t* cells = malloc((long) grid->nrows * grid->ncols * sizeof(uint16_t));
+  assert(cells);
+  grid->qdata = malloc(grid->nrows * sizeof(uint16_t*));
+  assert(grid->qdata);
+  grid->q_error = 0;
+  for (r = 0; r < grid->nrows; r++) {
+    grid->qdata[r] = cells + (long) r * grid->ncols;
+    for (c = 0; c < grid->ncols; c++) {
+      float val = grid->data[r][c];
+      grid->qdata[r][c] = grid_encode(grid, val);
+      grid->q_error = maxf(grid->q_error, fabsf(grid_get(grid, r, c) - val));
+    }
+  }
+  gridio_free(grid->data[0], grid->map_size);
+  free(grid->data);
+  grid->data = NULL;
+  grid->map_size = 0;
+}
+
+// Returns the q_error grid_quantize would leave the grid with at this
+// resolution, without quantizing it, so that a caller can keep the floats if
+// it is too large. A quantized grid returns its own.
+float grid_quantize_error(Grid* grid, float resolution) {
+  Grid probe = *grid;
+  float error = 0;
+  int r, c;
+  if (grid->qdata) {
+    return grid->q_error;
+  }
+  grid_quantize_step(&probe, resolution);
+  for (r = 0; r < grid->nrows; r++) {
+    for (c = 0; c < grid->ncols; c++) {
+      float val = grid->data[r][c];
+      error = maxf(error, fabsf(grid_decode(&probe, grid_encode(&probe, val)) - val));
+    }
+  }
+  return error;
+}
+
+// Returns true iff quantizing the grid can not have changed any visibility
+// answer decided by more than tolerance. A gradient between two cells moves
+// by at most 2 * q_error, as the cells are at least 1 apart, so comparing two
+// gradients, as the sweep does, moves by at most 4 * q_error. A grid kept
+// exactly is safe at any tolerance, 0 included.
+bool grid_quantize_safe(Grid* grid, float tolerance) {
+  return 4 * grid->q_error <= tolerance;
 }
 
 // Pack a r,c pair into a single int.
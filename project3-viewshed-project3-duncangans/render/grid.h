@@ -3,29 +3,55 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct grid_t {
-  int     ncols;
-  int     nrows;
-  float   xllcorner;
-  float   yllcorner;
-  float   cellsize;
-  float   nodata_value;
-  float** data;
-  float   min_value;
-  float   max_value;
+  int        ncols;
+  int        nrows;
+  float      xllcorner;
+  float      yllcorner;
+  float      cellsize;
+  float      nodata_value;
+  float**    data;      // the cells, or NULL once quantized
+  float      min_value;
+  float      max_value;
+  size_t     map_size;  // size of the mapping data[0] lies in, 0 if malloced
+  uint16_t** qdata;     // the cells quantized by grid_quantize, or NULL
+  float      q_offset;  // a quantized cell q is q_offset + q * q_scale
+  float      q_scale;
+  float      q_error;   // the most any cell moved when it was quantized
 } Grid;
 
+// The quantized value of a nodata cell.
+#define GRID_QNODATA UINT16_MAX
+
+// Returns the value a quantized cell q stands for.
+static inline float grid_decode(Grid* grid, uint16_t q) {
+  return (q == GRID_QNODATA) ? grid->nodata_value :
+                               grid->q_offset + q * grid->q_scale;
+}
+
+// Returns the value at the specified point in the grid, decoding it if the
+// grid is quantized. It is inline since the sweeps call it for every event.
+static inline float grid_get(Grid* grid, int r, int c) {
+  if (grid->qdata) {
+    return grid_decode(grid, grid->qdata[r][c]);
+  }
+  return grid->data[r][c];
+}
+
 Grid* grid_init_from(Grid* grid);
 Grid* grid_init_from_sized(Grid* grid, int nrows, int ncols);
 void  grid_free(Grid* grid);
-float grid_get(Grid* grid, int r, int c);
 void  grid_set(Grid* grid, int r, int c, float val);
 bool  grid_get_nodata(Grid* grid, int r, int c);
 void  grid_set_nodata(Grid* grid, int r, int c);
 Grid* grid_read(FILE* in_file);
 Grid* grid_read_simp(FILE* in_file, int max_side);
 void  grid_write(FILE* out_file, Grid* grid);
+void  grid_quantize(Grid* grid, float resolution);
+float grid_quantize_error(Grid* grid, float resolution);
+bool  grid_quantize_safe(Grid* grid, float tolerance);
 
 long long int grid_pack_rcpair(Grid* grid, int r, int c);
 void          grid_unpack_rcpair(Grid* grid, long long int rcpair, int* r, int* c);
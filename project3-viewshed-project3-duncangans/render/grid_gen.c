@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "terrain.h"
+#include "rtimer.h"
+
+// Generate a synthetic terrain (see terrain.c) and write it as an asc grid, or
+// as a binary grid of the dtype given. The same size, seed and holes always
+// give the same grid.
+int main(int argc, char** argv) {
+  FILE* out_file;
+  TerrainParams params;
+  GridioHeader header;
+  float* cells;
+  int nrows, ncols, dtype = 0;
+  Rtimer rt;
+  char buf[1000];
+
+  // parse and validate command line parameters
+  if (argc < 3 || argc > 7) {
+    fprintf(stderr, "Usage: grid_gen <out-file> <rows> [cols] [seed] [holes] [asc|float32|int16|uint16|float64]\n");
+    return 1;
+  }
+  nrows = atoi(argv[2]);
+  ncols = (argc > 3) ? atoi(argv[3]) : nrows;
+  if (nrows < 1 || ncols < 1) {
+    fprintf(stderr, "rows and cols must be at least 1\n");
+    return 1;
+  }
+  terrain_defaults(&params, nrows, ncols);
+  if (argc > 4) params.seed = strtoul(argv[4], NULL, 10);
+  if (argc > 5) params.holes = atof(argv[5]);
+  if (params.holes < 0 || params.holes >= 1) {
+    fprintf(stderr, "holes must be a fraction of the cells below 1\n");
+    return 1;
+  }
+  if (argc > 6 && strcmp(argv[6], "asc") != 0 &&
+      !(dtype = gridio_dtype_named(argv[6]))) {
+    fprintf(stderr, "Unknown dtype %s\n", argv[6]);
+    return 1;
+  }
+  if (!(out_file = fopen(argv[1], "wb"))) {
+    fprintf(stderr, "Cannot open %s for writing\n", argv[1]);
+    return 1;
+  }
+
+  rt_start(rt);
+  cells = terrain_generate(&params, &header);
+  rt_stop(rt);
+  rt_sprint(buf, rt);
+  printf("%d x %d, elevations %.0f to %.0f: %s\n", nrows, ncols,
+         header.min_value, header.max_value, buf);
+
+  if (dtype) {
+    gridio_write_bin_typed(out_file, &header, cells, dtype);
+  } else {
+    gridio_write_asc(out_file, &header, cells, 0);
+  }
+  fclose(out_file);
+  free(cells);
+  return 0;
+}
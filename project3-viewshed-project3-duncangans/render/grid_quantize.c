@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "grid.h"
+
+// Quantize a grid into 16 bits and report what that does to it: the step
+// chosen, the most any elevation moved, the memory saved, and whether any
+// visibility answer could change at the given tolerance. Every decoded
+// elevation is checked against the grid as read, to be within that most. With
+// an out-file the quantized grid is written out as well, decoded.
+int main(int argc, char** argv) {
+  FILE* in_file;
+  FILE* out_file;
+  Grid* grid;
+  Grid* original;
+  float resolution = 0, tolerance = 0;
+  long cells, off = 0;
+  int r, c;
+
+  // parse and validate command line parameters
+  if (argc < 2 || argc > 5) {
+    fprintf(stderr, "Usage: grid_quantize <in-file> [resolution] [tolerance] [out-file]\n");
+    return 1;
+  }
+  if (argc > 2) resolution = atof(argv[2]);
+  if (argc > 3) tolerance = atof(argv[3]);
+  if (!(in_file = fopen(argv[1], "r"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[1]);
+    return 1;
+  }
+
+  grid = grid_read(in_file);
+  rewind(in_file);
+  original = grid_read(in_file);
+  fclose(in_file);
+  grid_quantize(grid, resolution);
+  for (r = 0; r < grid->nrows; r++) {
+    for (c = 0; c < grid->ncols; c++) {
+      off += !(fabsf(grid_get(grid, r, c) - grid_get(original, r, c)) <= grid->q_error);
+    }
+  }
+  grid_free(original);
+  if (off) {
+    fprintf(stderr, "%ld decoded elevations moved more than %g\n", off,
+            grid->q_error);
+    return 1;
+  }
+  cells = (long) grid->nrows * grid->ncols;
+  printf("offset %g, step %g, largest change %g\n", grid->q_offset,
+         grid->q_scale, grid->q_error);
+  printf("%ld bytes quantized, %ld as floats\n", cells * (long) sizeof(uint16_t),
+         cells * (long) sizeof(float));
+  if (grid->q_error == 0) {
+    printf("exact: no visibility answer can change\n");
+  } else {
+    printf("visibility answers decided by more than %g in gradient can not "
+           "change; at tolerance %g the grid is %s\n", 4 * grid->q_error,
+           tolerance, grid_quantize_safe(grid, tolerance) ? "safe" : "not safe");
+  }
+
+  if (argc > 4) {
+    if (!(out_file = fopen(argv[4], "w"))) {
+      fprintf(stderr, "Cannot open %s for writing\n", argv[4]);
+      return 1;
+    }
+    grid_write(out_file, grid);
+    fclose(out_file);
+  }
+  grid_free(grid);
+  return 0;
+}
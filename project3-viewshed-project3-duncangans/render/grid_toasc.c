@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include "gridio.h"
+
+// Convert a binary grid back to an asc grid. See gridio.h for the format.
+int main(int argc, char** argv) {
+  FILE* in_file;
+  FILE* out_file;
+  GridioHeader header;
+  size_t map_size;
+  float* cells;
+
+  // parse and validate command line parameters
+  if (argc != 3) {
+    fprintf(stderr, "Usage: grid_toasc <in-file> <out-file>\n");
+    return 1;
+  }
+  if (!(in_file = fopen(argv[1], "r"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[1]);
+    return 1;
+  }
+  if (!(out_file = fopen(argv[2], "w"))) {
+    fprintf(stderr, "Cannot open %s for writing\n", argv[2]);
+    return 1;
+  }
+
+  // read and write, keeping the header in double precision
+  if (!(cells = gridio_read(in_file, &header, &map_size, 0))) {
+    return 1;
+  }
+  gridio_write_asc(out_file, &header, cells, 0);
+  gridio_free(cells, map_size);
+  fclose(out_file);
+
+  return 0;
+}
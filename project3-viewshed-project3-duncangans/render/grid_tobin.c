@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include "gridio.h"
+
+// Convert an asc grid to a binary grid, which tools can then map instead of
+// parse. See gridio.h for the format. The cells are float32 unless another
+// dtype is asked for; int16 and uint16 halve the size of the grid, and are
+// only written if every cell, nodata included, is a whole number in range.
+int main(int argc, char** argv) {
+  FILE* in_file;
+  FILE* out_file;
+  GridioHeader header;
+  size_t map_size;
+  float* cells;
+  int dtype = GRIDIO_DTYPE_FLOAT32;
+  long inexact;
+
+  // parse and validate command line parameters
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: grid_tobin <in-file> <out-file> [float32|int16|uint16|float64]\n");
+    return 1;
+  }
+  if (argc == 4 && !(dtype = gridio_dtype_named(argv[3]))) {
+    fprintf(stderr, "Unknown dtype %s\n", argv[3]);
+    return 1;
+  }
+  if (!(in_file = fopen(argv[1], "r"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[1]);
+    return 1;
+  }
+
+  // read and write, keeping the header in double precision
+  if (!(cells = gridio_read(in_file, &header, &map_size, 0))) {
+    return 1;
+  }
+  inexact = gridio_count_inexact(cells, (size_t) header.nrows * header.ncols, dtype);
+  if (inexact > 0) {
+    fprintf(stderr, "%ld cells are not whole numbers in the range of %s\n",
+            inexact, argv[3]);
+    return 1;
+  }
+  if (!(out_file = fopen(argv[2], "wb"))) {
+    fprintf(stderr, "Cannot open %s for writing\n", argv[2]);
+    return 1;
+  }
+  gridio_write_bin_typed(out_file, &header, cells, dtype);
+  gridio_free(cells, map_size);
+  fclose(out_file);
+
+  return 0;
+}
@@ -0,0 +1,925 @@
+/* Fast reading of asc grid files, shared by the viewshed and the render tools.
+ *
+ * The file is mapped into memory and its body is cut into one chunk per
+ * thread, each starting at the beginning of a line. A first pass counts the
+ * values in every chunk, so that a second pass knows where in the grid each
+ * chunk's values go and can convert them all in parallel. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gridio.h"
+
+// Chunks smaller than this are not worth a thread of their own.
+#define GRIDIO_MIN_CHUNK (1 << 20)
+
+// The longest token copied out for strtof.
+#define GRIDIO_MAX_TOKEN 64
+
+// Chunks of output are formatted this many bytes at a time.
+#define GRIDIO_WRITE_CHUNK (1 << 20)
+
+// Powers of ten that are exact in a float.
+static const float gridio_pow10[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+// One chunk of the file body and what the passes learn about it.
+typedef struct gridio_chunk_t {
+  const char* begin;
+  const char* end;
+  long        ntokens;     // values in the chunk
+  long        nlines;      // lines in the chunk, blank ones included
+  long        nragged;     // non-blank lines that do not hold ncols values
+  long        first_ragged;// line of the first ragged line in the chunk, or -1
+  long        first_value; // index in the grid of the chunk's first value
+  long        bad_value;   // index of the first value that is not a number, or -1
+  float       min_value;   // range of the chunk's values that are not nodata
+  float       max_value;
+  float       nodata_value;
+  int         ncols;
+  float*      data;
+  long        ncells;
+} GridioChunk;
+
+// One thread's share of the rows being written, and the text they make.
+typedef struct gridio_writer_t {
+  GridioRowFormatter format_row;
+  void*              arg;
+  int                first_row;
+  int                end_row;
+  char*              buf;
+  size_t             len;
+} GridioWriter;
+
+static inline int gridio_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// Returns the number of threads to read with: one per online processor.
+int gridio_default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int) n;
+}
+
+// Parses the token [p, end) as a float, with the same result as strtof. Short
+// decimals, which are nearly all of the values in a DEM, take a fast path: the
+// digits and the power of ten are both exact in a float, so the one division
+// is correctly rounded. Anything else goes to strtof. Returns 1 if the token is
+// a number.
+static int gridio_parse_float(const char* p, const char* end, float* val) {
+  const char* s = p;
+  int neg = 0, ndigits = 0, exp10 = 0;
+  uint32_t mant = 0;
+
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = (*s == '-');
+    s++;
+  }
+  for (; s < end && *s >= '0' && *s <= '9'; s++, ndigits++) {
+    mant = mant * 10 + (*s - '0');
+    if (mant >= (1 << 24)) goto slow;
+  }
+  if (s < end && *s == '.') {
+    for (s++; s < end && *s >= '0' && *s <= '9'; s++, ndigits++, exp10--) {
+      mant = mant * 10 + (*s - '0');
+      if (mant >= (1 << 24)) goto slow;
+    }
+  }
+  if (s != end || ndigits == 0 || exp10 < -10) goto slow;
+  *val = (float) mant / gridio_pow10[-exp10];
+  if (neg) *val = -*val;
+  return 1;
+
+ slow:;
+  char token[GRIDIO_MAX_TOKEN];
+  char* stop;
+  size_t len = end - p;
+  if (len >= GRIDIO_MAX_TOKEN) return 0;
+  memcpy(token, p, len);
+  token[len] = '\0';
+  *val = strtof(token, &stop);
+  return stop == token + len;
+}
+
+// Parses the header of an asc file: lines holding a keyword and a number.
+// Returns a pointer to the first cell value, or NULL if ncols or nrows is
+// missing. *nlines is set to the number of header lines.
+static const char* gridio_parse_header(const char* p, const char* end,
+                                       GridioHeader* header, long* nlines) {
+  int have_cols = 0, have_rows = 0;
+  *nlines = 0;
+  header->xllcorner = 0;
+  header->yllcorner = 0;
+  header->cellsize = 1;
+  header->nodata_value = -9999;
+
+  while (1) {
+    const char* line = p;
+    while (p < end && gridio_is_space(*p)) {
+      if (*p == '\n') (*nlines)++;
+      p++;
+    }
+    if (p == end || !((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) {
+      // the header ends where the values begin; they start on a fresh line
+      if (p != line) {
+        while (p > line && p[-1] != '\n') p--;
+      }
+      break;
+    }
+    char key[GRIDIO_MAX_TOKEN], value[GRIDIO_MAX_TOKEN];
+    size_t n = 0;
+    for (; p < end && !gridio_is_space(*p); p++) {
+      if (n < GRIDIO_MAX_TOKEN - 1) key[n++] = *p;
+    }
+    key[n] = '\0';
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    for (n = 0; p < end && !gridio_is_space(*p); p++) {
+      if (n < GRIDIO_MAX_TOKEN - 1) value[n++] = *p;
+    }
+    value[n] = '\0';
+    double v = strtod(value, NULL);
+
+    if (strcasecmp(key, "ncols") == 0) {
+      header->ncols = (int) v;
+      have_cols = 1;
+    } else if (strcasecmp(key, "nrows") == 0) {
+      header->nrows = (int) v;
+      have_rows = 1;
+    } else if (strcasecmp(key, "xllcorner") == 0 ||
+               strcasecmp(key, "xllcenter") == 0) {
+      header->xllcorner = v;
+    } else if (strcasecmp(key, "yllcorner") == 0 ||
+               strcasecmp(key, "yllcenter") == 0) {
+      header->yllcorner = v;
+    } else if (strcasecmp(key, "cellsize") == 0) {
+      header->cellsize = v;
+    } else if (strcasecmp(key, "nodata_value") == 0) {
+      header->nodata_value = v;
+    }
+  }
+  return (have_cols && have_rows) ? p : NULL;
+}
+
+// First pass over a chunk: counts its values and lines, and notes lines that
+// do not hold a full row.
+static void* gridio_count_chunk(void* arg) {
+  GridioChunk* chunk = arg;
+  const char* p = chunk->begin;
+  long line_tokens = 0;
+  int in_token = 0;
+
+  chunk->ntokens = chunk->nlines = chunk->nragged = 0;
+  chunk->first_ragged = -1;
+  for (; p < chunk->end; p++) {
+    if (gridio_is_space(*p)) {
+      in_token = 0;
+      if (*p == '\n') {
+        if (line_tokens != 0 && line_tokens != chunk->ncols) {
+          if (chunk->first_ragged < 0) chunk->first_ragged = chunk->nlines;
+          chunk->nragged++;
+        }
+        chunk->nlines++;
+        line_tokens = 0;
+      }
+    } else if (!in_token) {
+      in_token = 1;
+      line_tokens++;
+      chunk->ntokens++;
+    }
+  }
+  // a last line without a newline
+  if (line_tokens != 0) {
+    if (line_tokens != chunk->ncols) {
+      if (chunk->first_ragged < 0) chunk->first_ragged = chunk->nlines;
+      chunk->nragged++;
+    }
+    chunk->nlines++;
+  }
+  return NULL;
+}
+
+// Second pass over a chunk: converts its values into their place in the grid.
+static void* gridio_parse_chunk(void* arg) {
+  GridioChunk* chunk = arg;
+  const char* p = chunk->begin;
+  long i = chunk->first_value;
+
+  chunk->bad_value = -1;
+  chunk->min_value = INFINITY;
+  chunk->max_value = -INFINITY;
+  while (i < chunk->ncells) {
+    while (p < chunk->end && gridio_is_space(*p)) p++;
+    if (p == chunk->end) break;
+    const char* token = p;
+    while (p < chunk->end && !gridio_is_space(*p)) p++;
+    float val = 0;
+    if (!gridio_parse_float(token, p, &val) && chunk->bad_value < 0) {
+      chunk->bad_value = i;
+    }
+    chunk->data[i++] = val;
+    if (val != chunk->nodata_value) {
+      chunk->min_value = val < chunk->min_value ? val : chunk->min_value;
+      chunk->max_value = val > chunk->max_value ? val : chunk->max_value;
+    }
+  }
+  return NULL;
+}
+
+// Runs fn over each of the n items of the given size, a thread each.
+static void gridio_run(void* (*fn)(void*), void* items, size_t size, int n) {
+  pthread_t threads[n];
+  int started[n];
+  int t;
+  for (t = 1; t < n; t++) {
+    void* item = (char*) items + t * size;
+    started[t] = pthread_create(&threads[t], NULL, fn, item) == 0;
+    if (!started[t]) fn(item);
+  }
+  fn(items);
+  for (t = 1; t < n; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+  }
+}
+
+// Reads the rest of a stream that cannot be mapped, e.g. a pipe, into memory.
+static char* gridio_slurp(FILE* in_file, size_t* size) {
+  size_t cap = 1 << 20, n = 0, got;
+  char* text = malloc(cap);
+  if (!text) return NULL;
+  while ((got = fread(text + n, 1, cap - n, in_file)) > 0) {
+    n += got;
+    if (n == cap) {
+      char* bigger = realloc(text, cap *= 2);
+      if (!bigger) {
+        free(text);
+        return NULL;
+      }
+      text = bigger;
+    }
+  }
+  *size = n;
+  return text;
+}
+
+// Returns the cells of the asc grid read from in_file, in row-major order, in
+// one malloced block, and fills in header, the range of the values included.
+// The file is read from its current position, with nthreads threads (0 for
+// one per processor). Lines that do not hold a full row are reported but
+// tolerated: the values are taken in order.
+// Returns NULL, after saying why on stderr, if the grid cannot be read.
+float* gridio_read_asc(FILE* in_file, GridioHeader* header, int nthreads) {
+  struct stat st;
+  char* map = NULL;
+  size_t map_size = 0;
+  const char* text;
+  size_t size;
+  long offset = ftell(in_file);
+  if (offset < 0) offset = 0;
+
+  // map the file if it is a regular one, otherwise read it all in
+  if (fstat(fileno(in_file), &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > offset) {
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fileno(in_file), 0);
+    if (map == MAP_FAILED) map = NULL;
+  }
+  char* slurped = NULL;
+  if (map) {
+    madvise(map, map_size, MADV_WILLNEED);
+    text = map + offset;
+    size = map_size - offset;
+  } else {
+    slurped = gridio_slurp(in_file, &size);
+    if (!slurped) {
+      fprintf(stderr, "gridio: cannot read grid\n");
+      return NULL;
+    }
+    text = slurped;
+  }
+  const char* end = text + size;
+
+  long header_lines;
+  float* data = NULL;
+  GridioChunk* chunks = NULL;
+  const char* body = gridio_parse_header(text, end, header, &header_lines);
+  if (!body || header->nrows <= 0 || header->ncols <= 0) {
+    fprintf(stderr, "gridio: no ncols and nrows in grid header\n");
+    goto done;
+  }
+  long ncells = (long) header->nrows * header->ncols;
+  data = malloc(ncells * sizeof(float));
+  if (!data) {
+    fprintf(stderr, "gridio: cannot allocate %ld cells\n", ncells);
+    goto done;
+  }
+
+  // cut the body into chunks that start on a new line
+  if (nthreads <= 0) nthreads = gridio_default_threads();
+  long nchunks = (end - body) / GRIDIO_MIN_CHUNK + 1;
+  if (nchunks > nthreads) nchunks = nthreads;
+  chunks = malloc(nchunks * sizeof(GridioChunk));
+  if (!chunks) {
+    free(data);
+    data = NULL;
+    goto done;
+  }
+  const char* p = body;
+  int t;
+  for (t = 0; t < nchunks; t++) {
+    chunks[t].begin = p;
+    p = body + (end - body) * (t + 1) / nchunks;
+    if (p < chunks[t].begin) p = chunks[t].begin;
+    while (p < end && p > chunks[t].begin && p[-1] != '\n') p++;
+    chunks[t].end = p;
+    chunks[t].ncols = header->ncols;
+    chunks[t].data = data;
+    chunks[t].ncells = ncells;
+    chunks[t].nodata_value = header->nodata_value;
+  }
+  chunks[nchunks - 1].end = end;
+
+  gridio_run(gridio_count_chunk, chunks, sizeof(GridioChunk), nchunks);
+
+  // each chunk's values follow those of the chunks before it
+  long ntokens = 0, nlines = 0, nragged = 0, first_ragged = -1;
+  for (t = 0; t < nchunks; t++) {
+    chunks[t].first_value = ntokens;
+    if (first_ragged < 0 && chunks[t].first_ragged >= 0) {
+      first_ragged = nlines + chunks[t].first_ragged;
+    }
+    ntokens += chunks[t].ntokens;
+    nlines += chunks[t].nlines;
+    nragged += chunks[t].nragged;
+  }
+  if (ntokens < ncells) {
+    fprintf(stderr, "gridio: expected %ld values, found %ld\n", ncells, ntokens);
+    free(data);
+    data = NULL;
+    goto done;
+  }
+  if (nragged > 0) {
+    fprintf(stderr, "gridio: warning: %ld of %ld lines do not hold %d values "
+            "(first at line %ld); reading the values in order\n",
+            nragged, nlines, header->ncols, header_lines + first_ragged + 1);
+  }
+  if (ntokens > ncells) {
+    fprintf(stderr, "gridio: warning: ignoring %ld values past the last row\n",
+            ntokens - ncells);
+  }
+
+  gridio_run(gridio_parse_chunk, chunks, sizeof(GridioChunk), nchunks);
+
+  header->min_value = INFINITY;
+  header->max_value = -INFINITY;
+  for (t = 0; t < nchunks; t++) {
+    if (chunks[t].min_value < header->min_value) {
+      header->min_value = chunks[t].min_value;
+    }
+    if (chunks[t].max_value > header->max_value) {
+      header->max_value = chunks[t].max_value;
+    }
+    if (chunks[t].bad_value >= 0) {
+      fprintf(stderr, "gridio: value %ld (row %ld, col %ld) is not a number\n",
+              chunks[t].bad_value, chunks[t].bad_value / header->ncols,
+              chunks[t].bad_value % header->ncols);
+      free(data);
+      data = NULL;
+      break;
+    }
+  }
+
+ done:
+  free(chunks);
+  if (map) munmap(map, map_size);
+  free(slurped);
+  return data;
+}
+
+// Returns 1 if in_file, from its current position, holds a binary grid. Only
+// a regular file is looked at, with pread, so the stream is left as it was.
+int gridio_is_bin(FILE* in_file) {
+  char magic[4];
+  long offset = ftell(in_file);
+  if (offset < 0) return 0;
+  return pread(fileno(in_file), magic, 4, offset) == 4 &&
+         memcmp(magic, GRIDIO_BIN_MAGIC, 4) == 0;
+}
+
+// Returns the size in bytes of a cell of dtype, or 0 if there is no such
+// dtype.
+size_t gridio_dtype_size(int dtype) {
+  switch (dtype) {
+    case GRIDIO_DTYPE_FLOAT32: return sizeof(float);
+    case GRIDIO_DTYPE_INT16:   return sizeof(int16_t);
+    case GRIDIO_DTYPE_UINT16:  return sizeof(uint16_t);
+    case GRIDIO_DTYPE_FLOAT64: return sizeof(double);
+  }
+  return 0;
+}
+
+// Returns the dtype called name (float32, int16, uint16 or float64), or 0 if
+// there is none.
+int gridio_dtype_named(const char* name) {
+  if (strcmp(name, "float32") == 0) return GRIDIO_DTYPE_FLOAT32;
+  if (strcmp(name, "int16") == 0)   return GRIDIO_DTYPE_INT16;
+  if (strcmp(name, "uint16") == 0)  return GRIDIO_DTYPE_UINT16;
+  if (strcmp(name, "float64") == 0) return GRIDIO_DTYPE_FLOAT64;
+  return 0;
+}
+
+// Converts n cells of dtype to floats.
+static void gridio_to_floats(const void* cells, int dtype, size_t n, float* vals) {
+  size_t i;
+  switch (dtype) {
+    case GRIDIO_DTYPE_FLOAT32:
+      memcpy(vals, cells, n * sizeof(float));
+      break;
+    case GRIDIO_DTYPE_INT16:
+      for (i = 0; i < n; i++) vals[i] = ((const int16_t*) cells)[i];
+      break;
+    case GRIDIO_DTYPE_UINT16:
+      for (i = 0; i < n; i++) vals[i] = ((const uint16_t*) cells)[i];
+      break;
+    case GRIDIO_DTYPE_FLOAT64:
+      for (i = 0; i < n; i++) vals[i] = ((const double*) cells)[i];
+      break;
+  }
+}
+
+// Converts n floats to cells of dtype. Values that do not fit are rounded and
+// clamped; gridio_count_inexact says how many there are.
+static void gridio_from_floats(const float* vals, int dtype, size_t n, void* cells) {
+  size_t i;
+  switch (dtype) {
+    case GRIDIO_DTYPE_FLOAT32:
+      memcpy(cells, vals, n * sizeof(float));
+      break;
+    case GRIDIO_DTYPE_INT16:
+      for (i = 0; i < n; i++) {
+        ((int16_t*) cells)[i] = lrintf(fminf(fmaxf(vals[i], INT16_MIN), INT16_MAX));
+      }
+      break;
+    case GRIDIO_DTYPE_UINT16:
+      for (i = 0; i < n; i++) {
+        ((uint16_t*) cells)[i] = lrintf(fminf(fmaxf(vals[i], 0), UINT16_MAX));
+      }
+      break;
+    case GRIDIO_DTYPE_FLOAT64:
+      for (i = 0; i < n; i++) ((double*) cells)[i] = vals[i];
+      break;
+  }
+}
+
+// Returns how many of the n cells would not be kept exactly as dtype: for the
+// 16 bit dtypes, values that are not whole numbers or are out of range.
+long gridio_count_inexact(const float* cells, size_t n, int dtype) {
+  long inexact = 0;
+  size_t i;
+  float lo = dtype == GRIDIO_DTYPE_INT16 ? INT16_MIN : 0;
+  float hi = dtype == GRIDIO_DTYPE_INT16 ? INT16_MAX : UINT16_MAX;
+  if (dtype != GRIDIO_DTYPE_INT16 && dtype != GRIDIO_DTYPE_UINT16) return 0;
+  for (i = 0; i < n; i++) {
+    if (cells[i] != rintf(cells[i]) || cells[i] < lo || cells[i] > hi) inexact++;
+  }
+  return inexact;
+}
+
+// Returns the cells of the binary grid in in_file, mapped in place rather
+// than read, as they are stored, and fills in header and *dtype. The mapping
+// is private: cells may be changed without touching the file, and only the
+// pages changed are copied. *map_size is set to what gridio_free needs to
+// unmap it. Returns NULL, after saying why on stderr, if the grid cannot be
+// mapped.
+void* gridio_map_bin(FILE* in_file, GridioHeader* header, int* dtype,
+                     size_t* map_size) {
+  GridioBinHeader bin;
+  struct stat st;
+  long offset = ftell(in_file);
+  int fd = fileno(in_file);
+
+  if (offset < 0 || pread(fd, &bin, sizeof(bin), offset) != sizeof(bin) ||
+      memcmp(bin.magic, GRIDIO_BIN_MAGIC, 4) != 0) {
+    fprintf(stderr, "gridio: not a binary grid\n");
+    return NULL;
+  }
+  if (bin.version != GRIDIO_BIN_VERSION ||
+      bin.byte_order != GRIDIO_BIN_BYTE_ORDER ||
+      gridio_dtype_size(bin.dtype) == 0 ||
+      bin.data_offset != GRIDIO_BIN_DATA_OFFSET) {
+    fprintf(stderr, "gridio: binary grid version %d, dtype %d is not one "
+            "this build can map\n", bin.version, bin.dtype);
+    return NULL;
+  }
+  if (offset != 0) {
+    fprintf(stderr, "gridio: a binary grid is mapped from the start of its file\n");
+    return NULL;
+  }
+  size_t size = bin.data_offset +
+                (size_t) bin.nrows * bin.ncols * gridio_dtype_size(bin.dtype);
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < size) {
+    fprintf(stderr, "gridio: binary grid is cut short\n");
+    return NULL;
+  }
+  char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "gridio: cannot map binary grid\n");
+    return NULL;
+  }
+
+  header->ncols =        bin.ncols;
+  header->nrows =        bin.nrows;
+  header->xllcorner =    bin.xllcorner;
+  header->yllcorner =    bin.yllcorner;
+  header->cellsize =     bin.cellsize;
+  header->nodata_value = bin.nodata_value;
+  header->min_value =    bin.min_value;
+  header->max_value =    bin.max_value;
+  *dtype = bin.dtype;
+  *map_size = size;
+  return map + bin.data_offset;
+}
+
+// Writes header and the nrows * ncols cells as a binary grid of float32.
+void gridio_write_bin(FILE* out_file, GridioHeader* header, const float* cells) {
+  gridio_write_bin_typed(out_file, header, cells, GRIDIO_DTYPE_FLOAT32);
+}
+
+// Writes header and the nrows * ncols cells as a binary grid of dtype,
+// converted a row at a time. Check gridio_count_inexact first if the cells
+// must be kept exactly.
+void gridio_write_bin_typed(FILE* out_file, GridioHeader* header,
+                            const float* cells, int dtype) {
+  static const char pad[GRIDIO_BIN_DATA_OFFSET];
+  GridioBinHeader bin;
+  size_t size = gridio_dtype_size(dtype);
+  int r;
+  assert(size);
+  memset(&bin, 0, sizeof(bin));
+  memcpy(bin.magic, GRIDIO_BIN_MAGIC, 4);
+  bin.version =      GRIDIO_BIN_VERSION;
+  bin.byte_order =   GRIDIO_BIN_BYTE_ORDER;
+  bin.dtype =        dtype;
+  bin.data_offset =  GRIDIO_BIN_DATA_OFFSET;
+  bin.ncols =        header->ncols;
+  bin.nrows =        header->nrows;
+  bin.xllcorner =    header->xllcorner;
+  bin.yllcorner =    header->yllcorner;
+  bin.cellsize =     header->cellsize;
+  bin.nodata_value = header->nodata_value;
+  bin.min_value =    header->min_value;
+  bin.max_value =    header->max_value;
+  fwrite(&bin, sizeof(bin), 1, out_file);
+  fwrite(pad, 1, GRIDIO_BIN_DATA_OFFSET - sizeof(bin), out_file);
+  if (dtype == GRIDIO_DTYPE_FLOAT32) {
+    fwrite(cells, sizeof(float), (size_t) header->nrows * header->ncols, out_file);
+    return;
+  }
+  char* row = malloc(header->ncols * size);
+  assert(row);
+  for (r = 0; r < header->nrows; r++) {
+    gridio_from_floats(cells + (size_t) r * header->ncols, dtype, header->ncols, row);
+    fwrite(row, size, header->ncols, out_file);
+  }
+  free(row);
+}
+
+// Returns the cells of the grid in in_file, binary or asc, as they are
+// stored, and fills in header and *dtype. A binary grid is mapped and
+// *map_size set to the size of the mapping; an asc grid is read into memory
+// as float32 and *map_size set to 0. Either way the cells are let go of with
+// gridio_free.
+void* gridio_read_typed(FILE* in_file, GridioHeader* header, int* dtype,
+                        size_t* map_size, int nthreads) {
+  if (gridio_is_bin(in_file)) {
+    return gridio_map_bin(in_file, header, dtype, map_size);
+  }
+  *map_size = 0;
+  *dtype = GRIDIO_DTYPE_FLOAT32;
+  return gridio_read_asc(in_file, header, nthreads);
+}
+
+// Returns the cells of the grid in in_file as floats, as gridio_read_typed
+// does. A binary grid of another dtype is converted into memory, and
+// *map_size set to 0.
+float* gridio_read(FILE* in_file, GridioHeader* header, size_t* map_size,
+                   int nthreads) {
+  int dtype;
+  void* cells = gridio_read_typed(in_file, header, &dtype, map_size, nthreads);
+  if (!cells || dtype == GRIDIO_DTYPE_FLOAT32) return cells;
+  size_t n = (size_t) header->nrows * header->ncols;
+  float* vals = malloc(n * sizeof(float));
+  assert(vals);
+  gridio_to_floats(cells, dtype, n, vals);
+  gridio_free(cells, *map_size);
+  *map_size = 0;
+  return vals;
+}
+
+// Frees cells returned by gridio_read or gridio_read_typed.
+void gridio_free(void* cells, size_t map_size) {
+  if (map_size) {
+    munmap((char*) cells - GRIDIO_BIN_DATA_OFFSET, map_size);
+  } else {
+    free(cells);
+  }
+}
+
+// Writes the cell value v into p, followed by a space, in the fewest digits
+// that strtof reads back as exactly v. Whole numbers are written as integers.
+// Other values are tried with 1, 2, ... decimals while the digits stay exact
+// in a float, which is the same exact case the reader's fast path relies on,
+// and only then fall back to printf, as do values too small to write without
+// an exponent. Returns the end of what was written. p must hold
+// GRIDIO_FLOAT_CHARS.
+char* gridio_format_float(char* p, float v) {
+  if (signbit(v) && !isnan(v)) {
+    *p++ = '-';
+    v = -v;
+  }
+  float whole = floorf(v);
+  if (whole == v && v < (1 << 24)) {
+    char digits[12];
+    int n = 0;
+    uint32_t u = (uint32_t) v;
+    do {
+      digits[n++] = '0' + u % 10;
+      u /= 10;
+    } while (u);
+    while (n) *p++ = digits[--n];
+    *p++ = ' ';
+    return p;
+  }
+  int d = v < 1e-3f ? 11 : 1;
+  for (; d <= 10 && (double) v * gridio_pow10[d] < (1 << 24); d++) {
+    uint32_t scaled = (uint32_t) lrint((double) v * gridio_pow10[d]);
+    if ((float) scaled / gridio_pow10[d] != v) continue;
+    char digits[12];
+    int n = 0;
+    for (; n < d || scaled; n++) {
+      digits[n] = '0' + scaled % 10;
+      scaled /= 10;
+    }
+    if (n == d) digits[n++] = '0';
+    while (n > d) *p++ = digits[--n];
+    *p++ = '.';
+    while (n) *p++ = digits[--n];
+    *p++ = ' ';
+    return p;
+  }
+  int prec;
+  for (prec = 6; prec < 9; prec++) {
+    char* end;
+    int n = sprintf(p, "%.*g", prec, v);
+    if (strtof(p, &end) == v) {
+      p[n] = ' ';
+      return p + n + 1;
+    }
+  }
+  p += sprintf(p, "%.9g ", v);
+  return p;
+}
+
+// Formats a row of ncols values into buf, as the asc writers have always laid
+// them out: each value followed by a space, and a newline at the end. buf must
+// hold GRIDIO_FLOAT_CHARS per value and one more byte. Returns the length.
+size_t gridio_format_floats(char* buf, const float* vals, int ncols) {
+  char* p = buf;
+  int c;
+  for (c = 0; c < ncols; c++) {
+    p = gridio_format_float(p, vals[c]);
+  }
+  *p++ = '\n';
+  return p - buf;
+}
+
+// Formats a row of ncols bits, lowest bit of bits[0] first, as 0s and 1s in the
+// same layout. buf must hold GRIDIO_BIT_CHARS per value and one more byte.
+size_t gridio_format_bits(char* buf, const uint64_t* bits, int ncols) {
+  char* p = buf;
+  int c;
+  for (c = 0; c < ncols; c++) {
+    p[0] = '0' + ((bits[c >> 6] >> (c & 63)) & 1);
+    p[1] = ' ';
+    p += 2;
+  }
+  *p++ = '\n';
+  return p - buf;
+}
+
+// Row-major cells being written by gridio_write_asc.
+typedef struct gridio_cells_t {
+  const float* cells;
+  int          ncols;
+} GridioCells;
+
+// Formats row r of a GridioCells.
+static size_t gridio_format_cells_row(void* arg, int r, char* buf) {
+  GridioCells* rows = arg;
+  return gridio_format_floats(buf, rows->cells + (long) r * rows->ncols,
+                              rows->ncols);
+}
+
+// Formats one thread's rows into its buffer.
+static void* gridio_format_rows(void* arg) {
+  GridioWriter* writer = arg;
+  int r;
+  writer->len = 0;
+  for (r = writer->first_row; r < writer->end_row; r++) {
+    writer->len += writer->format_row(writer->arg, r, writer->buf + writer->len);
+  }
+  return NULL;
+}
+
+// Writes nrows rows to out_file, each formatted by format_row(arg, r, buf) into
+// at most row_bytes. nthreads threads (0 for one per processor) each format a
+// run of rows into their own buffer, and the buffers are then written in order,
+// one large write each, before the next runs are formatted.
+void gridio_write_rows(FILE* out_file, int nrows, size_t row_bytes,
+                       GridioRowFormatter format_row, void* arg, int nthreads) {
+  if (nthreads <= 0) nthreads = gridio_default_threads();
+  int rows_per_chunk = GRIDIO_WRITE_CHUNK / row_bytes;
+  if (rows_per_chunk < 1) rows_per_chunk = 1;
+  GridioWriter writers[nthreads];
+  int t, r = 0;
+  for (t = 0; t < nthreads; t++) {
+    writers[t].format_row = format_row;
+    writers[t].arg = arg;
+    writers[t].buf = malloc(rows_per_chunk * row_bytes);
+    assert(writers[t].buf);
+  }
+  while (r < nrows) {
+    int n;
+    for (n = 0; n < nthreads && r < nrows; n++) {
+      writers[n].first_row = r;
+      r = r + rows_per_chunk < nrows ? r + rows_per_chunk : nrows;
+      writers[n].end_row = r;
+    }
+    gridio_run(gridio_format_rows, writers, sizeof(GridioWriter), n);
+    for (t = 0; t < n; t++) {
+      fwrite(writers[t].buf, 1, writers[t].len, out_file);
+    }
+  }
+  for (t = 0; t < nthreads; t++) {
+    free(writers[t].buf);
+  }
+}
+
+// Formats v in the fewest digits, up to 17, that strtod reads back as v.
+static void gridio_format_double(char* buf, double v) {
+  int prec;
+  for (prec = 10; prec < 17; prec++) {
+    sprintf(buf, "%.*g", prec, v);
+    if (strtod(buf, NULL) == v) return;
+  }
+  sprintf(buf, "%.17g", v);
+}
+
+// Writes the header of an asc grid, each number in the fewest digits that
+// read back the same.
+void gridio_write_asc_header(FILE* out_file, GridioHeader* header) {
+  char num[32];
+  fprintf(out_file, "ncols %d\n", header->ncols);
+  fprintf(out_file, "nrows %d\n", header->nrows);
+  gridio_format_double(num, header->xllcorner);
+  fprintf(out_file, "xllcorner %s\n", num);
+  gridio_format_double(num, header->yllcorner);
+  fprintf(out_file, "yllcorner %s\n", num);
+  gridio_format_double(num, header->cellsize);
+  fprintf(out_file, "cellsize %s\n", num);
+  gridio_format_double(num, header->nodata_value);
+  fprintf(out_file, "NODATA_value %s\n", num);
+}
+
+// Writes header and the nrows * ncols cells as an asc grid, the values
+// formatted by nthreads threads (0 for one per processor).
+void gridio_write_asc(FILE* out_file, GridioHeader* header, const float* cells,
+                      int nthreads) {
+  gridio_write_asc_header(out_file, header);
+  GridioCells rows = {cells, header->ncols};
+  gridio_write_rows(out_file, header->nrows,
+                    (size_t) header->ncols * GRIDIO_FLOAT_CHARS + 1,
+                    gridio_format_cells_row, &rows, nthreads);
+}
+
+// Opens in_file, asc or binary, to be read a row at a time by
+// gridio_read_row, for grids too big to hold. Only the header is read here.
+// The min and max of an asc grid are not known until it has all been read,
+// so they are left 0. Returns 0, after saying why on stderr, if the grid
+// cannot be read this way.
+int gridio_open_rows(FILE* in_file, GridioRows* rows) {
+  char line[GRIDIO_MAX_TOKEN * 4];
+  char text[GRIDIO_MAX_TOKEN * 64];
+  size_t len = 0;
+  long nlines;
+  rows->in_file = in_file;
+  rows->row = 0;
+  rows->bin = gridio_is_bin(in_file);
+  memset(&rows->header, 0, sizeof(rows->header));
+
+  if (rows->bin) {
+    GridioBinHeader bin;
+    if (fread(&bin, sizeof(bin), 1, in_file) != 1 ||
+        bin.version != GRIDIO_BIN_VERSION ||
+        bin.byte_order != GRIDIO_BIN_BYTE_ORDER ||
+        gridio_dtype_size(bin.dtype) == 0 ||
+        fseek(in_file, bin.data_offset - sizeof(bin), SEEK_CUR) != 0) {
+      fprintf(stderr, "gridio: binary grid version %d, dtype %d is not one "
+              "this build can read\n", bin.version, bin.dtype);
+      return 0;
+    }
+    rows->header.ncols =        bin.ncols;
+    rows->header.nrows =        bin.nrows;
+    rows->header.xllcorner =    bin.xllcorner;
+    rows->header.yllcorner =    bin.yllcorner;
+    rows->header.cellsize =     bin.cellsize;
+    rows->header.nodata_value = bin.nodata_value;
+    rows->header.min_value =    bin.min_value;
+    rows->header.max_value =    bin.max_value;
+    rows->dtype = bin.dtype;
+    return 1;
+  }
+
+  // the header is every line up to the first that does not start with a
+  // keyword, which is read again as the first row
+  while (1) {
+    long start = ftell(in_file);
+    if (start < 0) {
+      fprintf(stderr, "gridio: an asc grid read by rows must be a file\n");
+      return 0;
+    }
+    if (!fgets(line, sizeof(line), in_file)) break;
+    const char* p = line;
+    while (gridio_is_space(*p)) p++;
+    if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) {
+      fseek(in_file, start, SEEK_SET);
+      break;
+    }
+    size_t n = strlen(line);
+    if (len + n >= sizeof(text)) break;
+    memcpy(text + len, line, n);
+    len += n;
+  }
+  if (!gridio_parse_header(text, text + len, &rows->header, &nlines) ||
+      rows->header.nrows <= 0 || rows->header.ncols <= 0) {
+    fprintf(stderr, "gridio: no ncols and nrows in grid header\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Reads the next row of a grid opened by gridio_open_rows into vals, ncols
+// values. The values of an asc grid are read in order whatever lines they
+// are on. Returns 0, after saying why on stderr, if the grid runs out or
+// holds something that is not a number.
+int gridio_read_row(GridioRows* rows, float* vals) {
+  int ncols = rows->header.ncols;
+  FILE* in_file = rows->in_file;
+  int c;
+  if (rows->row >= rows->header.nrows) return 0;
+  if (rows->bin) {
+    // cells of other dtypes are read as they are and then converted
+    size_t size = gridio_dtype_size(rows->dtype);
+    int convert = rows->dtype != GRIDIO_DTYPE_FLOAT32;
+    void* cells = convert ? malloc(ncols * size) : vals;
+    assert(cells);
+    if (fread(cells, size, ncols, in_file) != (size_t) ncols) {
+      fprintf(stderr, "gridio: binary grid is cut short at row %d\n", rows->row);
+      if (convert) free(cells);
+      return 0;
+    }
+    if (convert) {
+      gridio_to_floats(cells, rows->dtype, ncols, vals);
+      free(cells);
+    }
+    rows->row++;
+    return 1;
+  }
+  for (c = 0; c < ncols; c++) {
+    char token[GRIDIO_MAX_TOKEN];
+    int n = 0, ch;
+    while ((ch = getc_unlocked(in_file)) != EOF && gridio_is_space(ch)) {}
+    while (ch != EOF && !gridio_is_space(ch)) {
+      if (n < GRIDIO_MAX_TOKEN - 1) token[n++] = ch;
+      ch = getc_unlocked(in_file);
+    }
+    if (n == 0) {
+      fprintf(stderr, "gridio: grid is cut short at row %d\n", rows->row);
+      return 0;
+    }
+    if (!gridio_parse_float(token, token + n, &vals[c])) {
+      fprintf(stderr, "gridio: value (%d, %d) is not a number\n", rows->row, c);
+      return 0;
+    }
+  }
+  rows->row++;
+  return 1;
+}
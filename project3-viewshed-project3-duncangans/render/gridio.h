@@ -0,0 +1,93 @@
+#ifndef __gridio_h
+#define __gridio_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+// The header of an asc grid file.
+typedef struct gridio_header_t {
+  int    ncols;
+  int    nrows;
+  double xllcorner;
+  double yllcorner;
+  double cellsize;
+  double nodata_value;
+  float  min_value;     // smallest and largest value that is not nodata
+  float  max_value;
+} GridioHeader;
+
+// The header of a binary grid file. The cells follow at data_offset, a
+// multiple of the page size, as nrows * ncols values of dtype in row-major
+// order and in the byte order of the machine that wrote them, so that the
+// file can be mapped and used in place. Elevations that are whole numbers in
+// range can be kept in 16 bits, half the size of float32.
+#define GRIDIO_BIN_MAGIC       "GRDB"
+#define GRIDIO_BIN_VERSION     1
+#define GRIDIO_BIN_BYTE_ORDER  0x01020304
+#define GRIDIO_BIN_DATA_OFFSET 4096
+#define GRIDIO_DTYPE_FLOAT32   1
+#define GRIDIO_DTYPE_INT16     2
+#define GRIDIO_DTYPE_UINT16    3
+#define GRIDIO_DTYPE_FLOAT64   4
+
+typedef struct gridio_bin_header_t {
+  char     magic[4];
+  int32_t  version;
+  uint32_t byte_order;
+  int32_t  dtype;
+  int64_t  data_offset;
+  int32_t  ncols;
+  int32_t  nrows;
+  double   xllcorner;
+  double   yllcorner;
+  double   cellsize;
+  double   nodata_value;
+  float    min_value;
+  float    max_value;
+} GridioBinHeader;
+
+// A grid being read a row at a time (see gridio_open_rows).
+typedef struct gridio_rows_t {
+  FILE*        in_file;
+  GridioHeader header;
+  int          bin;     // 1 for a binary grid
+  int          dtype;   // the dtype of a binary grid's cells
+  int          row;     // the row read next
+} GridioRows;
+
+// Formats row r of a grid being written into buf, and returns its length.
+typedef size_t (*GridioRowFormatter)(void* arg, int r, char* buf);
+
+// The most characters a single value takes in a row.
+#define GRIDIO_FLOAT_CHARS 16
+#define GRIDIO_BIT_CHARS   2
+
+int    gridio_default_threads(void);
+float* gridio_read_asc(FILE* in_file, GridioHeader* header, int nthreads);
+int    gridio_is_bin(FILE* in_file);
+size_t gridio_dtype_size(int dtype);
+int    gridio_dtype_named(const char* name);
+void*  gridio_map_bin(FILE* in_file, GridioHeader* header, int* dtype,
+                      size_t* map_size);
+long   gridio_count_inexact(const float* cells, size_t n, int dtype);
+void   gridio_write_bin(FILE* out_file, GridioHeader* header, const float* cells);
+void   gridio_write_bin_typed(FILE* out_file, GridioHeader* header,
+                              const float* cells, int dtype);
+float* gridio_read(FILE* in_file, GridioHeader* header, size_t* map_size,
+                   int nthreads);
+void*  gridio_read_typed(FILE* in_file, GridioHeader* header, int* dtype,
+                         size_t* map_size, int nthreads);
+void   gridio_free(void* cells, size_t map_size);
+char*  gridio_format_float(char* p, float v);
+size_t gridio_format_floats(char* buf, const float* vals, int ncols);
+size_t gridio_format_bits(char* buf, const uint64_t* bits, int ncols);
+void   gridio_write_asc_header(FILE* out_file, GridioHeader* header);
+void   gridio_write_asc(FILE* out_file, GridioHeader* header, const float* cells,
+                        int nthreads);
+void   gridio_write_rows(FILE* out_file, int nrows, size_t row_bytes,
+                         GridioRowFormatter format_row, void* arg, int nthreads);
+
+int    gridio_open_rows(FILE* in_file, GridioRows* rows);
+int    gridio_read_row(GridioRows* rows, float* vals);
+
+#endif
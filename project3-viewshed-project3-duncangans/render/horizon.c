@@ -0,0 +1,280 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "horizon.h"
+#include "gridio.h"
+#include "vis.h"
+#include "utils.h"
+
+// Horizon angles are stored as elevation angles in [-PI/2, PI/2] scaled into
+// 16 bits, about 0.003 degrees a step.
+#define HORIZON_SCALE (32767 / (M_PI / 2))
+
+// A cell at a fixed offset from the one whose horizons are being built, with
+// the sector and band it falls in and 1 / its distance.
+typedef struct horizon_offset_t {
+  int   dr;
+  int   dc;
+  int   slot;           // sector * nbands + band
+  float inv_dist;
+} HorizonOffset;
+
+// What the threads building an index share.
+typedef struct horizon_build_t {
+  Grid*          elev_grid;
+  HorizonIndex*  index;
+  HorizonOffset* offsets;
+  int            noffsets;
+  int            next_row;
+} HorizonBuild;
+
+// Returns the band a distance of d >= 1 cells falls in.
+static int horizon_band(float d) {
+  return floorf(log2f(d) * HORIZON_BANDS_PER_OCTAVE);
+}
+
+// Returns the sector of the angle swept from (v_r, v_c) to (t_r, t_c).
+static int horizon_sector(HorizonIndex* index, int v_r, int v_c, int t_r, int t_c) {
+  float alpha = vis_swept_alpha(v_r, v_c, t_r, t_c);
+  int s = alpha * index->nsectors / (2 * M_PI);
+  return s % index->nsectors;
+}
+
+// Returns an elevation angle in its stored form.
+static int16_t horizon_quantize(float gradient) {
+  return lrintf(atanf(gradient) * HORIZON_SCALE);
+}
+
+// Builds the horizons of the rows a thread takes, one row at a time. The
+// horizon of a cell in each slot is the highest gradient to the cells at the
+// offsets in it, and each band then takes in the bands nearer than it.
+static void* horizon_build_rows(void* arg) {
+  HorizonBuild* build = arg;
+  HorizonIndex* index = build->index;
+  Grid* elev_grid = build->elev_grid;
+  int nslots = index->nsectors * index->nbands;
+  float* highest = malloc(nslots * sizeof(float));
+  int r, c, i, s, b;
+  assert(highest);
+
+  while ((r = __sync_fetch_and_add(&build->next_row, 1)) < index->nrows) {
+    for (c = 0; c < index->ncols; c++) {
+      int16_t* angles = index->angles + ((long) r * index->ncols + c) * nslots;
+      float v_elev = grid_get(elev_grid, r, c);
+      for (i = 0; i < nslots; i++) {
+        highest[i] = -INFINITY;
+      }
+      if (v_elev != elev_grid->nodata_value) {
+        for (i = 0; i < build->noffsets; i++) {
+          HorizonOffset* offset = &build->offsets[i];
+          int t_r = r + offset->dr, t_c = c + offset->dc;
+          float t_elev;
+          if (t_r < 0 || t_r >= index->nrows || t_c < 0 || t_c >= index->ncols) {
+            continue;
+          }
+          t_elev = grid_get(elev_grid, t_r, t_c);
+          if (t_elev == elev_grid->nodata_value) {
+            continue;
+          }
+          highest[offset->slot] = maxf(highest[offset->slot],
+                                       (t_elev - v_elev) * offset->inv_dist);
+        }
+      }
+      for (s = 0; s < index->nsectors; s++) {
+        float horizon = -INFINITY;
+        for (b = 0; b < index->nbands; b++) {
+          horizon = maxf(horizon, highest[s * index->nbands + b]);
+          angles[s * index->nbands + b] = horizon_quantize(horizon);
+        }
+      }
+    }
+  }
+  free(highest);
+  return NULL;
+}
+
+// Returns the horizon index of a grid with nsectors sectors, taking in the
+// cells out to radius of each cell, built on nthreads threads (0 for one per
+// processor). Each cell looks at every other cell in range, so it takes time
+// in proportion to radius squared.
+HorizonIndex* horizon_build(Grid* elev_grid, int nsectors, int radius, int nthreads) {
+  HorizonIndex* index = malloc(sizeof(HorizonIndex));
+  HorizonBuild build;
+  int dr, dc, t;
+  assert(index);
+  assert(nsectors > 0 && radius > 0);
+  if (nthreads <= 0) nthreads = gridio_default_threads();
+
+  index->nrows = elev_grid->nrows;
+  index->ncols = elev_grid->ncols;
+  index->nsectors = nsectors;
+  index->nbands = horizon_band(radius) + 1;
+  index->radius = radius;
+  index->map_size = 0;
+  index->angles = malloc((size_t) index->nrows * index->ncols * nsectors *
+                         index->nbands * sizeof(int16_t));
+  assert(index->angles);
+
+  // the sector, band and distance of each offset in range are worked out once
+  build.elev_grid = elev_grid;
+  build.index = index;
+  build.offsets = malloc((size_t) (2 * radius + 1) * (2 * radius + 1) *
+                         sizeof(HorizonOffset));
+  assert(build.offsets);
+  build.noffsets = 0;
+  build.next_row = 0;
+  for (dr = -radius; dr <= radius; dr++) {
+    for (dc = -radius; dc <= radius; dc++) {
+      HorizonOffset* offset = &build.offsets[build.noffsets];
+      float d = sqrtf(dr * dr + dc * dc);
+      if ((dr == 0 && dc == 0) || d > radius) {
+        continue;
+      }
+      offset->dr = dr;
+      offset->dc = dc;
+      offset->slot = horizon_sector(index, 0, 0, dr, dc) * index->nbands +
+                     horizon_band(d);
+      offset->inv_dist = 1 / d;
+      build.noffsets++;
+    }
+  }
+
+  pthread_t threads[nthreads];
+  for (t = 1; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, horizon_build_rows, &build);
+  }
+  horizon_build_rows(&build);
+  for (t = 1; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  free(build.offsets);
+  return index;
+}
+
+// Writes a horizon index to out_file.
+void horizon_write(FILE* out_file, HorizonIndex* index) {
+  static const char pad[HORIZON_DATA_OFFSET];
+  HorizonFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HORIZON_MAGIC, 4);
+  header.version =     HORIZON_VERSION;
+  header.data_offset = HORIZON_DATA_OFFSET;
+  header.nrows =       index->nrows;
+  header.ncols =       index->ncols;
+  header.nsectors =    index->nsectors;
+  header.nbands =      index->nbands;
+  header.radius =      index->radius;
+  header.bands_per_octave = HORIZON_BANDS_PER_OCTAVE;
+  fwrite(&header, sizeof(header), 1, out_file);
+  fwrite(pad, 1, HORIZON_DATA_OFFSET - sizeof(header), out_file);
+  fwrite(index->angles, sizeof(int16_t),
+         (size_t) index->nrows * index->ncols * index->nsectors * index->nbands,
+         out_file);
+}
+
+// Returns the horizon index in in_file, mapped rather than read, or NULL if
+// it is not one.
+HorizonIndex* horizon_read(FILE* in_file) {
+  HorizonFileHeader header;
+  struct stat st;
+  int fd = fileno(in_file);
+
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, HORIZON_MAGIC, 4) != 0 ||
+      header.version != HORIZON_VERSION ||
+      header.data_offset != HORIZON_DATA_OFFSET ||
+      header.bands_per_octave != HORIZON_BANDS_PER_OCTAVE) {
+    fprintf(stderr, "horizon: not a horizon index\n");
+    return NULL;
+  }
+  size_t size = header.data_offset + (size_t) header.nrows * header.ncols *
+                header.nsectors * header.nbands * sizeof(int16_t);
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < size) {
+    fprintf(stderr, "horizon: horizon index is cut short\n");
+    return NULL;
+  }
+  char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "horizon: cannot map horizon index\n");
+    return NULL;
+  }
+
+  HorizonIndex* index = malloc(sizeof(HorizonIndex));
+  assert(index);
+  index->nrows =    header.nrows;
+  index->ncols =    header.ncols;
+  index->nsectors = header.nsectors;
+  index->nbands =   header.nbands;
+  index->radius =   header.radius;
+  index->angles =   (int16_t*) (map + header.data_offset);
+  index->map_size = size;
+  return index;
+}
+
+// Frees a horizon index, built or mapped.
+void horizon_free(HorizonIndex* index) {
+  if (index->map_size) {
+    munmap((char*) index->angles - HORIZON_DATA_OFFSET, index->map_size);
+  } else {
+    free(index->angles);
+  }
+  free(index);
+}
+
+// Returns whether (t_r, t_c) is visible from (v_r, v_c) by the horizons of
+// the viewpoint: it is if it rises above the horizon in its sector at the end
+// of the last band nearer than it. This is an approximation in both
+// directions. Cells in the same band as the target, nearer than it, are not
+// looked at, and a cell anywhere across the sector blocks as if it were on
+// the line of sight. Targets beyond the radius of the index are not visible.
+bool horizon_visible(HorizonIndex* index, Grid* elev_grid, int v_r, int v_c,
+                     int t_r, int t_c) {
+  float d, v_elev, t_elev;
+  int band, sector;
+  assert(index->nrows == elev_grid->nrows && index->ncols == elev_grid->ncols);
+
+  if (t_r == v_r && t_c == v_c) {
+    return true;
+  }
+  d = dist2di(v_r, v_c, t_r, t_c);
+  v_elev = grid_get(elev_grid, v_r, v_c);
+  t_elev = grid_get(elev_grid, t_r, t_c);
+  if (d > index->radius || v_elev == elev_grid->nodata_value ||
+      t_elev == elev_grid->nodata_value) {
+    return false;
+  }
+  band = horizon_band(d);
+  if (band == 0) {
+    return true;
+  }
+  sector = horizon_sector(index, v_r, v_c, t_r, t_c);
+  int16_t* angles = index->angles +
+                    ((long) v_r * index->ncols + v_c) * index->nsectors * index->nbands;
+  return horizon_quantize((t_elev - v_elev) / d) >=
+         angles[sector * index->nbands + band - 1];
+}
+
+// Returns the approximate viewshed of (v_r, v_c) by horizon_visible, out to
+// the radius of the index. Nothing is swept; each cell is one comparison.
+Grid* horizon_compute_vshed(HorizonIndex* index, Grid* elev_grid, int v_r, int v_c) {
+  Grid* vshed_grid = grid_init_from(elev_grid);
+  int r, c;
+  for (r = 0; r < vshed_grid->nrows; r++) {
+    for (c = 0; c < vshed_grid->ncols; c++) {
+      grid_set(vshed_grid, r, c, vis_grid_occluded);
+    }
+  }
+  for (r = maxi(0, v_r - index->radius); r <= mini(vshed_grid->nrows - 1, v_r + index->radius); r++) {
+    for (c = maxi(0, v_c - index->radius); c <= mini(vshed_grid->ncols - 1, v_c + index->radius); c++) {
+      if (horizon_visible(index, elev_grid, v_r, v_c, r, c)) {
+        grid_set(vshed_grid, r, c, vis_grid_visible);
+      }
+    }
+  }
+  return vshed_grid;
+}
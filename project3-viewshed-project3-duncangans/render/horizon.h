@@ -0,0 +1,57 @@
+#ifndef __horizon_h
+#define __horizon_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "grid.h"
+
+// A horizon index holds, for every cell of a grid and every one of nsectors
+// azimuth sectors around it, the horizon: the highest elevation angle to any
+// other cell in the sector. Distances are split into bands, two to each
+// doubling of the distance, out to radius, and the horizon is kept as it
+// stands at the end of each band, so a query can ask what rises above a
+// target nearer than it. Angles are stored in 16 bits, so an index takes
+// 2 * nsectors * nbands bytes a cell.
+typedef struct horizon_index_t {
+  int      nrows;
+  int      ncols;
+  int      nsectors;
+  int      nbands;
+  int      radius;
+  int16_t* angles;      // [cell][sector][band], row-major cells
+  size_t   map_size;    // size of the mapping angles lies in, 0 if malloced
+} HorizonIndex;
+
+// Bands to each doubling of the distance. One halves the index but lets
+// through about twice as many cells that are not visible (on set1.asc at
+// radius 64), and four misses more visible cells than it saves.
+#define HORIZON_BANDS_PER_OCTAVE 2
+
+// The header of a horizon index file. The angles follow at data_offset, a
+// multiple of the page size, so that the file can be mapped and used in place.
+#define HORIZON_MAGIC       "HRZN"
+#define HORIZON_VERSION     1
+#define HORIZON_DATA_OFFSET 4096
+
+typedef struct horizon_file_header_t {
+  char    magic[4];
+  int32_t version;
+  int64_t data_offset;
+  int32_t nrows;
+  int32_t ncols;
+  int32_t nsectors;
+  int32_t nbands;
+  int32_t radius;
+  int32_t bands_per_octave;
+} HorizonFileHeader;
+
+HorizonIndex* horizon_build(Grid* elev_grid, int nsectors, int radius, int nthreads);
+void          horizon_write(FILE* out_file, HorizonIndex* index);
+HorizonIndex* horizon_read(FILE* in_file);
+void          horizon_free(HorizonIndex* index);
+bool          horizon_visible(HorizonIndex* index, Grid* elev_grid, int v_r, int v_c,
+                              int t_r, int t_c);
+Grid*         horizon_compute_vshed(HorizonIndex* index, Grid* elev_grid, int v_r, int v_c);
+
+#endif
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "grid.h"
+#include "horizon.h"
+#include "rtimer.h"
+
+// Build the horizon index of a grid, for horizon_query to answer visibility
+// from. More sectors give closer answers and a bigger index, and the build
+// takes time in proportion to the radius squared.
+int main(int argc, char** argv) {
+  FILE* in_file;
+  FILE* out_file;
+  Grid* elev_grid;
+  HorizonIndex* index;
+  int nsectors = 32, radius = 64, nthreads = 0;
+  Rtimer rt;
+  char buf[1000];
+
+  // parse and validate command line parameters
+  if (argc < 3 || argc > 6) {
+    fprintf(stderr, "Usage: horizon_build <grid-file> <index-file> [sectors] [radius] [threads]\n");
+    return 1;
+  }
+  if (argc > 3) nsectors = atoi(argv[3]);
+  if (argc > 4) radius = atoi(argv[4]);
+  if (argc > 5) nthreads = atoi(argv[5]);
+  if (nsectors < 1 || radius < 1) {
+    fprintf(stderr, "sectors and radius must be at least 1\n");
+    return 1;
+  }
+  if (!(in_file = fopen(argv[1], "r"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[1]);
+    return 1;
+  }
+  if (!(out_file = fopen(argv[2], "wb"))) {
+    fprintf(stderr, "Cannot open %s for writing\n", argv[2]);
+    return 1;
+  }
+
+  elev_grid = grid_read(in_file);
+  fclose(in_file);
+
+  rt_start(rt);
+  index = horizon_build(elev_grid, nsectors, radius, nthreads);
+  rt_stop(rt);
+  rt_sprint(buf, rt);
+  printf("%d sectors, %d bands, radius %d: %s\n", index->nsectors, index->nbands,
+         index->radius, buf);
+
+  horizon_write(out_file, index);
+  fclose(out_file);
+  horizon_free(index);
+  grid_free(elev_grid);
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "grid.h"
+#include "horizon.h"
+
+// Answer visibility from a horizon index built by horizon_build: whether one
+// cell sees another, or the approximate viewshed of a cell out to the radius
+// of the index.
+int main(int argc, char** argv) {
+  FILE* in_file;
+  FILE* index_file;
+  FILE* out_file;
+  Grid* elev_grid;
+  Grid* vshed_grid;
+  HorizonIndex* index;
+  int v_r, v_c;
+
+  // parse and validate command line parameters
+  if (argc != 6 && argc != 7) {
+    fprintf(stderr, "Usage: horizon_query <grid-file> <index-file> <v-row> <v-col> <out-file>\n"
+                    "       horizon_query <grid-file> <index-file> <v-row> <v-col> <t-row> <t-col>\n");
+    return 1;
+  }
+  if (!(in_file = fopen(argv[1], "r"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[1]);
+    return 1;
+  }
+  if (!(index_file = fopen(argv[2], "rb"))) {
+    fprintf(stderr, "Cannot open %s for reading\n", argv[2]);
+    return 1;
+  }
+  elev_grid = grid_read(in_file);
+  fclose(in_file);
+  if (!(index = horizon_read(index_file))) {
+    return 1;
+  }
+  fclose(index_file);
+  if (index->nrows != elev_grid->nrows || index->ncols != elev_grid->ncols) {
+    fprintf(stderr, "%s is not the index of %s\n", argv[2], argv[1]);
+    return 1;
+  }
+  v_r = atoi(argv[3]);
+  v_c = atoi(argv[4]);
+  if (v_r < 0 || v_r >= elev_grid->nrows || v_c < 0 || v_c >= elev_grid->ncols) {
+    fprintf(stderr, "The viewpoint is off the grid\n");
+    return 1;
+  }
+
+  if (argc == 7) {
+    int t_r = atoi(argv[5]), t_c = atoi(argv[6]);
+    if (t_r < 0 || t_r >= elev_grid->nrows || t_c < 0 || t_c >= elev_grid->ncols) {
+      fprintf(stderr, "The target is off the grid\n");
+      return 1;
+    }
+    printf("%s\n", horizon_visible(index, elev_grid, v_r, v_c, t_r, t_c) ?
+           "visible" : "not visible");
+  } else {
+    if (!(out_file = fopen(argv[5], "w"))) {
+      fprintf(stderr, "Cannot open %s for writing\n", argv[5]);
+      return 1;
+    }
+    vshed_grid = horizon_compute_vshed(index, elev_grid, v_r, v_c);
+    grid_write(out_file, vshed_grid);
+    fclose(out_file);
+    grid_free(vshed_grid);
+  }
+
+  horizon_free(index);
+  grid_free(elev_grid);
+  return 0;
+}
@@ -2,7 +2,7 @@
 #include <assert.h>
 #include "llist.h"
 
-LList* llist_init() {
+LList* llist_init(void) {
   LList* list = malloc(sizeof(LList));
   assert(list);
   list->head = NULL;
@@ -13,7 +13,7 @@ typedef struct llist_t {
   int        count;
 } LList;
 
-LList*     llist_init();
+LList*     llist_init(void);
 void       llist_destroy(LList* llist);
 void       llist_destroy_with_values(LList* llist);
 void       llist_insert(LList* llist, void* value);
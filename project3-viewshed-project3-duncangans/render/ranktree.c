@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "ranktree.h"
+
+// Returns a new tree with no ranks, which ranktree_reset sizes for a sweep.
+RankTree* ranktree_init(void) {
+  RankTree* tree = calloc(1, sizeof(RankTree));
+  assert(tree);
+  return tree;
+}
+
+// Empties the tree and makes room for nranks ranks, growing its array if it
+// is too small. A run of sweeps that shares one allocates it once.
+void ranktree_reset(RankTree* tree, uint32_t nranks) {
+  uint32_t i;
+  assert(nranks < (1u << 31));
+  tree->leaves = 1;
+  while (tree->leaves <= nranks) {
+    tree->leaves *= 2;
+  }
+  if (2 * tree->leaves > tree->cap) {
+    free(tree->max_gradients);
+    tree->cap = 2 * tree->leaves;
+    tree->max_gradients = malloc((size_t) tree->cap * sizeof(float));
+    assert(tree->max_gradients);
+  }
+  for (i = 0; i < 2 * tree->leaves; i++) {
+    tree->max_gradients[i] = -INFINITY;
+  }
+}
+
+// Frees the tree.
+void ranktree_free(RankTree* tree) {
+  free(tree->max_gradients);
+  free(tree);
+}
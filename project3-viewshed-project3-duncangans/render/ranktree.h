@@ -0,0 +1,55 @@
+#ifndef __ranktree_h
+#define __ranktree_h
+
+#include <stdint.h>
+#include <math.h>
+
+// The other active list of the sweeps of vis.c: for a sweep whose targets are
+// all known before it starts, each target is given a rank, its place in
+// order of distance, and the list is a tournament tree over the ranks kept in
+// one array. Leaf leaves + rank holds the gradient of the target of that rank
+// while it is active, and -INFINITY otherwise; node i holds the larger of
+// nodes 2i and 2i + 1. Adding, removing and querying a target are each one
+// walk of fixed length between a leaf and the root, with no pointers to
+// follow and no rebalancing.
+
+typedef struct rank_tree_t {
+  float*   max_gradients;   // 2 * leaves nodes; node 0 is unused
+  uint32_t leaves;          // a power of two above the number of ranks
+  uint32_t cap;             // nodes allocated
+} RankTree;
+
+static inline float ranktree_max(float a, float b) {
+  return (a > b) ? a : b;
+}
+
+// Makes gradient the value of the target of the given rank: its gradient to
+// add it, or -INFINITY to remove it.
+static inline void ranktree_set(RankTree* tree, uint32_t rank, float gradient) {
+  float* nodes = tree->max_gradients;
+  uint32_t i = tree->leaves + rank;
+  nodes[i] = gradient;
+  for (i >>= 1; i > 0; i >>= 1) {
+    nodes[i] = ranktree_max(nodes[2 * i], nodes[2 * i + 1]);
+  }
+}
+
+// Returns the largest gradient of the active targets of rank less than rank,
+// -INFINITY if there are none. Walking up from that leaf, each node that is
+// a right child has the left sibling covering the ranks just before it.
+static inline float ranktree_max_below(RankTree* tree, uint32_t rank) {
+  float* nodes = tree->max_gradients;
+  float m = -INFINITY;
+  uint32_t i;
+  for (i = tree->leaves + rank; i > 1; i >>= 1) {
+    float sibling = nodes[i - 1];
+    m = ((i & 1) && sibling > m) ? sibling : m;
+  }
+  return m;
+}
+
+RankTree* ranktree_init(void);
+void      ranktree_reset(RankTree* tree, uint32_t nranks);
+void      ranktree_free(RankTree* tree);
+
+#endif
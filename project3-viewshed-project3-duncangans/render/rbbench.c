@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "rbbst.h"
+#include "rtimer.h"
+
+// Benchmark the active list (see rbbst.c) on its own: for each size, the
+// rate of inserts, deletes and max-gradient queries with that many values
+// live. Deletes and inserts alternate in batches, so the size stays within a
+// batch of the one asked for.
+
+#define RBBENCH_SIZES    "10000,100000,1000000,10000000"
+#define RBBENCH_OPS      1000000
+#define RBBENCH_BATCH    65536
+#define RBBENCH_MAX_KEY  1e6    // keys are distances from 1 to this
+#define RBBENCH_MAX_LIST 64
+
+// Returns the next number of a xorshift64 stream.
+static uint64_t rbbench_next(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Returns a number in [0, 1) from the stream.
+static float rbbench_uniform(uint64_t* state) {
+  return (rbbench_next(state) >> 40) / (float) (1 << 24);
+}
+
+static TreeValue rbbench_value(uint64_t* state) {
+  TreeValue value = { 1 + rbbench_uniform(state) * RBBENCH_MAX_KEY,
+                      2 * rbbench_uniform(state) - 1 };
+  return value;
+}
+
+// Parses a comma separated list of positive numbers into vals, and returns
+// how many there were, or 0 if one is not a positive number.
+static int rbbench_parse_numbers(const char* list, long* vals) {
+  int n = 0;
+  char* end;
+  while (*list && n < RBBENCH_MAX_LIST) {
+    vals[n] = strtol(list, &end, 10);
+    if (end == list || vals[n] < 1 || (*end && *end != ',')) {
+      return 0;
+    }
+    n++;
+    list = *end ? end + 1 : end;
+  }
+  return n;
+}
+
+// Runs the benchmark at one size and prints its line.
+static void rbbench_size(long size, long ops, uint64_t* state) {
+  float* keys = malloc((size + RBBENCH_BATCH) * sizeof(float));
+  TreeValue dummy = { RBBENCH_MAX_KEY * 2, 0 };
+  double insert_s = 0, delete_s = 0, query_s = 0;
+  long live = 0, inserts = 0, deletes = 0, i;
+  long batch = (size / 2 < RBBENCH_BATCH) ? size / 2 : RBBENCH_BATCH;
+  volatile float sink = 0;
+  Rtimer rt;
+
+  if (batch < 1) batch = 1;
+  RBTree* tree = createTree(dummy);
+  rt_start(rt);
+  for (; live < size; live++) {
+    TreeValue value = rbbench_value(state);
+    keys[live] = value.key;
+    insertInto(tree, value);
+  }
+  rt_stop(rt);
+  double fill_s = rt_seconds(rt);
+
+  // delete a batch of random live keys, then insert as many new ones
+  while (deletes < ops) {
+    rt_start(rt);
+    for (i = 0; i < batch; i++) {
+      long k = rbbench_next(state) % live;
+      deleteFrom(tree, keys[k]);
+      keys[k] = keys[--live];
+    }
+    rt_stop(rt);
+    delete_s += rt_seconds(rt);
+    deletes += batch;
+
+    rt_start(rt);
+    for (i = 0; i < batch; i++) {
+      TreeValue value = rbbench_value(state);
+      keys[live++] = value.key;
+      insertInto(tree, value);
+    }
+    rt_stop(rt);
+    insert_s += rt_seconds(rt);
+    inserts += batch;
+  }
+
+  rt_start(rt);
+  for (i = 0; i < ops; i++) {
+    sink += findMaxGradientWithinKey(tree, 1 + rbbench_uniform(state) * RBBENCH_MAX_KEY);
+  }
+  rt_stop(rt);
+  query_s = rt_seconds(rt);
+
+  printf("%9ld %12.2f %12.2f %12.2f %12.2f %10.1f\n", size,
+         size / fill_s / 1e6, inserts / insert_s / 1e6,
+         deletes / delete_s / 1e6, ops / query_s / 1e6,
+         tree->cap * sizeof(RBNode) / 1048576.0);
+  deleteTree(tree);
+  free(tree);
+  free(keys);
+}
+
+int main(int argc, char** argv) {
+  long sizes[RBBENCH_MAX_LIST];
+  long ops = RBBENCH_OPS;
+  uint64_t state = 1;
+  int nsizes, i;
+
+  if (argc > 4) {
+    fprintf(stderr, "Usage: rbbench [sizes] [ops] [seed]\n");
+    return 1;
+  }
+  nsizes = rbbench_parse_numbers((argc > 1) ? argv[1] : RBBENCH_SIZES, sizes);
+  if (nsizes == 0) {
+    fprintf(stderr, "sizes must be a comma separated list of positive numbers\n");
+    return 1;
+  }
+  if (argc > 2) ops = atol(argv[2]);
+  if (argc > 3) state = strtoull(argv[3], NULL, 10);
+  if (ops < 1 || state == 0) {
+    fprintf(stderr, "ops and seed must be positive\n");
+    return 1;
+  }
+
+  printf("%9s %12s %12s %12s %12s %10s\n", "live", "fill Mop/s",
+         "insert Mop/s", "delete Mop/s", "query Mop/s", "pool MB");
+  for (i = 0; i < nsizes; i++) {
+    rbbench_size(sizes[i], ops, &state);
+  }
+  return 0;
+}
@@ -0,0 +1,279 @@
+/* The active list: a left-leaning red-black tree (Sedgewick) in a pool of
+   nodes. Equal keys are allowed: nodes are ordered by key and then by their
+   index in the pool, so that the tree never holds two nodes it cannot tell
+   apart, and deleting a key removes one of the nodes with it. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "rbbst.h"
+
+// The pool starts with room for this many nodes and doubles when full.
+#define RB_MIN_CAP 1024
+
+static inline float rb_max(float a, float b) {
+  return (a > b) ? a : b;
+}
+
+// Returns true iff node n, with the given key, goes before node h.
+static inline int rb_before(RBTree* tree, float key, uint32_t n, uint32_t h) {
+  float h_key = tree->nodes[h].value.key;
+  return key < h_key || (key == h_key && n < h);
+}
+
+static inline int rb_is_red(RBTree* tree, uint32_t n) {
+  return n != RB_NIL && tree->nodes[n].red;
+}
+
+// Makes n's max_gradient that of it and its children.
+static inline void rb_update(RBTree* tree, uint32_t n) {
+  RBNode* node = &tree->nodes[n];
+  float m = node->value.gradient;
+  if (node->left != RB_NIL) m = rb_max(m, tree->nodes[node->left].max_gradient);
+  if (node->right != RB_NIL) m = rb_max(m, tree->nodes[node->right].max_gradient);
+  node->max_gradient = m;
+}
+
+// Returns a new red node holding value, from the nodes given back if there
+// are any, or else the pool, which grows if it is full.
+static uint32_t rb_node_new(RBTree* tree, TreeValue value) {
+  uint32_t n;
+  if (tree->free != RB_NIL) {
+    n = tree->free;
+    tree->free = tree->nodes[n].left;
+  } else {
+    if (tree->used == tree->cap) {
+      // checked in release builds too, as the doubling would wrap
+      if (tree->cap >= RB_NIL / 2) {
+        fprintf(stderr, "rbbst: the active list is full\n");
+        exit(1);
+      }
+      tree->cap = (tree->cap < RB_MIN_CAP) ? RB_MIN_CAP : tree->cap * 2;
+      tree->nodes = realloc(tree->nodes, (size_t) tree->cap * sizeof(RBNode));
+      assert(tree->nodes);
+    }
+    n = tree->used++;
+  }
+  RBNode* node = &tree->nodes[n];
+  node->value = value;
+  node->max_gradient = value.gradient;
+  node->left = node->right = RB_NIL;
+  node->red = 1;
+  tree->size++;
+  return n;
+}
+
+// Gives n back to the pool.
+static void rb_node_free(RBTree* tree, uint32_t n) {
+  tree->nodes[n].left = tree->free;
+  tree->free = n;
+  tree->size--;
+}
+
+static uint32_t rb_rotate_left(RBTree* tree, uint32_t h) {
+  RBNode* nodes = tree->nodes;
+  uint32_t x = nodes[h].right;
+  nodes[h].right = nodes[x].left;
+  nodes[x].left = h;
+  nodes[x].red = nodes[h].red;
+  nodes[h].red = 1;
+  rb_update(tree, h);
+  rb_update(tree, x);
+  return x;
+}
+
+static uint32_t rb_rotate_right(RBTree* tree, uint32_t h) {
+  RBNode* nodes = tree->nodes;
+  uint32_t x = nodes[h].left;
+  nodes[h].left = nodes[x].right;
+  nodes[x].right = h;
+  nodes[x].red = nodes[h].red;
+  nodes[h].red = 1;
+  rb_update(tree, h);
+  rb_update(tree, x);
+  return x;
+}
+
+static void rb_flip_colors(RBTree* tree, uint32_t h) {
+  RBNode* nodes = tree->nodes;
+  nodes[h].red = !nodes[h].red;
+  if (nodes[h].left != RB_NIL) nodes[nodes[h].left].red = !nodes[nodes[h].left].red;
+  if (nodes[h].right != RB_NIL) nodes[nodes[h].right].red = !nodes[nodes[h].right].red;
+}
+
+// Restores the left lean of h and the colors below it on the way back up,
+// and its max_gradient.
+static uint32_t rb_balance(RBTree* tree, uint32_t h) {
+  RBNode* nodes = tree->nodes;
+  if (rb_is_red(tree, nodes[h].right)) {
+    h = rb_rotate_left(tree, h);
+  }
+  if (rb_is_red(tree, nodes[h].left) && rb_is_red(tree, nodes[nodes[h].left].left)) {
+    h = rb_rotate_right(tree, h);
+  }
+  if (rb_is_red(tree, nodes[h].left) && rb_is_red(tree, nodes[h].right)) {
+    rb_flip_colors(tree, h);
+  }
+  rb_update(tree, h);
+  return h;
+}
+
+// Makes h's left child or one of its children red, for a delete on the left.
+static uint32_t rb_move_red_left(RBTree* tree, uint32_t h) {
+  RBNode* nodes = tree->nodes;
+  rb_flip_colors(tree, h);
+  if (rb_is_red(tree, nodes[nodes[h].right].left)) {
+    nodes[h].right = rb_rotate_right(tree, nodes[h].right);
+    h = rb_rotate_left(tree, h);
+    rb_flip_colors(tree, h);
+  }
+  return h;
+}
+
+// As rb_move_red_left, for a delete on the right.
+static uint32_t rb_move_red_right(RBTree* tree, uint32_t h) {
+  RBNode* nodes = tree->nodes;
+  rb_flip_colors(tree, h);
+  if (rb_is_red(tree, nodes[nodes[h].left].left)) {
+    h = rb_rotate_right(tree, h);
+    rb_flip_colors(tree, h);
+  }
+  return h;
+}
+
+// Inserts n into the subtree at h and returns the subtree's new root. The
+// pool does not move while this runs, as n is already taken from it.
+static uint32_t rb_insert(RBTree* tree, uint32_t h, uint32_t n) {
+  RBNode* nodes = tree->nodes;
+  if (h == RB_NIL) return n;
+  if (rb_before(tree, nodes[n].value.key, n, h)) {
+    nodes[h].left = rb_insert(tree, nodes[h].left, n);
+  } else {
+    nodes[h].right = rb_insert(tree, nodes[h].right, n);
+  }
+  return rb_balance(tree, h);
+}
+
+// Takes the leftmost node of the subtree at h out of it, into *min, and
+// returns the subtree's new root.
+static uint32_t rb_delete_min(RBTree* tree, uint32_t h, uint32_t* min) {
+  RBNode* nodes = tree->nodes;
+  if (nodes[h].left == RB_NIL) {
+    *min = h;
+    return RB_NIL;
+  }
+  if (!rb_is_red(tree, nodes[h].left) && !rb_is_red(tree, nodes[nodes[h].left].left)) {
+    h = rb_move_red_left(tree, h);
+  }
+  nodes[h].left = rb_delete_min(tree, nodes[h].left, min);
+  return rb_balance(tree, h);
+}
+
+// Deletes node n, which has the given key, from the subtree at h, and
+// returns the subtree's new root. A node with a right child is replaced by
+// the leftmost node to its right, moved as it is, so each node keeps its
+// place in the order.
+static uint32_t rb_delete(RBTree* tree, uint32_t h, float key, uint32_t n) {
+  RBNode* nodes = tree->nodes;
+  if (h != n && rb_before(tree, key, n, h)) {
+    if (!rb_is_red(tree, nodes[h].left) && !rb_is_red(tree, nodes[nodes[h].left].left)) {
+      h = rb_move_red_left(tree, h);
+    }
+    nodes[h].left = rb_delete(tree, nodes[h].left, key, n);
+  } else {
+    if (rb_is_red(tree, nodes[h].left)) {
+      h = rb_rotate_right(tree, h);
+    }
+    if (h == n && nodes[h].right == RB_NIL) {
+      rb_node_free(tree, h);
+      return RB_NIL;
+    }
+    if (!rb_is_red(tree, nodes[h].right) && !rb_is_red(tree, nodes[nodes[h].right].left)) {
+      h = rb_move_red_right(tree, h);
+    }
+    if (h == n) {
+      uint32_t min;
+      uint32_t right = rb_delete_min(tree, nodes[h].right, &min);
+      nodes[min].left = nodes[h].left;
+      nodes[min].right = right;
+      nodes[min].red = nodes[h].red;
+      rb_node_free(tree, h);
+      h = min;
+    } else {
+      nodes[h].right = rb_delete(tree, nodes[h].right, key, n);
+    }
+  }
+  return rb_balance(tree, h);
+}
+
+// Returns a new tree holding just value. The sweeps seed it with a value
+// further than any cell, so that it is never empty.
+RBTree* createTree(TreeValue value) {
+  RBTree* tree = malloc(sizeof(RBTree));
+  assert(tree);
+  tree->cap = RB_MIN_CAP;
+  tree->nodes = malloc((size_t) tree->cap * sizeof(RBNode));
+  assert(tree->nodes);
+  resetTree(tree, value);
+  return tree;
+}
+
+// Empties the tree, keeping its pool, and inserts value, which leaves it as
+// createTree would.
+void resetTree(RBTree* tree, TreeValue value) {
+  tree->used = 0;
+  tree->free = RB_NIL;
+  tree->root = RB_NIL;
+  tree->size = 0;
+  insertInto(tree, value);
+}
+
+void insertInto(RBTree* tree, TreeValue value) {
+  uint32_t n = rb_node_new(tree, value);
+  tree->root = rb_insert(tree, tree->root, n);
+  tree->nodes[tree->root].red = 0;
+}
+
+// Deletes one node with the given key. A key that is not in the tree is
+// ignored.
+void deleteFrom(RBTree* tree, float key) {
+  uint32_t root = tree->root;
+  uint32_t n = root;
+  while (n != RB_NIL && tree->nodes[n].value.key != key) {
+    n = (key < tree->nodes[n].value.key) ? tree->nodes[n].left : tree->nodes[n].right;
+  }
+  if (n == RB_NIL) return;
+  if (!rb_is_red(tree, tree->nodes[root].left) && !rb_is_red(tree, tree->nodes[root].right)) {
+    tree->nodes[root].red = 1;
+  }
+  tree->root = rb_delete(tree, root, key, n);
+  if (tree->root != RB_NIL) tree->nodes[tree->root].red = 0;
+}
+
+// Returns the largest gradient of the nodes with keys less than key,
+// -INFINITY if there are none, walking down the tree once.
+float findMaxGradientWithinKey(RBTree* tree, float key) {
+  RBNode* nodes = tree->nodes;
+  float m = -INFINITY;
+  uint32_t n = tree->root;
+  while (n != RB_NIL) {
+    RBNode* node = &nodes[n];
+    if (node->value.key < key) {
+      m = rb_max(m, node->value.gradient);
+      if (node->left != RB_NIL) m = rb_max(m, nodes[node->left].max_gradient);
+      n = node->right;
+    } else {
+      n = node->left;
+    }
+  }
+  return m;
+}
+
+// Frees the tree's pool. The tree itself is the caller's to free.
+void deleteTree(RBTree* tree) {
+  free(tree->nodes);
+  tree->nodes = NULL;
+  tree->root = RB_NIL;
+  tree->size = 0;
+}
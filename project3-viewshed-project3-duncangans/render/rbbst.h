@@ -0,0 +1,45 @@
+#ifndef __rbbst_h
+#define __rbbst_h
+
+#include <stdint.h>
+
+// The active list of the sweeps of vis.c: a left-leaning red-black tree of
+// values keyed by distance, each node also holding the largest gradient in
+// its subtree, so that the largest gradient nearer than a distance is found
+// in one walk down. Nodes live in one pool and refer to each other by index,
+// so a tree is a single allocation that a sweep can empty and fill again
+// without freeing it (see resetTree).
+
+typedef struct tree_value_t {
+  float key;        // distance from the viewpoint
+  float gradient;
+} TreeValue;
+
+// No node; an index past any pool.
+#define RB_NIL UINT32_MAX
+
+typedef struct rb_node_t {
+  TreeValue value;
+  float     max_gradient;   // of the node and its subtrees
+  uint32_t  left;
+  uint32_t  right;
+  char      red;            // the link from its parent is red
+} RBNode;
+
+typedef struct rb_tree_t {
+  RBNode*  nodes;           // the pool
+  uint32_t cap;
+  uint32_t used;            // nodes taken from the pool since it was emptied
+  uint32_t free;            // nodes given back, chained through left
+  uint32_t root;
+  uint32_t size;
+} RBTree;
+
+RBTree* createTree(TreeValue value);
+void    resetTree(RBTree* tree, TreeValue value);
+void    insertInto(RBTree* tree, TreeValue value);
+void    deleteFrom(RBTree* tree, float key);
+float   findMaxGradientWithinKey(RBTree* tree, float key);
+void    deleteTree(RBTree* tree);
+
+#endif
@@ -0,0 +1,159 @@
+/* Synthetic terrain for benchmarks: fractal hills made by diamond-square, with
+   lakes of nodata. The same parameters always give the same terrain. */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include "terrain.h"
+#include "utils.h"
+
+// Returns a number in [-1, 1) that depends only on the seed and i (it is
+// splitmix64), so the terrain does not depend on the order it is built in.
+static float terrain_noise(unsigned int seed, uint64_t i) {
+  uint64_t z = i + ((uint64_t) seed << 32) + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z >> 40) / (float) (1 << 23) - 1;
+}
+
+// Noise for the lakes is drawn from i at and above this, which no cell index
+// reaches.
+#define TERRAIN_LAKE_STREAM ((uint64_t) 1 << 62)
+
+// Sets params to the defaults for a terrain of the given size: seed 1, no
+// holes.
+void terrain_defaults(TerrainParams* params, int nrows, int ncols) {
+  params->nrows = nrows;
+  params->ncols = ncols;
+  params->seed = 1;
+  params->roughness = TERRAIN_ROUGHNESS;
+  params->detail = TERRAIN_DETAIL;
+  params->holes = 0;
+}
+
+// Fills h, side cells on a side with side one more than a power of two, with
+// diamond-square: each square's centre is the mean of its corners, then each
+// edge's middle the mean of its neighbours, each plus noise that shrinks with
+// the squares: by 2^-roughness each time they halve, to params->detail
+// between neighbouring cells.
+static void terrain_diamond_square(float* h, size_t side, TerrainParams* params) {
+  unsigned int seed = params->seed;
+  float decay = powf(2, -params->roughness);
+  float scale = params->detail * powf(side - 1, params->roughness);
+  size_t step, half, r, c;
+
+  h[0] = scale * terrain_noise(seed, 0);
+  h[side - 1] = scale * terrain_noise(seed, side - 1);
+  h[(side - 1) * side] = scale * terrain_noise(seed, (side - 1) * side);
+  h[side * side - 1] = scale * terrain_noise(seed, side * side - 1);
+
+  for (step = side - 1; step > 1; step /= 2) {
+    half = step / 2;
+    for (r = half; r < side; r += step) {
+      for (c = half; c < side; c += step) {
+        h[r * side + c] = (h[(r - half) * side + c - half] +
+                           h[(r - half) * side + c + half] +
+                           h[(r + half) * side + c - half] +
+                           h[(r + half) * side + c + half]) / 4 +
+                          scale * terrain_noise(seed, r * side + c);
+      }
+    }
+    for (r = 0; r < side; r += half) {
+      for (c = ((r / half) % 2 == 0) ? half : 0; c < side; c += step) {
+        float sum = 0;
+        int n = 0;
+        if (r >= half)       { sum += h[(r - half) * side + c]; n++; }
+        if (r + half < side) { sum += h[(r + half) * side + c]; n++; }
+        if (c >= half)       { sum += h[r * side + c - half]; n++; }
+        if (c + half < side) { sum += h[r * side + c + half]; n++; }
+        h[r * side + c] = sum / n + scale * terrain_noise(seed, r * side + c);
+      }
+    }
+    scale *= decay;
+  }
+}
+
+// Floods round lakes of nodata into the cells until params->holes of them
+// are nodata. Most lakes are small, a few reach a sixteenth of the grid.
+static void terrain_lakes(float* cells, TerrainParams* params) {
+  long target = params->holes * params->nrows * params->ncols;
+  long marked = 0;
+  int max_radius = maxi(1, mini(params->nrows, params->ncols) / 16);
+  uint64_t i = TERRAIN_LAKE_STREAM;
+  int r, c;
+
+  while (marked < target) {
+    float u = (terrain_noise(params->seed, i++) + 1) / 2;
+    int r0 = (terrain_noise(params->seed, i++) + 1) / 2 * params->nrows;
+    int c0 = (terrain_noise(params->seed, i++) + 1) / 2 * params->ncols;
+    int radius = 1 + u * u * max_radius;
+    for (r = maxi(0, r0 - radius); r <= mini(params->nrows - 1, r0 + radius); r++) {
+      for (c = maxi(0, c0 - radius); c <= mini(params->ncols - 1, c0 + radius); c++) {
+        float* cell = cells + (long) r * params->ncols + c;
+        if (*cell != TERRAIN_NODATA &&
+            (r - r0) * (r - r0) + (c - c0) * (c - c0) <= radius * radius) {
+          *cell = TERRAIN_NODATA;
+          marked++;
+        }
+      }
+    }
+  }
+}
+
+// Returns a malloced row-major terrain of the size and shape in params, and
+// fills in its header. Elevations are whole meters from 0 up, so the grid can
+// be kept as int16 (see grid_tobin). The fractal is built on the smallest
+// square of side 2^k + 1 that covers the grid and cut down to it, so a 32768
+// square grid needs about 4.3GB while it is built.
+float* terrain_generate(TerrainParams* params, GridioHeader* header) {
+  size_t side = 2, n = (size_t) params->nrows * params->ncols, i;
+  int r;
+  float lo = INFINITY;
+
+  assert(params->nrows > 0 && params->ncols > 0);
+  assert(params->holes >= 0 && params->holes < 1);
+  while (side - 1 < (size_t) maxi(params->nrows, params->ncols)) {
+    side = 2 * side - 1;
+  }
+  float* cells = malloc(side * side * sizeof(float));
+  assert(cells);
+  terrain_diamond_square(cells, side, params);
+
+  // cut the square down to the grid in place; each row only moves back
+  for (r = 0; r < params->nrows; r++) {
+    memmove(cells + (size_t) r * params->ncols, cells + (size_t) r * side,
+            params->ncols * sizeof(float));
+  }
+  float* shrunk = realloc(cells, n * sizeof(float));
+  if (shrunk) {
+    cells = shrunk;
+  }
+
+  // lift the lowest cell to 0 and round to whole meters, then cut the lakes
+  for (i = 0; i < n; i++) {
+    lo = minf(lo, cells[i]);
+  }
+  for (i = 0; i < n; i++) {
+    cells[i] = rintf(cells[i] - lo);
+  }
+  terrain_lakes(cells, params);
+
+  header->ncols = params->ncols;
+  header->nrows = params->nrows;
+  header->xllcorner = 0;
+  header->yllcorner = 0;
+  header->cellsize = TERRAIN_CELLSIZE;
+  header->nodata_value = TERRAIN_NODATA;
+  header->min_value = INFINITY;
+  header->max_value = -INFINITY;
+  for (i = 0; i < n; i++) {
+    if (cells[i] != TERRAIN_NODATA) {
+      header->min_value = minf(header->min_value, cells[i]);
+      header->max_value = maxf(header->max_value, cells[i]);
+    }
+  }
+  return cells;
+}
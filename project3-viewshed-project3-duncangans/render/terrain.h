@@ -0,0 +1,28 @@
+#ifndef __terrain_h
+#define __terrain_h
+
+#include "gridio.h"
+
+// The shape of a synthetic terrain (see terrain_generate).
+typedef struct terrain_params_t {
+  int          nrows;
+  int          ncols;
+  unsigned int seed;
+  float        roughness;   // 0 to 1; each halving of the scale keeps
+                            // 2^-roughness of the relief
+  float        detail;      // meters of relief from one cell to the next
+  float        holes;       // fraction of the cells that are nodata
+} TerrainParams;
+
+// Defaults that look like the hills of set1.asc, cell size included. The
+// relief grows with the grid, to some 300 meters at 1024 cells on a side and
+// some 3000 at 32768.
+#define TERRAIN_ROUGHNESS 0.7
+#define TERRAIN_DETAIL    1
+#define TERRAIN_CELLSIZE  30
+#define TERRAIN_NODATA    -9999
+
+void   terrain_defaults(TerrainParams* params, int nrows, int ncols);
+float* terrain_generate(TerrainParams* params, GridioHeader* header);
+
+#endif
@@ -1,115 +1,457 @@
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <float.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "vis.h"
+#include "gridio.h"
 #include "rbbst.h"
+#include "ranktree.h"
 #include "utils.h"
 #include "llist.h"
 
-// Returns the angle in radians swept from point (v_r, v_c) to (t_r, t_c). This
-// angle is always between 0 and 2PI.
-float vis_swept_alpha(float v_r, float v_c, float t_r, float t_c) {
-  float y_delta = v_r - t_r;
-  float x_delta = v_c - t_c;
-  float a = atan2(y_delta, x_delta);
-  return (a >= 0) ? a : (2 * M_PI) + a;
-}
-
-// Constructs and returns a new VisEvent.
-VisEvent* vis_event_init(char event_type, Grid* elev_grid, int v_r, int v_c, int t_r, int t_c, float alpha) {
-  VisEvent* vis_event = malloc(sizeof(VisEvent));
-  assert(vis_event);
-  vis_event->event_type = event_type;
-  vis_event->t_r = t_r;
-  vis_event->t_c = t_c;
-  vis_event->alpha = alpha;
-  vis_event->distance = dist2di(v_r, v_c, t_r, t_c);
-  vis_event->gradient = ((float) grid_get(elev_grid, t_r, t_c) - grid_get(elev_grid, v_r, v_c)) / vis_event->distance;
-  return vis_event;
-}
-
-// A comparator to sort events in increasing sweep angle. We break ties
-// in order of increasing distance and then in <end, query, start> order to
-// ensure that we never have multiple nodes in the active list that have the
-// same distance, as this can cause undetermined behavior on deletion.
-int vis_events_in_increasing_alpha(const void* elem_a, const void* elem_b) {
-  VisEvent* vis_event_a = *((VisEvent**) elem_a);
-  VisEvent* vis_event_b = *((VisEvent**) elem_b);
-
-  if (vis_event_a->alpha < vis_event_b->alpha) {
-    return -1;
-  } else if (vis_event_a->alpha > vis_event_b->alpha) {
-    return 1;
-  } else {
-    if (vis_event_a->distance < vis_event_b->distance) {
-      return -1;
-    } else if (vis_event_a->distance > vis_event_b->distance) {
-      return 1;
-    } else {
-      return vis_event_a->event_type - vis_event_b->event_type;
+// The bits of 1.0f. Distances are at least 1, so their bits less these
+// fit in the 30 bits a key has for them.
+#define VIS_KEY_ONE 0x3f800000u
+
+// Returns the key events are sorted by: increasing sweep angle, then
+// increasing distance, then <end, query, start>, which ensures that we never
+// have multiple nodes in the active list that have the same distance, as this
+// can cause undetermined behavior on deletion. Both floats are positive, and
+// the bits of positive floats order the same as they do, so comparing keys
+// gives the same order as comparing the three in turn. The alpha of -0.0 that
+// atan2 can give is made +0.0, which compares equal to it.
+static uint64_t vis_event_key(float alpha, float distance, char event_type) {
+  union { float f; uint32_t u; } a = { alpha + 0.0f }, d = { distance };
+  assert(a.u < 0x7f800000u && distance >= 1);
+  return ((uint64_t) a.u << 32) | ((uint64_t) (d.u - VIS_KEY_ONE) << 2) |
+         (uint64_t) event_type;
+}
+
+// Returns the distance packed into a key, exactly as it was given.
+static float vis_event_distance(uint64_t key) {
+  union { uint32_t u; float f; } d = { (uint32_t) ((key >> 2) & 0x3fffffff) + VIS_KEY_ONE };
+  return d.f;
+}
+
+// Returns the event type packed into a key.
+static char vis_event_type(uint64_t key) {
+  return key & 3;
+}
+
+// Fills in vis_event, one of the events of a sweep. target is where the
+// target cell is in the sweep's window.
+static void vis_event_init(VisEvent* vis_event, char event_type, Grid* elev_grid, int v_r, int v_c, int t_r, int t_c, uint32_t target, float alpha) {
+  float distance = dist2di(v_r, v_c, t_r, t_c);
+  vis_event->key = vis_event_key(alpha, distance, event_type);
+  vis_event->target = target;
+  vis_event->gradient = ((float) grid_get(elev_grid, t_r, t_c) - grid_get(elev_grid, v_r, v_c)) / distance;
+}
+
+// Events are sorted by their keys, VIS_RADIX_BITS at a time from the lowest,
+// each pass a stable counting sort. Sorts of fewer than VIS_RADIX_MIN_SPLIT
+// events per thread are left to fewer threads, as starting one would cost
+// more than it saves.
+#define VIS_RADIX_BITS      11
+#define VIS_RADIX_BUCKETS   (1 << VIS_RADIX_BITS)
+#define VIS_RADIX_MIN_SPLIT (1 << 16)
+
+// What the threads of a sort share. Thread t counts and moves the events
+// [t * n / nthreads, (t + 1) * n / nthreads) of src into dst.
+typedef struct vis_sort_t {
+  VisEvent* src;
+  VisEvent* dst;
+  size_t    n;
+  int       nthreads;
+  int       shift;
+  size_t*   counts;     // VIS_RADIX_BUCKETS for each thread
+} VisSort;
+
+typedef struct vis_sort_part_t {
+  VisSort* sort;
+  int      t;
+} VisSortPart;
+
+// Counts how many of its events fall in each bucket of the pass.
+static void* vis_sort_count(void* arg) {
+  VisSortPart* part = arg;
+  VisSort* sort = part->sort;
+  size_t* counts = sort->counts + (size_t) part->t * VIS_RADIX_BUCKETS;
+  size_t i = part->t * sort->n / sort->nthreads;
+  size_t end = (part->t + 1) * sort->n / sort->nthreads;
+  memset(counts, 0, VIS_RADIX_BUCKETS * sizeof(size_t));
+  for (; i < end; i++) {
+    counts[(sort->src[i].key >> sort->shift) & (VIS_RADIX_BUCKETS - 1)]++;
+  }
+  return NULL;
+}
+
+// Moves its events to where the counts, made offsets, say they go.
+static void* vis_sort_move(void* arg) {
+  VisSortPart* part = arg;
+  VisSort* sort = part->sort;
+  size_t* offsets = sort->counts + (size_t) part->t * VIS_RADIX_BUCKETS;
+  size_t i = part->t * sort->n / sort->nthreads;
+  size_t end = (part->t + 1) * sort->n / sort->nthreads;
+  for (; i < end; i++) {
+    sort->dst[offsets[(sort->src[i].key >> sort->shift) & (VIS_RADIX_BUCKETS - 1)]++] = sort->src[i];
+  }
+  return NULL;
+}
+
+// Runs fn over each part, a thread each.
+static void vis_sort_run(void* (*fn)(void*), VisSortPart* parts, int nthreads) {
+  pthread_t threads[nthreads];
+  int started[nthreads];
+  int t;
+  for (t = 1; t < nthreads; t++) {
+    started[t] = pthread_create(&threads[t], NULL, fn, &parts[t]) == 0;
+    if (!started[t]) fn(&parts[t]);
+  }
+  fn(&parts[0]);
+  for (t = 1; t < nthreads; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+  }
+}
+
+// Sorts the n events by key on up to nthreads threads, using scratch, which
+// has room for n events, and returns whichever of events and scratch holds
+// them sorted. The sort is stable. Passes over bits that every key shares
+// are skipped, so the short keys of a small window take fewer passes.
+static VisEvent* vis_sort_events(VisEvent* events, VisEvent* scratch, size_t n,
+                                 int nthreads) {
+  nthreads = maxi(1, mini(nthreads, n / VIS_RADIX_MIN_SPLIT));
+  VisSort sort = { events, scratch, n, nthreads, 0,
+                   malloc((size_t) nthreads * VIS_RADIX_BUCKETS * sizeof(size_t)) };
+  VisSortPart parts[nthreads];
+  int t, b;
+  assert(sort.counts);
+  for (t = 0; t < nthreads; t++) {
+    parts[t].sort = &sort;
+    parts[t].t = t;
+  }
+
+  for (sort.shift = 0; sort.shift < 64; sort.shift += VIS_RADIX_BITS) {
+    vis_sort_run(vis_sort_count, parts, nthreads);
+
+    // turn the counts into where each thread's first event of each bucket
+    // goes: after the smaller buckets, and after the earlier threads' events
+    // of its own bucket
+    size_t offset = 0;
+    bool shared = false;
+    for (b = 0; b < VIS_RADIX_BUCKETS; b++) {
+      size_t bucket = offset;
+      for (t = 0; t < nthreads; t++) {
+        size_t count = sort.counts[(size_t) t * VIS_RADIX_BUCKETS + b];
+        sort.counts[(size_t) t * VIS_RADIX_BUCKETS + b] = offset;
+        offset += count;
+      }
+      shared |= offset - bucket == n;
     }
+    if (shared) continue;
+
+    vis_sort_run(vis_sort_move, parts, nthreads);
+    VisEvent* swap = sort.src;
+    sort.src = sort.dst;
+    sort.dst = swap;
   }
+
+  free(sort.counts);
+  return sort.src;
 }
 
 // Returns a tree value suitable for insertion into the active list that
 // corresponds to the given VisEvent, i.e. having the same distance key and
-// gradient.
-TreeValue* vis_tree_value_for_event(VisEvent* vis_event) {
-  TreeValue* tree_value = malloc(sizeof(TreeValue));
-  assert(tree_value);
-  tree_value->key = vis_event->distance;
-  tree_value->gradient = vis_event->gradient;
+// gradient. The tree keeps its own copy, so the value lives on the stack.
+static TreeValue vis_tree_value_for_event(VisEvent* vis_event) {
+  TreeValue tree_value = { .key = vis_event_distance(vis_event->key),
+                           .gradient = vis_event->gradient };
   return tree_value;
 }
 
 // Returns a dummy tree value with a distance larger than any for any real
 // target point.
-TreeValue* vis_tree_value_dummy() {
-  TreeValue* tree_value = malloc(sizeof(TreeValue));
-  assert(tree_value);
-  tree_value->key = FLT_MAX;
-  tree_value->gradient = 0;
+static TreeValue vis_tree_value_dummy(void) {
+  TreeValue tree_value = { .key = FLT_MAX, .gradient = 0 };
   return tree_value;
 }
 
+// Returns a new context for sweeps, with nothing allocated yet, which sorts
+// on nthreads threads (0 for one per processor) and keeps the ranked active
+// list.
+VisContext* vis_context_init(int nthreads) {
+  VisContext* vis_context = calloc(1, sizeof(VisContext));
+  assert(vis_context);
+  vis_context->nthreads = (nthreads > 0) ? nthreads : gridio_default_threads();
+  vis_context->active_kind = vis_active_ranked;
+  return vis_context;
+}
+
+// Frees the context, its scratch arrays and its active lists.
+void vis_context_free(VisContext* vis_context) {
+  if (vis_context->active_list) {
+    deleteTree(vis_context->active_list);
+    free(vis_context->active_list);
+  }
+  if (vis_context->ranked_list) {
+    ranktree_free(vis_context->ranked_list);
+  }
+  free(vis_context->ranks);
+  free(vis_context->events);
+  free(vis_context->scratch);
+  free(vis_context->squares);
+  free(vis_context);
+}
+
+// Returns the context's event array with room for at least n events, growing
+// it and the scratch space to sort it in if they are too small. What they
+// held before is not kept.
+static VisEvent* vis_context_events(VisContext* vis_context, size_t n) {
+  if (n > vis_context->events_cap) {
+    free(vis_context->events);
+    free(vis_context->scratch);
+    vis_context->events = malloc((n ? n : 1) * sizeof(VisEvent));
+    vis_context->scratch = malloc((n ? n : 1) * sizeof(VisEvent));
+    assert(vis_context->events && vis_context->scratch);
+    vis_context->events_cap = n;
+  }
+  return vis_context->events;
+}
+
+// Returns the context's active list, seeded with a dummy node since our tree
+// implementation must always have at least 1 node. The tree and its pool of
+// nodes are made by the first sweep and emptied for each one after.
+static RBTree* vis_context_active_list(VisContext* vis_context) {
+  if (vis_context->active_list) {
+    resetTree(vis_context->active_list, vis_tree_value_dummy());
+  } else {
+    vis_context->active_list = createTree(vis_tree_value_dummy());
+  }
+  return vis_context->active_list;
+}
+
+// Adds the target of a start event to the sweep's active list.
+static inline void vis_active_insert(VisContext* vis_context, VisEvent* vis_event) {
+  if (vis_context->active_kind == vis_active_ranked) {
+    ranktree_set(vis_context->ranked_list, vis_context->ranks[2 * vis_event->target],
+                 vis_event->gradient);
+  } else {
+    insertInto(vis_context->active_list, vis_tree_value_for_event(vis_event));
+  }
+}
+
+// Removes the target of an end event from the sweep's active list. The tree
+// removes a node at the target's distance, which may be another target's.
+static inline void vis_active_delete(VisContext* vis_context, VisEvent* vis_event) {
+  if (vis_context->active_kind == vis_active_ranked) {
+    ranktree_set(vis_context->ranked_list, vis_context->ranks[2 * vis_event->target],
+                 -INFINITY);
+  } else {
+    deleteFrom(vis_context->active_list, vis_event_distance(vis_event->key));
+  }
+}
+
+// Returns the highest gradient in the sweep's active list of the targets
+// nearer than the target of a query event, -INFINITY if there are none.
+static inline float vis_active_max_nearer(VisContext* vis_context, VisEvent* vis_event) {
+  if (vis_context->active_kind == vis_active_ranked) {
+    return ranktree_max_below(vis_context->ranked_list,
+                              vis_context->ranks[2 * vis_event->target + 1]);
+  }
+  return findMaxGradientWithinKey(vis_context->active_list,
+                                  vis_event_distance(vis_event->key));
+}
+
+// Returns the context's array of squares with room for at least n of them,
+// as vis_context_events.
+static VisSquare** vis_context_squares(VisContext* vis_context, size_t n) {
+  if (n > vis_context->squares_cap) {
+    free(vis_context->squares);
+    vis_context->squares = malloc((n ? n : 1) * sizeof(VisSquare*));
+    assert(vis_context->squares);
+    vis_context->squares_cap = n;
+  }
+  return vis_context->squares;
+}
+
+// Returns the context's array of ranks with room for ntargets targets, as
+// vis_context_events.
+static uint32_t* vis_context_ranks(VisContext* vis_context, size_t ntargets) {
+  if (ntargets > vis_context->ranks_cap) {
+    free(vis_context->ranks);
+    vis_context->ranks = malloc((ntargets ? ntargets : 1) * 2 * sizeof(uint32_t));
+    assert(vis_context->ranks);
+    vis_context->ranks_cap = ntargets;
+  }
+  return vis_context->ranks;
+}
+
+// Ranks the targets of the nevents events, made three to a target, for the
+// ranked active list: ranks[2 * target] is the target's rank, its place in
+// order of distance, and ranks[2 * target + 1] the number of targets nearer
+// than it, which are the ranks its query looks at. Targets at the same
+// distance take ranks in the order their events were made. The distances are
+// sorted in the context's scratch space, before the events are.
+static void vis_context_rank(VisContext* vis_context, VisEvent* events,
+                             size_t nevents, size_t ntargets) {
+  size_t n = nevents / 3;
+  size_t i, nearer = 0;
+  uint32_t* ranks = vis_context_ranks(vis_context, ntargets);
+  VisEvent* by_distance = vis_context->scratch;
+  for (i = 0; i < n; i++) {
+    by_distance[i].key = (events[3 * i].key & UINT32_MAX) >> 2;
+    by_distance[i].target = events[3 * i].target;
+  }
+  by_distance = vis_sort_events(by_distance, by_distance + n, n,
+                                vis_context->nthreads);
+  for (i = 0; i < n; i++) {
+    if (by_distance[i].key != by_distance[nearer].key) nearer = i;
+    ranks[2 * by_distance[i].target] = i;
+    ranks[2 * by_distance[i].target + 1] = nearer;
+  }
+}
+
+// Starts the active list of a sweep, of the kind the context keeps, for the
+// nevents events of ntargets targets in the context's event array, and adds
+// the targets on the initial sweep line: those whose start event was made
+// last of their three.
+static void vis_context_active_start(VisContext* vis_context, size_t nevents,
+                                     size_t ntargets) {
+  VisEvent* events = vis_context->events;
+  size_t i;
+  if (vis_context->active_kind == vis_active_ranked) {
+    if (!vis_context->ranked_list) {
+      vis_context->ranked_list = ranktree_init();
+    }
+    vis_context_rank(vis_context, events, nevents, ntargets);
+    ranktree_reset(vis_context->ranked_list, nevents / 3);
+  } else {
+    vis_context_active_list(vis_context);
+  }
+  for (i = 0; i + 2 < nevents; i += 3) {
+    if (vis_event_type(events[i + 2].key) == vis_start_event) {
+      vis_active_insert(vis_context, &events[i + 2]);
+    }
+  }
+}
+
+// Keeps the elevations of elev_grid in 16 bits for the sweeps (see
+// grid_quantize), halving what they take, but only if that can not change any
+// answer decided by more than tolerance (see grid_quantize_safe); a tolerance
+// of 0 quantizes only grids it keeps exactly. Returns true iff the grid is
+// quantized; otherwise its floats are left as they are.
+bool vis_quantize(Grid* elev_grid, float tolerance) {
+  if (!elev_grid->qdata) {
+    float error = grid_quantize_error(elev_grid, 0);
+    if (4 * error > tolerance) {
+      return false;
+    }
+    grid_quantize(elev_grid, 0);
+    // every decoded height must be within the error measured above, or the
+    // answers could move further than tolerance allows
+    if (elev_grid->q_error > error) {
+      fprintf(stderr, "vis: quantizing moved a cell by %g, more than the %g "
+              "measured\n", elev_grid->q_error, error);
+      exit(1);
+    }
+  }
+  return grid_quantize_safe(elev_grid, tolerance);
+}
+
 // Compute the viewshed based on the given elev grid from the viewpoint
 // (v_r, v_c), returning the viewshed grid. Returns NULL if the given viewpoint
 // is a nodata point.
 Grid* vis_compute_vshed(Grid* elev_grid, int v_r, int v_c) {
+  return vis_compute_vshed_within(elev_grid, v_r, v_c, 0, false);
+}
+
+// Compute the viewshed from the viewpoint (v_r, v_c) out to the given radius,
+// in cells. Only the cells of the window around the viewpoint that the radius
+// reaches get events, so the work depends on the radius rather than on the
+// size of the grid. Cells further than the radius are occluded. If crop is
+// set the returned grid is just that window, with its header moved to match;
+// otherwise it is the size of elev_grid. A radius of 0 is no limit.
+Grid* vis_compute_vshed_within(Grid* elev_grid, int v_r, int v_c, int radius,
+                               bool crop) {
+  VisContext* vis_context = vis_context_init(0);
+  Grid* vshed_grid = vis_compute_vshed_in(vis_context, elev_grid, v_r, v_c,
+                                          radius, crop);
+  vis_context_free(vis_context);
+  return vshed_grid;
+}
+
+// As vis_compute_vshed_within, with the events kept in vis_context, so that
+// a run of sweeps allocates them once rather than for every viewpoint.
+Grid* vis_compute_vshed_in(VisContext* vis_context, Grid* elev_grid, int v_r,
+                           int v_c, int radius, bool crop) {
   // we can not reasonably copmute the viewshed from a nodata viewpoint
   assert(!grid_get_nodata(elev_grid, v_r, v_c));
 
-  // initialize the visiblity storage
-  Grid* vshed_grid = grid_init_from(elev_grid);
+  // the window of cells the radius reaches
+  int r0 = 0, c0 = 0, r1 = elev_grid->nrows, c1 = elev_grid->ncols;
+  if (radius > 0) {
+    r0 = maxi(r0, v_r - radius);
+    c0 = maxi(c0, v_c - radius);
+    r1 = mini(r1, v_r + radius + 1);
+    c1 = mini(c1, v_c + radius + 1);
+  }
 
-  // initialize the active list. seed the tree with a dummy node since our
-  // tree implementation must always have at least 1 node
-  int num_non_viewpoint_cells = (elev_grid->nrows * elev_grid->ncols) - 1;
-  int num_vis_tree_values = 1 + v_c + num_non_viewpoint_cells;
-  int iVTV = 0;
-  TreeValue** vis_tree_values = malloc(num_vis_tree_values * sizeof(TreeValue*));
-  TreeValue* vis_tree_value = vis_tree_value_dummy();
-  vis_tree_values[iVTV++] = vis_tree_value;
-  RBTree* active_list = createTree(*vis_tree_value);
+  // initialize the visiblity storage. cells out of range are never looked
+  // at, so they are set occluded up front. the viewshed is written at
+  // (o_r + t_r, o_c + t_c)
+  Grid* vshed_grid;
+  int o_r = 0, o_c = 0;
+  int t_r, t_c;
+  if (crop) {
+    vshed_grid = grid_init_from_sized(elev_grid, r1 - r0, c1 - c0);
+    vshed_grid->xllcorner += c0 * elev_grid->cellsize;
+    vshed_grid->yllcorner += (elev_grid->nrows - r1) * elev_grid->cellsize;
+    o_r = -r0;
+    o_c = -c0;
+  } else {
+    vshed_grid = grid_init_from(elev_grid);
+  }
+  if (radius > 0) {
+    for (t_r = 0; t_r < vshed_grid->nrows; t_r++) {
+      for (t_c = 0; t_c < vshed_grid->ncols; t_c++) {
+        grid_set(vshed_grid, t_r, t_c, vis_grid_occluded);
+      }
+    }
+  }
+
+  // count the cells that get events
+  long num_non_viewpoint_cells = 0;
+  for (t_r = r0; t_r < r1; t_r++) {
+    for (t_c = c0; t_c < c1; t_c++) {
+      if (!((t_r == v_r) && (t_c == v_c)) &&
+          vis_within_radius(v_r, v_c, t_r, t_c, radius)) {
+        num_non_viewpoint_cells++;
+      }
+    }
+  }
 
   // initialize and populate the events list with the start, end, and query
-  // for each point in the grid
+  // for each point in the grid. each event holds where its cell is in the
+  // window
+  int w_c = c1 - c0;
+  assert((long long) (r1 - r0) * w_c <= UINT32_MAX);
   float v_r_f = (float) v_r;
   float v_c_f = (float) v_c;
-  int t_r, t_c;
-  int num_vis_events = num_non_viewpoint_cells * 3;
-  VisEvent** vis_events = malloc(num_vis_events * sizeof(VisEvent*));
-  assert(vis_events);
-  int i = 0;
-  for (t_r = 0; t_r < elev_grid->nrows; t_r++) {
-    for (t_c = 0; t_c < elev_grid->ncols; t_c++) {
+  long num_vis_events = num_non_viewpoint_cells * 3;
+  VisEvent* vis_events = vis_context_events(vis_context, num_vis_events);
+  long i = 0;
+  for (t_r = r0; t_r < r1; t_r++) {
+    for (t_c = c0; t_c < c1; t_c++) {
       float t_r_f = (float) t_r;
       float t_c_f = (float) t_c;
       float alpha_ll, alpha_lr, alpha_ul, alpha_ur, alpha_min, alpha_ct, alpha_max;
 
-      // don't add events for the viewpoint itself
-      if (!((t_r == v_r) && (t_c == v_c))) {
+      // don't add events for the viewpoint itself, or out of range cells
+      if (!((t_r == v_r) && (t_c == v_c)) &&
+          vis_within_radius(v_r, v_c, t_r, t_c, radius)) {
         alpha_ll = vis_swept_alpha(v_r_f, v_c_f, t_r_f - 0.5, t_c_f - 0.5);
         alpha_lr = vis_swept_alpha(v_r_f, v_c_f, t_r_f - 0.5, t_c_f + 0.5);
         alpha_ul = vis_swept_alpha(v_r_f, v_c_f, t_r_f + 0.5, t_c_f - 0.5);
@@ -118,53 +460,53 @@ Grid* vis_compute_vshed(Grid* elev_grid, int v_r, int v_c) {
         alpha_min = min4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
         alpha_max = max4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
 
-        // include the cells on the initial sweep line in the active list
+        // the cells on the initial sweep line start active, and their start
+        // event comes last
+        uint32_t target = (uint32_t) (t_r - r0) * w_c + (t_c - c0);
         if ((t_r == v_r) && (t_c < v_c)) {
-          vis_events[i] =   vis_event_init(vis_query_event, elev_grid, v_r, v_c, t_r, t_c, alpha_ct);
-          vis_events[i+1] = vis_event_init(vis_end_event,   elev_grid, v_r, v_c, t_r, t_c, alpha_min);
-          vis_events[i+2] = vis_event_init(vis_start_event, elev_grid, v_r, v_c, t_r, t_c, alpha_max);
-
-          vis_tree_value = vis_tree_value_for_event(vis_events[i+2]);
-          insertInto(active_list, *vis_tree_value);
-          vis_tree_values[iVTV++] = vis_tree_value;
+          vis_event_init(&vis_events[i],   vis_query_event, elev_grid, v_r, v_c, t_r, t_c, target, alpha_ct);
+          vis_event_init(&vis_events[i+1], vis_end_event,   elev_grid, v_r, v_c, t_r, t_c, target, alpha_min);
+          vis_event_init(&vis_events[i+2], vis_start_event, elev_grid, v_r, v_c, t_r, t_c, target, alpha_max);
         } else {
-          vis_events[i] =   vis_event_init(vis_start_event, elev_grid, v_r, v_c, t_r, t_c, alpha_min);
-          vis_events[i+1] = vis_event_init(vis_query_event, elev_grid, v_r, v_c, t_r, t_c, alpha_ct);
-          vis_events[i+2] = vis_event_init(vis_end_event,   elev_grid, v_r, v_c, t_r, t_c, alpha_max);
+          vis_event_init(&vis_events[i],   vis_start_event, elev_grid, v_r, v_c, t_r, t_c, target, alpha_min);
+          vis_event_init(&vis_events[i+1], vis_query_event, elev_grid, v_r, v_c, t_r, t_c, target, alpha_ct);
+          vis_event_init(&vis_events[i+2], vis_end_event,   elev_grid, v_r, v_c, t_r, t_c, target, alpha_max);
         }
         i += 3;
       }
     }
   }
 
+  // initialize the active list with the cells on the initial sweep line
+  vis_context_active_start(vis_context, num_vis_events, (size_t) (r1 - r0) * w_c);
+
   // sort the events list
-  qsort(vis_events, num_vis_events, sizeof(VisEvent*), vis_events_in_increasing_alpha);
+  vis_events = vis_sort_events(vis_events, vis_context->scratch, num_vis_events,
+                               vis_context->nthreads);
 
   // we say that the viewpoint is visible
-  grid_set(vshed_grid, v_r, v_c, vis_grid_visible);
+  grid_set(vshed_grid, o_r + v_r, o_c + v_c, vis_grid_visible);
 
   // process the sorted events to compute visibility of the points
   for (i = 0; i < num_vis_events; i++) {
-    VisEvent* vis_event = vis_events[i];
-    char event_type = vis_event->event_type;
-    t_r = vis_event->t_r;
-    t_c = vis_event->t_c;
+    VisEvent* vis_event = &vis_events[i];
+    char event_type = vis_event_type(vis_event->key);
+    t_r = r0 + vis_event->target / w_c;
+    t_c = c0 + vis_event->target % w_c;
 
     // start event
     if (event_type == vis_start_event) {
-      vis_tree_value = vis_tree_value_for_event(vis_event);
-      insertInto(active_list, *vis_tree_value);
-      vis_tree_values[iVTV++] = vis_tree_value;
+      vis_active_insert(vis_context, vis_event);
 
     // end event
     } else if (event_type == vis_end_event) {
-      deleteFrom(active_list, vis_event->distance);
+      vis_active_delete(vis_context, vis_event);
 
     // query event
     } else if (event_type == vis_query_event) {
       // points with nodata elevation have nodata visibility
       if (grid_get_nodata(elev_grid, t_r, t_c)) {
-        grid_set_nodata(vshed_grid, t_r, t_c);
+        grid_set_nodata(vshed_grid, o_r + t_r, o_c + t_c);
 
       // otherwise find in the active list the highest gradient of
       // the points closer to the viewpoint than the target point
@@ -172,24 +514,14 @@ Grid* vis_compute_vshed(Grid* elev_grid, int v_r, int v_c) {
       // from the active list
       } else {
         float target_gradient = vis_event->gradient;
-        float max_gradient = findMaxGradientWithinKey(active_list, vis_event->distance);
-        grid_set(vshed_grid, t_r, t_c,
+        float max_gradient = vis_active_max_nearer(vis_context, vis_event);
+        grid_set(vshed_grid, o_r + t_r, o_c + t_c,
           (target_gradient >= max_gradient) ?
           vis_grid_visible : vis_grid_occluded);
       }
     }
   }
 
-  // free resources used internally
-  for (i = 0; i < num_vis_events; i++) { free(vis_events[i]); }
-  free(vis_events);
-
-  for (i = 0; i < num_vis_tree_values; i++) { free(vis_tree_values[i]); }
-  free(vis_tree_values);
-
-  deleteTree(active_list);
-  free(active_list);
-
   // return the vshed result
   return vshed_grid;
 }
@@ -208,32 +540,190 @@ int vis_count_vshed(Grid* vshed_grid) {
   return count;
 }
 
-// Computes and counts the exact viewshed at (r,c) for the given grid.
-int vis_compute_vcount_at(Grid* elev_grid, int r, int c) {
-  Grid* vshed_grid = vis_compute_vshed(elev_grid, r, c);
-  int count = vis_count_vshed(vshed_grid);
-  grid_free(vshed_grid);
+// Returns the events of sweeps over a grid of nrows by ncols from any of its
+// cells, sorted on nthreads threads (0 for one per processor). The angle and
+// distance of a cell from the viewpoint depend only on its offset from it, so
+// every offset a grid of this shape has gets its start, query and end events
+// here, and the sweep from a viewpoint is the walk of these that skips the
+// offsets that fall off the grid. Those are in the same order as the sweep's
+// own events would be sorted, ties included, as the events are made in the
+// same order. It takes 48 bytes for each offset, about four times the cells
+// of the grid.
+VisTable* vis_table_init(int nrows, int ncols, int nthreads) {
+  VisTable* table = malloc(sizeof(VisTable));
+  long long noffsets = (2LL * nrows - 1) * (2LL * ncols - 1) - 1;
+  int d_r, d_c;
+  assert(table);
+  assert(noffsets <= UINT32_MAX);
+  if (nthreads <= 0) nthreads = gridio_default_threads();
+  table->nrows = nrows;
+  table->ncols = ncols;
+  table->nevents = noffsets * 3;
+
+  // make the events as vis_compute_vshed_in does from a viewpoint at (0, 0),
+  // each holding the number of its offset, and sort them
+  VisEvent* vis_events = malloc(table->nevents * sizeof(VisEvent));
+  VisEvent* scratch = malloc(table->nevents * sizeof(VisEvent));
+  int32_t* offsets = malloc(noffsets * 2 * sizeof(int32_t));
+  assert(vis_events && scratch && offsets);
+  uint32_t k = 0;
+  size_t i = 0;
+  for (d_r = 1 - nrows; d_r < nrows; d_r++) {
+    for (d_c = 1 - ncols; d_c < ncols; d_c++) {
+      float t_r_f = (float) d_r;
+      float t_c_f = (float) d_c;
+      float alpha_ll, alpha_lr, alpha_ul, alpha_ur, alpha_min, alpha_ct, alpha_max;
+      float distance = dist2di(0, 0, d_r, d_c);
+      if (d_r == 0 && d_c == 0) continue;
+      alpha_ll = vis_swept_alpha(0, 0, t_r_f - 0.5, t_c_f - 0.5);
+      alpha_lr = vis_swept_alpha(0, 0, t_r_f - 0.5, t_c_f + 0.5);
+      alpha_ul = vis_swept_alpha(0, 0, t_r_f + 0.5, t_c_f - 0.5);
+      alpha_ur = vis_swept_alpha(0, 0, t_r_f + 0.5, t_c_f + 0.5);
+      alpha_ct = vis_swept_alpha(0, 0, t_r_f, t_c_f);
+      alpha_min = min4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
+      alpha_max = max4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
+      if ((d_r == 0) && (d_c < 0)) {
+        vis_events[i].key =   vis_event_key(alpha_ct,  distance, vis_query_event);
+        vis_events[i+1].key = vis_event_key(alpha_min, distance, vis_end_event);
+        vis_events[i+2].key = vis_event_key(alpha_max, distance, vis_start_event);
+      } else {
+        vis_events[i].key =   vis_event_key(alpha_min, distance, vis_start_event);
+        vis_events[i+1].key = vis_event_key(alpha_ct,  distance, vis_query_event);
+        vis_events[i+2].key = vis_event_key(alpha_max, distance, vis_end_event);
+      }
+      vis_events[i].target = vis_events[i+1].target = vis_events[i+2].target = k;
+      offsets[2 * k] = d_r;
+      offsets[2 * k + 1] = d_c;
+      i += 3;
+      k++;
+    }
+  }
+  VisEvent* sorted = vis_sort_events(vis_events, scratch, table->nevents, nthreads);
+
+  // swap the number of each offset for the offset, which the walk wants
+  table->events = malloc(table->nevents * sizeof(VisTableEvent));
+  assert(table->events);
+  for (i = 0; i < table->nevents; i++) {
+    table->events[i].key = sorted[i].key;
+    table->events[i].d_r = offsets[2 * sorted[i].target];
+    table->events[i].d_c = offsets[2 * sorted[i].target + 1];
+  }
+  free(vis_events);
+  free(scratch);
+  free(offsets);
+  return table;
+}
+
+// Frees the table.
+void vis_table_free(VisTable* table) {
+  free(table->events);
+  free(table);
+}
+
+// Returns the size of the viewshed from (v_r, v_c), which is not nodata,
+// counted from the sweep of the table's events for the cells of elev_grid, a
+// grid of the table's shape. It is the same as vis_count_vshed of the
+// viewshed vis_compute_vshed would make. Any number of threads can walk one
+// table at once, each with its own context.
+int vis_table_count_vshed(VisContext* vis_context, VisTable* table,
+                          Grid* elev_grid, int v_r, int v_c) {
+  float v_elev = grid_get(elev_grid, v_r, v_c);
+  int count = 1;
+  int t_c;
+  size_t i;
+  assert(elev_grid->nrows == table->nrows && elev_grid->ncols == table->ncols);
+  assert(!grid_get_nodata(elev_grid, v_r, v_c));
+
+  // seed the tree with the dummy node and the cells on the initial sweep
+  // line, which vis_compute_vshed_in also starts with
+  RBTree* active_list = vis_context_active_list(vis_context);
+  for (t_c = 0; t_c < v_c; t_c++) {
+    float distance = dist2di(v_r, v_c, v_r, t_c);
+    TreeValue tree_value = { .key = distance,
+                             .gradient = ((float) grid_get(elev_grid, v_r, t_c) - v_elev) / distance };
+    insertInto(active_list, tree_value);
+  }
+
+  for (i = 0; i < table->nevents; i++) {
+    VisTableEvent* vis_event = &table->events[i];
+    int t_r = v_r + vis_event->d_r;
+    t_c = v_c + vis_event->d_c;
+    if (t_r < 0 || t_r >= table->nrows || t_c < 0 || t_c >= table->ncols) {
+      continue;
+    }
+    char event_type = vis_event_type(vis_event->key);
+    float distance = vis_event_distance(vis_event->key);
+
+    if (event_type == vis_start_event) {
+      TreeValue tree_value = { .key = distance,
+                               .gradient = ((float) grid_get(elev_grid, t_r, t_c) - v_elev) / distance };
+      insertInto(active_list, tree_value);
+    } else if (event_type == vis_end_event) {
+      deleteFrom(active_list, distance);
+    } else if (!grid_get_nodata(elev_grid, t_r, t_c)) {
+      float target_gradient = ((float) grid_get(elev_grid, t_r, t_c) - v_elev) / distance;
+      if (target_gradient >= findMaxGradientWithinKey(active_list, distance)) {
+        count++;
+      }
+    }
+  }
+
   return count;
 }
 
-// Computes the viewshed count for each point in the map and returns a grid
-// representing these counts.
-Grid* vis_compute_vcount(Grid* elev_grid) {
-  // compute vcounts
-  Grid* vcount_grid = grid_init_from(elev_grid);
+// What the threads counting viewsheds share.
+typedef struct vis_vcount_t {
+  VisTable* table;
+  Grid*     elev_grid;
+  Grid*     vcount_grid;
+  int       next_row;
+} VisVcount;
+
+// Counts the viewsheds of the rows a thread takes, one row at a time.
+static void* vis_vcount_rows(void* arg) {
+  VisVcount* vcount = arg;
+  Grid* elev_grid = vcount->elev_grid;
+  VisContext* vis_context = vis_context_init(1);
   int r, c;
-  for (r = 0; r < elev_grid->nrows; r++) {
-
+  while ((r = __sync_fetch_and_add(&vcount->next_row, 1)) < elev_grid->nrows) {
     for (c = 0; c < elev_grid->ncols; c++) {
       if (grid_get_nodata(elev_grid, r, c)) {
-        grid_set_nodata(vcount_grid, r, c);
+        grid_set_nodata(vcount->vcount_grid, r, c);
       } else {
-        grid_set(vcount_grid, r, c, vis_compute_vcount_at(elev_grid, r, c));
+        grid_set(vcount->vcount_grid, r, c,
+                 vis_table_count_vshed(vis_context, vcount->table, elev_grid, r, c));
       }
     }
   }
+  vis_context_free(vis_context);
+  return NULL;
+}
 
-  return vcount_grid;
+// Computes the viewshed count for each point in the map and returns a grid
+// representing these counts, on nthreads threads (0 for one per processor).
+// The events are made and sorted once for the whole grid (see
+// vis_table_init), and each thread sweeps from the viewpoints of the rows it
+// takes with its own active list.
+Grid* vis_compute_vcount(Grid* elev_grid, int nthreads) {
+  VisVcount vcount;
+  int t;
+  if (nthreads <= 0) nthreads = gridio_default_threads();
+  vcount.table = vis_table_init(elev_grid->nrows, elev_grid->ncols, nthreads);
+  vcount.elev_grid = elev_grid;
+  vcount.vcount_grid = grid_init_from(elev_grid);
+  vcount.next_row = 0;
+
+  pthread_t threads[nthreads];
+  for (t = 1; t < nthreads; t++) {
+    pthread_create(&threads[t], NULL, vis_vcount_rows, &vcount);
+  }
+  vis_vcount_rows(&vcount);
+  for (t = 1; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  vis_table_free(vcount.table);
+
+  return vcount.vcount_grid;
 }
 
 // Simple constructor for VisSquare structs.
@@ -404,84 +894,53 @@ float vis_square_center_c(VisSquare*square) {
   return square->c + ((square->size - 1) / 2.0);
 }
 
-// Returns a tree value suitable for insertion into the active list that
-// corresponds to the given VisSquareEvent, i.e. having the same distance key
-// and  gradient.
-TreeValue* vis_tree_value_for_square_event(VisSquareEvent* vis_square_event) {
-  TreeValue* tree_value = malloc(sizeof(TreeValue));
-  assert(tree_value);
-  tree_value->key = vis_square_event->distance;
-  tree_value->gradient = vis_square_event->gradient;
-  return tree_value;
-}
-
-// Constructs and returns a new VisSquareEvent.
-VisSquareEvent* vis_square_event_init(char event_type, VisSquare* v_square, VisSquare* t_square, float v_r, float v_c, float t_r, float t_c, float alpha) {
-  VisSquareEvent* vis_square_event = malloc(sizeof(VisSquareEvent));
-  assert(vis_square_event);
-  vis_square_event->event_type = event_type;
-  vis_square_event->t_square = t_square;
-  vis_square_event->alpha = alpha;
-  vis_square_event->distance = dist2d(v_r, v_c, t_r, t_c);
-  vis_square_event->gradient = (t_square->elev - v_square->elev) / vis_square_event->distance;
-  return vis_square_event;
-}
-
-// A comparator to sort square events in increasing sweep angle. We break ties
-// in order of increasing distance and then in <end, query, start> order to
-// ensure that we never have multiple nodes in the active list that have the
-// same distance, as this can cause undetermined behavior on deletion.
-int vis_square_events_in_increasing_alpha(const void* elem_a, const void* elem_b) {
-  VisSquareEvent* vis_square_event_a = *((VisSquareEvent**) elem_a);
-  VisSquareEvent* vis_square_event_b = *((VisSquareEvent**) elem_b);
-
-  if (vis_square_event_a->alpha < vis_square_event_b->alpha) {
-    return -1;
-  } else if (vis_square_event_a->alpha > vis_square_event_b->alpha) {
-    return 1;
-  } else {
-    if (vis_square_event_a->distance < vis_square_event_b->distance) {
-      return -1;
-    } else if (vis_square_event_a->distance > vis_square_event_b->distance) {
-      return 1;
-    } else {
-      return vis_square_event_a->event_type - vis_square_event_b->event_type;
-    }
-  }
+// Fills in vis_event, one of the events of an approximate sweep. target is
+// the index of t_square among the squares of the sweep.
+static void vis_square_event_init(VisEvent* vis_event, char event_type, VisSquare* v_square, VisSquare* t_square, uint32_t target, float v_r, float v_c, float t_r, float t_c, float alpha) {
+  float distance = dist2d(v_r, v_c, t_r, t_c);
+  vis_event->key = vis_event_key(alpha, distance, event_type);
+  vis_event->target = target;
+  vis_event->gradient = (t_square->elev - v_square->elev) / distance;
 }
 
 // Compute the aprox. viewshed based on the given elev grid from the viewpoint
 // represented by v_square, returning the viewshed grid.
 // Returns NULL if the given viewpoint is a nodata sqaure.
 Grid* vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square) {
+  VisContext* vis_context = vis_context_init(0);
+  Grid* vshed_grid = vis_compute_avshed_in(vis_context, elev_grid, squares,
+                                           v_square);
+  vis_context_free(vis_context);
+  return vshed_grid;
+}
+
+// As vis_compute_avshed, with the events kept in vis_context.
+Grid* vis_compute_avshed_in(VisContext* vis_context, Grid* elev_grid,
+                            LList* squares, VisSquare* v_square) {
   // we can not reasonably compute the viewshed from a nodata viewpoint.
   assert(!vis_square_is_nodata(v_square, elev_grid));
 
   // initialize the visiblity storage
   Grid* vshed_grid = grid_init_from(elev_grid);
 
-  // initialize the active list. seed the tree with a dummy node since our
-  // tree implementation must always have at least 1 node
-  LList* vis_tree_values = llist_init();
-  TreeValue* vis_tree_value = vis_tree_value_dummy();
-  llist_insert(vis_tree_values, vis_tree_value);
-  RBTree* active_list = createTree(*vis_tree_value);
-
   // approximate the viewpoint at the center of the v_square
   float v_r_f = vis_square_center_r(v_square);
   float v_c_f = vis_square_center_c(v_square);
 
   // initialize and populate the events list with the start, end, and query
-  // for each point in the grid
-  int num_vis_square_events = (llist_count(squares) - 1) * 3;
-  VisSquareEvent** vis_square_events = malloc(num_vis_square_events * sizeof(VisSquareEvent*));
-  assert(vis_square_events);
-  int i = 0;
+  // for each point in the grid. each event holds the index of its square in
+  // the context's array of them
+  long num_vis_square_events = (llist_count(squares) - 1) * 3L;
+  VisEvent* vis_square_events = vis_context_events(vis_context, num_vis_square_events);
+  VisSquare** vis_squares = vis_context_squares(vis_context, llist_count(squares));
+  uint32_t target = 0;
+  long i = 0;
   LListNode* square_node = llist_head(squares);
   while (square_node) {
     VisSquare* square = (VisSquare*) llist_node_value(square_node);
     // don't add events for the viewpoint itself
     if (square != v_square) {
+      vis_squares[target] = square;
       float half_size = ((float) square->size) / 2.0;
       float t_r_f = vis_square_center_r(square);
       float t_c_f = vis_square_center_c(square);
@@ -493,27 +952,29 @@ Grid* vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square) {
       float alpha_min = min4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
       float alpha_max = max4f(alpha_ll, alpha_lr, alpha_ul, alpha_ur);
 
-      // include the cells on the initial sweep line in the active list
+      // the squares on the initial sweep line start active, and their start
+      // event comes last
       if (vis_square_intersects_initial_sweep(square, v_r_f, v_c_f)) {
-        vis_square_events[i] =   vis_square_event_init(vis_query_event, v_square, square, v_r_f, v_c_f, t_r_f, t_c_f, alpha_ct);
-        vis_square_events[i+1] = vis_square_event_init(vis_end_event,   v_square, square, v_r_f, v_c_f, t_r_f, t_c_f, alpha_min);
-        vis_square_events[i+2] = vis_square_event_init(vis_start_event, v_square, square, v_r_f, v_c_f, t_r_f, t_c_f, alpha_max);
-
-        vis_tree_value = vis_tree_value_for_square_event(vis_square_events[i+2]);
-        insertInto(active_list, *vis_tree_value);
-        llist_insert(vis_tree_values, vis_tree_value);
+        vis_square_event_init(&vis_square_events[i],   vis_query_event, v_square, square, target, v_r_f, v_c_f, t_r_f, t_c_f, alpha_ct);
+        vis_square_event_init(&vis_square_events[i+1], vis_end_event,   v_square, square, target, v_r_f, v_c_f, t_r_f, t_c_f, alpha_min);
+        vis_square_event_init(&vis_square_events[i+2], vis_start_event, v_square, square, target, v_r_f, v_c_f, t_r_f, t_c_f, alpha_max);
       } else {
-        vis_square_events[i] =   vis_square_event_init(vis_start_event, v_square, square, v_r_f, v_c_f, t_r_f, t_c_f, alpha_min);
-        vis_square_events[i+1] = vis_square_event_init(vis_query_event, v_square, square, v_r_f, v_c_f, t_r_f, t_c_f, alpha_ct);
-        vis_square_events[i+2] = vis_square_event_init(vis_end_event,   v_square, square, v_r_f, v_c_f, t_r_f, t_c_f, alpha_max);
+        vis_square_event_init(&vis_square_events[i],   vis_start_event, v_square, square, target, v_r_f, v_c_f, t_r_f, t_c_f, alpha_min);
+        vis_square_event_init(&vis_square_events[i+1], vis_query_event, v_square, square, target, v_r_f, v_c_f, t_r_f, t_c_f, alpha_ct);
+        vis_square_event_init(&vis_square_events[i+2], vis_end_event,   v_square, square, target, v_r_f, v_c_f, t_r_f, t_c_f, alpha_max);
       }
       i += 3;
+      target++;
     }
     square_node = llist_node_next(square_node);
   }
 
+  // initialize the active list with the squares on the initial sweep line
+  vis_context_active_start(vis_context, num_vis_square_events, target);
+
   // sort the events list
-  qsort(vis_square_events, num_vis_square_events, sizeof(VisSquareEvent*), vis_square_events_in_increasing_alpha);
+  vis_square_events = vis_sort_events(vis_square_events, vis_context->scratch,
+                                      num_vis_square_events, vis_context->nthreads);
 
   // we say that the all cells in the viewpoint's square are visible
   int j, k;
@@ -525,24 +986,22 @@ Grid* vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square) {
 
   // process the sorted events to compute visibility of the other sqaures
   for (i = 0; i < num_vis_square_events; i++) {
-    VisSquareEvent* vis_square_event = vis_square_events[i];
-    char event_type = vis_square_event->event_type;
+    VisEvent* vis_square_event = &vis_square_events[i];
+    char event_type = vis_event_type(vis_square_event->key);
 
     // start event
     if (event_type == vis_start_event) {
-      vis_tree_value = vis_tree_value_for_square_event(vis_square_event);
-      insertInto(active_list, *vis_tree_value);
-      llist_insert(vis_tree_values, vis_tree_value);
+      vis_active_insert(vis_context, vis_square_event);
 
     // end event
     } else if (event_type == vis_end_event) {
-      deleteFrom(active_list, vis_square_event->distance);
+      vis_active_delete(vis_context, vis_square_event);
 
     // query event
     } else if (event_type == vis_query_event) {
       // we need the square associated with this event so that we can set
       // visibility for all of the associated cells.
-      VisSquare* t_square = vis_square_event->t_square;
+      VisSquare* t_square = vis_squares[vis_square_event->target];
 
       // squares with nodata elevation have nodata visibility
       if (vis_square_is_nodata(t_square, elev_grid)) {
@@ -558,7 +1017,7 @@ Grid* vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square) {
       // from the active list
       } else {
         float target_gradient = vis_square_event->gradient;
-        float max_gradient = findMaxGradientWithinKey(active_list, vis_square_event->distance);
+        float max_gradient = vis_active_max_nearer(vis_context, vis_square_event);
         int visibility = (target_gradient >= max_gradient) ?
                            vis_grid_visible : vis_grid_occluded;
         for (j = 0; j < t_square->size; j++) {
@@ -570,15 +1029,6 @@ Grid* vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square) {
     }
   }
 
-  // free resources used internally
-  for (i = 0; i < num_vis_square_events; i++) { free(vis_square_events[i]); }
-  free(vis_square_events);
-
-  llist_destroy_with_values(vis_tree_values);
-
-  deleteTree(active_list);
-  free(active_list);
-
   // return the vshed result
   return vshed_grid;
 }
@@ -586,6 +1036,15 @@ Grid* vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square) {
 // Computes the approximate viewshed count for every point in the map and
 // returns a grid representing these counts.
 Grid* vis_compute_avcount(Grid* elev_grid, int epsilon) {
+  VisContext* vis_context = vis_context_init(0);
+  Grid* avcount_grid = vis_compute_avcount_in(vis_context, elev_grid, epsilon);
+  vis_context_free(vis_context);
+  return avcount_grid;
+}
+
+// As vis_compute_avcount, sweeping from every square with vis_context.
+Grid* vis_compute_avcount_in(VisContext* vis_context, Grid* elev_grid,
+                             int epsilon) {
   // simplify the grid into larger squares
   LList* approx_squares = vis_compute_approx_squares(elev_grid, epsilon);
 
@@ -601,7 +1060,7 @@ Grid* vis_compute_avcount(Grid* elev_grid, int epsilon) {
     if (vis_square_is_nodata(v_square, elev_grid)) {
       avcount = elev_grid->nodata_value;
     } else {
-      Grid* avshed_grid = vis_compute_avshed(elev_grid, approx_squares, v_square);
+      Grid* avshed_grid = vis_compute_avshed_in(vis_context, elev_grid, approx_squares, v_square);
       avcount = vis_count_vshed(avshed_grid);
       grid_free(avshed_grid);
     }
@@ -664,8 +1123,9 @@ Grid* vis_compute_nnvcount(Grid* vcount_grid, int hood_size) {
 
 // Compute the viewshed counts exactly for a every cell in a lower-resolution
 // version of the given grid, then use those counts to approximate view counts
-// for all cells in the original grid.
-Grid* vis_compute_svcount(Grid* elev_grid, int square_size) {
+// for all cells in the original grid. The counts are computed on nthreads
+// threads (0 for one per processor), as vis_compute_vcount does.
+Grid* vis_compute_svcount(Grid* elev_grid, int square_size, int nthreads) {
   // determine the size of the simplified grid
   int nsimprows = (elev_grid->nrows / square_size) + 1;
   int nsimpcols = (elev_grid->ncols / square_size) + 1;
@@ -697,7 +1157,7 @@ Grid* vis_compute_svcount(Grid* elev_grid, int square_size) {
   }
 
   // compute the exact viewcount on this simplified grid
-  Grid* simp_vcount_grid = vis_compute_vcount(simp_grid);
+  Grid* simp_vcount_grid = vis_compute_vcount(simp_grid, nthreads);
 
   // use these viewcounts to fill in viewcount values for corresponding cells
   // in the svcount grid.
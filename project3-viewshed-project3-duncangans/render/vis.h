@@ -2,18 +2,39 @@
 #define __vis_h
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
 #include "grid.h"
 #include "llist.h"
+#include "rbbst.h"
+#include "ranktree.h"
 
+// An event of a sweep. key packs the sweep angle (alpha) of the event, the
+// distance of its target from the viewpoint and the event type, so that
+// sorting events by key sorts them as the sweep takes them. target is where
+// the target is: its cell in the sweep's window, or its square.
 typedef struct vis_event_t {
-  char  event_type;
-  int   t_r;
-  int   t_c;
-  float alpha;
-  float distance;
-  float gradient;
+  uint64_t key;
+  uint32_t target;
+  float    gradient;
 } VisEvent;
 
+// An event of the sweeps from every viewpoint of a grid, for the target at
+// an offset of (d_r, d_c) from the viewpoint (see vis_table_init).
+typedef struct vis_table_event_t {
+  uint64_t key;
+  int32_t  d_r;
+  int32_t  d_c;
+} VisTableEvent;
+
+// The events of the sweeps over grids of one shape, sorted.
+typedef struct vis_table_t {
+  int            nrows;
+  int            ncols;
+  VisTableEvent* events;
+  size_t         nevents;
+} VisTable;
+
 typedef struct vis_square_t {
   int   r;
   int   c;
@@ -21,13 +42,29 @@ typedef struct vis_square_t {
   float elev;
 } VisSquare;
 
-typedef struct vis_square_event_t {
-  char  event_type;
-  float alpha;
-  float distance;
-  float gradient;
-  VisSquare* t_square;
-} VisSquareEvent;
+// Scratch space for sweeps. A run of sweeps that shares one (as
+// vis_compute_vcount does) allocates its events and active list once: the
+// arrays and the tree's pool only grow, and are kept until vis_context_free.
+// A context is for one sweep at a time; the sweep sorts its events on
+// nthreads threads. active_kind is the active list vis_compute_vshed_in and
+// vis_compute_avshed_in keep: the red-black tree of rbbst.c, or the
+// tournament tree over the targets ranked by distance of ranktree.c.
+typedef struct vis_context_t {
+  VisEvent*   events;
+  VisEvent*   scratch;      // room to sort events in
+  size_t      events_cap;
+  VisSquare** squares;      // of an approximate sweep, by event target
+  size_t      squares_cap;
+  RBTree*     active_list;
+  int         active_kind;  // vis_active_tree or vis_active_ranked
+  RankTree*   ranked_list;
+  uint32_t*   ranks;        // by target: its rank, and the ranks nearer it
+  size_t      ranks_cap;
+  int         nthreads;
+} VisContext;
+
+#define vis_active_tree   0
+#define vis_active_ranked 1
 
 #define vis_end_event   0
 #define vis_query_event 1
@@ -39,14 +76,49 @@ typedef struct vis_square_event_t {
 #define vis_grid_not_rooted 0
 #define vis_grid_rooted     1
 
+// Returns the angle in radians swept from point (v_r, v_c) to (t_r, t_c). This
+// angle is always between 0 and 2PI. It is inline so that horizon.c can share
+// it without linking the sweep.
+static inline float vis_swept_alpha(float v_r, float v_c, float t_r, float t_c) {
+  float y_delta = v_r - t_r;
+  float x_delta = v_c - t_c;
+  float a = atan2(y_delta, x_delta);
+  return (a >= 0) ? a : (2 * M_PI) + a;
+}
+
+// Returns true iff (t_r, t_c) is within radius cells of (v_r, v_c). A radius
+// of 0 is no limit. Inline for emvis.c, as above.
+static inline bool vis_within_radius(int v_r, int v_c, int t_r, int t_c, int radius) {
+  long long d_r = t_r - v_r;
+  long long d_c = t_c - v_c;
+  return (radius <= 0) ||
+         ((d_r * d_r) + (d_c * d_c) <= (long long) radius * radius);
+}
+
+VisContext* vis_context_init(int nthreads);
+void   vis_context_free(VisContext* vis_context);
 bool   vis_square_contains(VisSquare* square, int r, int c);
+bool   vis_quantize(Grid* elev_grid, float tolerance);
 Grid*  vis_compute_vshed(Grid* elev_grid, int v_r, int v_c);
+Grid*  vis_compute_vshed_within(Grid* elev_grid, int v_r, int v_c, int radius,
+                                bool crop);
+Grid*  vis_compute_vshed_in(VisContext* vis_context, Grid* elev_grid, int v_r,
+                            int v_c, int radius, bool crop);
 int    vis_count_vshed(Grid* vshed_grid);
-Grid*  vis_compute_vcount(Grid* elev_grid);
+VisTable* vis_table_init(int nrows, int ncols, int nthreads);
+void   vis_table_free(VisTable* table);
+int    vis_table_count_vshed(VisContext* vis_context, VisTable* table,
+                             Grid* elev_grid, int v_r, int v_c);
+Grid*  vis_compute_vcount(Grid* elev_grid, int nthreads);
 LList* vis_compute_approx_squares(Grid* elev_grid, int epsilon);
 Grid*  vis_compute_avshed(Grid* elev_grid, LList* squares, VisSquare* v_square);
+Grid*  vis_compute_avshed_in(VisContext* vis_context, Grid* elev_grid,
+                             LList* squares, VisSquare* v_square);
 Grid*  vis_compute_avcount(Grid* elev_grid, int epsilon);
+Grid*  vis_compute_avcount_in(VisContext* vis_context, Grid* elev_grid,
+                              int epsilon);
 Grid*  vis_compute_nnvcount(Grid* vcount_grid, int hood_size);
-Grid*  vis_compute_svcount(Grid* elev_grid, int square_size);
+Grid*  vis_compute_svcount(Grid* elev_grid, int square_size,
+                           int nthreads);
 
 #endif
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "grid.h"
+#include "gridio.h"
+#include "terrain.h"
+#include "vis.h"
+#include "utils.h"
+#include "rtimer.h"
+
+// Benchmark the viewshed engines end to end, on synthetic terrain (see
+// terrain.c) of each size asked for. r2, exact and simd are createViewshed's
+// engines, run through the viewshed program at each thread count; vshed,
+// avcount and svcount are the sweeps of vis.c, run in process at each thread
+// count too (their threads sort the events, and svcount's also sweep from its
+// viewpoints), and vshed-tree and avcount-tree the same sweeps keeping the
+// red-black tree as their active list rather than the ranked one, and
+// vshed-quantized, avcount-quantized and svcount-quantized the same sweeps over
+// the grid kept in 16 bits (see vis_quantize). Each run is a child process that
+// reads the grid, computes and writes the result to /dev/null, so its time and
+// peak memory are its own, and one that takes longer than the timeout is
+// stopped. What each run took goes to the CSV file.
+
+#define VSBENCH_SIZES     "1024,2048,4096"
+#define VSBENCH_THREADS   "1,2,4"
+#define VSBENCH_ENGINES   "r2,simd,vshed,avcount,svcount"
+#define VSBENCH_VIEWSHED  "../viewshed"
+#define VSBENCH_TIMEOUT   600
+#define VSBENCH_HOLES     0.02  // lakes of nodata, as a fraction of the cells
+#define VSBENCH_EPSILON   50    // how tight avcount's squares are, in meters
+#define VSBENCH_SIMP_SIDE 64    // svcount computes exactly on a grid this big
+#define VSBENCH_MAX_LIST  64
+
+// One run of an engine on a grid.
+typedef struct vsbench_run_t {
+  const char* engine;
+  int         threads;
+  const char* grid_path;
+  int         nrows;
+  int         ncols;
+  int         v_r;
+  int         v_c;
+  const char* viewshed;   // the viewshed program
+} VsbenchRun;
+
+// Returns true iff the engine is one of the viewshed program's.
+static bool vsbench_is_program(const char* engine) {
+  return !strcmp(engine, "r2") || !strcmp(engine, "exact") ||
+         !strcmp(engine, "simd");
+}
+
+// Returns true iff the engine is one of vis.c's sweeps.
+static bool vsbench_is_sweep(const char* engine) {
+  return !strcmp(engine, "vshed") || !strcmp(engine, "avcount") ||
+         !strcmp(engine, "svcount") || !strcmp(engine, "vshed-tree") ||
+         !strcmp(engine, "avcount-tree") || !strcmp(engine, "vshed-quantized") ||
+         !strcmp(engine, "avcount-quantized") ||
+         !strcmp(engine, "svcount-quantized");
+}
+
+// Parses a comma separated list of positive numbers into vals, and returns
+// how many there were, or 0 if one is not a positive number.
+static int vsbench_parse_numbers(const char* list, int* vals) {
+  int n = 0;
+  char* end;
+  while (*list && n < VSBENCH_MAX_LIST) {
+    vals[n] = strtol(list, &end, 10);
+    if (end == list || vals[n] < 1 || (*end && *end != ',')) {
+      return 0;
+    }
+    n++;
+    list = *end ? end + 1 : end;
+  }
+  return n;
+}
+
+// Splits a comma separated list of engines in place, and returns how many
+// there were, or 0 if one is unknown.
+static int vsbench_parse_engines(char* list, char** engines) {
+  int n = 0;
+  char* engine;
+  for (engine = strtok(list, ","); engine && n < VSBENCH_MAX_LIST;
+       engine = strtok(NULL, ",")) {
+    if (!vsbench_is_program(engine) && !vsbench_is_sweep(engine)) {
+      fprintf(stderr, "Unknown engine %s\n", engine);
+      return 0;
+    }
+    engines[n++] = engine;
+  }
+  return n;
+}
+
+// Runs the engine in this child process, and never returns.
+static void vsbench_child(VsbenchRun* run, int timeout) {
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDOUT_FILENO);
+  }
+  alarm(timeout);
+
+  if (vsbench_is_program(run->engine)) {
+    char v_r[16], v_c[16], threads[16];
+    sprintf(v_r, "%d", run->v_r);
+    sprintf(v_c, "%d", run->v_c);
+    sprintf(threads, "%d", run->threads);
+    execl(run->viewshed, "viewshed", run->grid_path, "/dev/null", v_r, v_c,
+          "--engine", run->engine, "--threads", threads, (char*) NULL);
+    fprintf(stderr, "Cannot run %s\n", run->viewshed);
+    _exit(127);
+  }
+
+  FILE* in_file = fopen(run->grid_path, "rb");
+  FILE* out_file = fopen("/dev/null", "w");
+  if (!in_file || !out_file) {
+    _exit(1);
+  }
+  Grid* elev_grid = grid_read(in_file);
+  VisContext* vis_context = vis_context_init(run->threads);
+  Grid* result;
+  if (strstr(run->engine, "-tree")) {
+    vis_context->active_kind = vis_active_tree;
+  }
+  // the quantized sweeps must give the same answers, so the grid is only
+  // quantized if it is kept exactly; the synthetic terrain is whole meters
+  if (strstr(run->engine, "-quantized") && !vis_quantize(elev_grid, 0)) {
+    fprintf(stderr, "The grid can not be quantized exactly\n");
+    _exit(1);
+  }
+  if (!strncmp(run->engine, "vshed", 5)) {
+    result = vis_compute_vshed_in(vis_context, elev_grid, run->v_r, run->v_c,
+                                  0, false);
+  } else if (!strncmp(run->engine, "avcount", 7)) {
+    result = vis_compute_avcount_in(vis_context, elev_grid, VSBENCH_EPSILON);
+  } else {
+    int side = maxi(run->nrows, run->ncols);
+    result = vis_compute_svcount(elev_grid, maxi(1, (side + VSBENCH_SIMP_SIDE - 1) /
+                                                    VSBENCH_SIMP_SIDE),
+                                 run->threads);
+  }
+  grid_write(out_file, result);
+  fclose(out_file);
+  _exit(0);
+}
+
+// Runs the engine in a child process and waits for it, timing it with rt and
+// filling in what it used. Returns its wait status.
+static int vsbench_run(VsbenchRun* run, int timeout, Rtimer* rt,
+                       struct rusage* usage) {
+  Rtimer run_rt;
+  int status;
+  pid_t pid;
+
+  fflush(stdout);
+  rt_start(run_rt);
+  if ((pid = fork()) < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    vsbench_child(run, timeout);
+  }
+  if (wait4(pid, &status, 0, usage) < 0) {
+    perror("wait4");
+    exit(1);
+  }
+  rt_stop(run_rt);
+  *rt = run_rt;
+  return status;
+}
+
+// Returns the highest cell in the middle ninth of the grid, in row-major
+// order, as an observer would stand on a hill; from a valley the engines give
+// up on most lines of sight at once.
+static long vsbench_viewpoint(float* cells, GridioHeader* header) {
+  long best = (long) (header->nrows / 2) * header->ncols + header->ncols / 2;
+  int r, c;
+  for (r = header->nrows / 3; r < maxi(1, 2 * header->nrows / 3); r++) {
+    for (c = header->ncols / 3; c < maxi(1, 2 * header->ncols / 3); c++) {
+      long i = (long) r * header->ncols + c;
+      if (cells[i] != header->nodata_value &&
+          (cells[best] == header->nodata_value || cells[i] > cells[best])) {
+        best = i;
+      }
+    }
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  FILE* csv_file;
+  int sizes[VSBENCH_MAX_LIST], thread_counts[VSBENCH_MAX_LIST];
+  char* engines[VSBENCH_MAX_LIST];
+  char engine_list[1000];
+  int nsizes, nthreads, nengines, i, j, k;
+  const char* viewshed = VSBENCH_VIEWSHED;
+  int timeout = VSBENCH_TIMEOUT;
+  bool programs = false;
+  char grid_path[] = "/tmp/vsbenchXXXXXX";
+  Rtimer rt;
+  char buf[1000];
+
+  // parse and validate command line parameters
+  if (argc < 2 || argc > 7) {
+    fprintf(stderr, "Usage: vsbench <csv-file> [sizes] [threads] [engines] [viewshed] [timeout-s]\n");
+    return 1;
+  }
+  nsizes = vsbench_parse_numbers((argc > 2) ? argv[2] : VSBENCH_SIZES, sizes);
+  nthreads = vsbench_parse_numbers((argc > 3) ? argv[3] : VSBENCH_THREADS,
+                                   thread_counts);
+  snprintf(engine_list, sizeof(engine_list), "%s",
+           (argc > 4) ? argv[4] : VSBENCH_ENGINES);
+  nengines = vsbench_parse_engines(engine_list, engines);
+  if (argc > 5) viewshed = argv[5];
+  if (argc > 6) timeout = atoi(argv[6]);
+  if (!nsizes || !nthreads || !nengines || timeout < 1) {
+    fprintf(stderr, "sizes, threads and engines are comma separated lists, "
+            "and sizes, threads and the timeout must be at least 1\n");
+    return 1;
+  }
+  for (k = 0; k < nengines; k++) {
+    programs = programs || vsbench_is_program(engines[k]);
+  }
+  if (programs && access(viewshed, X_OK) != 0) {
+    fprintf(stderr, "Cannot run %s; build it, or give its path\n", viewshed);
+    return 1;
+  }
+  if (!(csv_file = fopen(argv[1], "w"))) {
+    fprintf(stderr, "Cannot open %s for writing\n", argv[1]);
+    return 1;
+  }
+  fprintf(csv_file, "rows,cols,engine,threads,wall_s,user_s,sys_s,"
+          "peak_rss_kb,cells_per_s,status\n");
+
+  for (i = 0; i < nsizes; i++) {
+    TerrainParams params;
+    GridioHeader header;
+    float* cells;
+    long viewpoint;
+    int fd;
+
+    // the terrain is written to a binary grid for the runs to read, and
+    // freed before they start so that none of them carries it
+    terrain_defaults(&params, sizes[i], sizes[i]);
+    params.holes = VSBENCH_HOLES;
+    rt_start(rt);
+    cells = terrain_generate(&params, &header);
+    rt_stop(rt);
+    rt_sprint(buf, rt);
+    printf("%d x %d terrain: %s\n", sizes[i], sizes[i], buf);
+    viewpoint = vsbench_viewpoint(cells, &header);
+    strcpy(grid_path, "/tmp/vsbenchXXXXXX");
+    FILE* grid_file;
+    if ((fd = mkstemp(grid_path)) < 0 || !(grid_file = fdopen(fd, "wb"))) {
+      fprintf(stderr, "Cannot create a grid file in /tmp\n");
+      return 1;
+    }
+    gridio_write_bin(grid_file, &header, cells);
+    fclose(grid_file);
+    free(cells);
+
+    for (k = 0; k < nengines; k++) {
+      for (j = 0; j < nthreads; j++) {
+        VsbenchRun run = {engines[k], thread_counts[j],
+                          grid_path, header.nrows, header.ncols,
+                          viewpoint / header.ncols, viewpoint % header.ncols,
+                          viewshed};
+        struct rusage usage;
+        int status = vsbench_run(&run, timeout, &rt, &usage);
+        const char* outcome =
+          (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? "ok" :
+          (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) ? "timeout" :
+          "failed";
+        double wall = rt_w_useconds(rt) / 1000000;
+        double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        double rate = (double) header.nrows * header.ncols / wall;
+
+        fprintf(csv_file, "%d,%d,%s,%d,%.3f,%.3f,%.3f,%ld,%.0f,%s\n",
+                header.nrows, header.ncols, run.engine, run.threads, wall,
+                user, sys, usage.ru_maxrss, rate, outcome);
+        fflush(csv_file);
+        printf("  %-17s %2d threads: %8.2fs wall %8.2fs user %6.2fs sys "
+               "%8ld KB %12.0f cells/s %s\n", run.engine, run.threads, wall,
+               user, sys, usage.ru_maxrss, rate, outcome);
+      }
+    }
+    unlink(grid_path);
+  }
+
+  fclose(csv_file);
+  return 0;
+}
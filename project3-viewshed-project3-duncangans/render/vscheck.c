@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "grid.h"
+#include "gridio.h"
+#include "terrain.h"
+#include "vis.h"
+#include "utils.h"
+
+// Check a viewshed engine against the two exact algorithms there are: the
+// brute force isVisible behind the viewshed program's exact engine, and the
+// sweep of vis.c. On set1.asc it is also checked against the viewsheds stored
+// next to it (set1vis.<row>.<col>.asc), and then on synthetic terrains (see
+// terrain.c) from random viewpoints. The engine is given as options to the
+// viewshed program, e.g. "--engine simd --layout blocked --threads 4".
+//
+// The references do not agree with each other everywhere (the sweep compares
+// the gradients of cell centres, where isVisible follows the line of sight
+// across the cells), so a reference's own disagreement with the exact engine
+// is its baseline, and the engine fails if it differs from any reference in
+// more cells than the baseline plus tolerance times the cells with data.
+// Mismatches are counted by distance from the viewpoint and by the angle
+// vis_swept_alpha gives, to show where an engine goes wrong.
+
+#define VSCHECK_TOLERANCE  0.001
+#define VSCHECK_TERRAINS   4
+#define VSCHECK_SIZE       512
+#define VSCHECK_VIEWPOINTS 4
+#define VSCHECK_HOLES      0.02
+#define VSCHECK_MAX_ARGS   32
+#define VSCHECK_BANDS      16   // distances by doubling: [1, 2), [2, 4), ...
+#define VSCHECK_SECTORS    8
+
+// The viewpoints of the viewsheds stored with set1.asc.
+static const int vscheck_set1_viewpoints[][2] = {{100, 100}, {250, 250}};
+
+// How an engine's viewshed differs from a reference's.
+typedef struct vscheck_tally_t {
+  long mismatches;
+  long cells;                        // cells with data
+  long by_band[VSCHECK_BANDS];
+  long by_sector[VSCHECK_SECTORS];
+} VscheckTally;
+
+// The engine to check, and what the references need to match its options.
+typedef struct vscheck_engine_t {
+  const char* viewshed;              // the viewshed program
+  char*       args[VSCHECK_MAX_ARGS];
+  int         nargs;
+  char*       radius;                // the value of --radius, or NULL
+  char*       height;                // the value of --height, or NULL
+} VscheckEngine;
+
+// Splits options into the engine's arguments in place, noting the radius and
+// height the references must use. Returns false if there are too many, or one
+// changes what is written (a packed or cropped viewshed can not be compared).
+static bool vscheck_parse_engine(char* options, VscheckEngine* engine) {
+  char* arg;
+  engine->nargs = 0;
+  engine->radius = NULL;
+  engine->height = NULL;
+  for (arg = strtok(options, " "); arg; arg = strtok(NULL, " ")) {
+    if (engine->nargs == VSCHECK_MAX_ARGS) {
+      return false;
+    }
+    if (!strcmp(arg, "--crop") || !strcmp(arg, "--format")) {
+      return false;
+    }
+    if (engine->nargs > 0 && !strcmp(engine->args[engine->nargs - 1], "--radius")) {
+      engine->radius = arg;
+    }
+    if (engine->nargs > 0 && !strcmp(engine->args[engine->nargs - 1], "--height")) {
+      engine->height = arg;
+    }
+    engine->args[engine->nargs++] = arg;
+  }
+  return true;
+}
+
+// Runs the viewshed program on the grid file from (v_r, v_c) with the given
+// options, and returns the viewshed it wrote, or NULL if it failed.
+static Grid* vscheck_run(const char* viewshed, const char* grid_path, int v_r,
+                         int v_c, char** args, int nargs) {
+  char out_path[] = "/tmp/vscheckXXXXXX";
+  char row[16], col[16];
+  char* argv[VSCHECK_MAX_ARGS + 6];
+  int fd, status, i;
+  pid_t pid;
+
+  if ((fd = mkstemp(out_path)) < 0) {
+    fprintf(stderr, "Cannot create a viewshed file in /tmp\n");
+    exit(1);
+  }
+  close(fd);
+  sprintf(row, "%d", v_r);
+  sprintf(col, "%d", v_c);
+  argv[0] = "viewshed";
+  argv[1] = (char*) grid_path;
+  argv[2] = out_path;
+  argv[3] = row;
+  argv[4] = col;
+  for (i = 0; i < nargs; i++) {
+    argv[5 + i] = args[i];
+  }
+  argv[5 + nargs] = NULL;
+
+  fflush(stdout);
+  if ((pid = fork()) < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    execv(viewshed, argv);
+    fprintf(stderr, "Cannot run %s\n", viewshed);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+
+  Grid* vshed_grid = NULL;
+  FILE* out_file;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+      (out_file = fopen(out_path, "r"))) {
+    vshed_grid = grid_read(out_file);
+    fclose(out_file);
+  }
+  unlink(out_path);
+  return vshed_grid;
+}
+
+// Counts where vshed_grid and ref_grid differ among the cells of elev_grid
+// that have data. Nodata cells are left out, as the references mark them
+// differently.
+static void vscheck_compare(Grid* elev_grid, Grid* vshed_grid, Grid* ref_grid,
+                            int v_r, int v_c, VscheckTally* tally) {
+  int r, c;
+  memset(tally, 0, sizeof(VscheckTally));
+  for (r = 0; r < elev_grid->nrows; r++) {
+    for (c = 0; c < elev_grid->ncols; c++) {
+      if (grid_get_nodata(elev_grid, r, c) || (r == v_r && c == v_c)) {
+        continue;
+      }
+      tally->cells++;
+      if ((grid_get(vshed_grid, r, c) == vis_grid_visible) ==
+          (grid_get(ref_grid, r, c) == vis_grid_visible)) {
+        continue;
+      }
+      float alpha = vis_swept_alpha(v_r, v_c, r, c);
+      int band = maxi(0, (int) log2f(dist2di(v_r, v_c, r, c)));
+      int sector = alpha / (2 * M_PI) * VSCHECK_SECTORS;
+      tally->mismatches++;
+      tally->by_band[mini(band, VSCHECK_BANDS - 1)]++;
+      tally->by_sector[mini(sector, VSCHECK_SECTORS - 1)]++;
+    }
+  }
+}
+
+// Prints how the engine did against one reference, and returns true iff it
+// is within tolerance of the reference's baseline.
+static bool vscheck_report(const char* name, VscheckTally* tally,
+                           long baseline, float tolerance) {
+  bool pass = tally->mismatches <= baseline + tolerance * tally->cells;
+  int i;
+  printf("    %-7s %7ld of %ld cells differ, baseline %ld: %s\n", name,
+         tally->mismatches, tally->cells, baseline, pass ? "ok" : "FAIL");
+  if (tally->mismatches > baseline) {
+    printf("      by distance:");
+    for (i = 0; i < VSCHECK_BANDS; i++) {
+      if (tally->by_band[i]) {
+        printf(" %d-%d: %ld", 1 << i, 2 << i, tally->by_band[i]);
+      }
+    }
+    printf("\n      by angle:   ");
+    for (i = 0; i < VSCHECK_SECTORS; i++) {
+      if (tally->by_sector[i]) {
+        printf(" %d-%d: %ld", 360 * i / VSCHECK_SECTORS,
+               360 * (i + 1) / VSCHECK_SECTORS, tally->by_sector[i]);
+      }
+    }
+    printf("\n");
+  }
+  return pass;
+}
+
+// Checks the engine from one viewpoint against the exact engine, the sweep
+// and, if given, a stored viewshed. Returns true iff it passes against all
+// of them.
+static bool vscheck_viewpoint(VscheckEngine* engine, const char* grid_path,
+                              Grid* elev_grid, int v_r, int v_c,
+                              Grid* stored_grid, float tolerance) {
+  char* exact_args[6] = {"--engine", "exact"};
+  int nexact = 2;
+  VscheckTally tally, baseline;
+  bool pass = true;
+
+  // the exact engine sees as far and from as high as the engine does
+  if (engine->radius) {
+    exact_args[nexact++] = "--radius";
+    exact_args[nexact++] = engine->radius;
+  }
+  if (engine->height) {
+    exact_args[nexact++] = "--height";
+    exact_args[nexact++] = engine->height;
+  }
+  printf("  viewpoint %d %d\n", v_r, v_c);
+  Grid* vshed_grid = vscheck_run(engine->viewshed, grid_path, v_r, v_c,
+                                 engine->args, engine->nargs);
+  Grid* exact_grid = vscheck_run(engine->viewshed, grid_path, v_r, v_c,
+                                 exact_args, nexact);
+  if (!vshed_grid || !exact_grid) {
+    printf("    the viewshed program failed: FAIL\n");
+    return false;
+  }
+  vscheck_compare(elev_grid, vshed_grid, exact_grid, v_r, v_c, &tally);
+  pass = vscheck_report("exact", &tally, 0, tolerance) && pass;
+
+  // the sweep has no observer height, so it only checks engines without one
+  if (!engine->height) {
+    Grid* sweep_grid = vis_compute_vshed_within(elev_grid, v_r, v_c,
+                         engine->radius ? atoi(engine->radius) : 0, false);
+    vscheck_compare(elev_grid, exact_grid, sweep_grid, v_r, v_c, &baseline);
+    vscheck_compare(elev_grid, vshed_grid, sweep_grid, v_r, v_c, &tally);
+    pass = vscheck_report("sweep", &tally, baseline.mismatches, tolerance) && pass;
+    grid_free(sweep_grid);
+  }
+  if (stored_grid) {
+    vscheck_compare(elev_grid, exact_grid, stored_grid, v_r, v_c, &baseline);
+    vscheck_compare(elev_grid, vshed_grid, stored_grid, v_r, v_c, &tally);
+    pass = vscheck_report("stored", &tally, baseline.mismatches, tolerance) && pass;
+  }
+  grid_free(vshed_grid);
+  grid_free(exact_grid);
+  return pass;
+}
+
+// Returns a random viewpoint of the grid that has data, as r * ncols + c.
+static long vscheck_random_viewpoint(Grid* elev_grid) {
+  int r, c;
+  do {
+    r = rand() % elev_grid->nrows;
+    c = rand() % elev_grid->ncols;
+  } while (grid_get_nodata(elev_grid, r, c));
+  return (long) r * elev_grid->ncols + c;
+}
+
+int main(int argc, char** argv) {
+  VscheckEngine engine;
+  float tolerance = VSCHECK_TOLERANCE;
+  int nterrains = VSCHECK_TERRAINS, size = VSCHECK_SIZE;
+  int nviewpoints = VSCHECK_VIEWPOINTS;
+  unsigned int seed = 1;
+  int failed = 0, checked = 0, i, j;
+  FILE* in_file;
+  char stored_path[64];
+
+  // parse and validate command line parameters
+  if (argc < 3 || argc > 8) {
+    fprintf(stderr, "Usage: vscheck <viewshed> <engine-options> [tolerance] [terrains] [size] [viewpoints] [seed]\n");
+    return 1;
+  }
+  engine.viewshed = argv[1];
+  if (argc > 3) tolerance = atof(argv[3]);
+  if (argc > 4) nterrains = atoi(argv[4]);
+  if (argc > 5) size = atoi(argv[5]);
+  if (argc > 6) nviewpoints = atoi(argv[6]);
+  if (argc > 7) seed = strtoul(argv[7], NULL, 10);
+  if (!vscheck_parse_engine(argv[2], &engine)) {
+    fprintf(stderr, "engine options can not change what is written "
+            "(--crop, --format) and are at most %d words\n", VSCHECK_MAX_ARGS);
+    return 1;
+  }
+  if (tolerance < 0 || nterrains < 0 || size < 2 || nviewpoints < 1) {
+    fprintf(stderr, "tolerance and terrains must be at least 0, size 2 and "
+            "viewpoints 1\n");
+    return 1;
+  }
+  if (access(engine.viewshed, X_OK) != 0) {
+    fprintf(stderr, "Cannot run %s; build it, or give its path\n", engine.viewshed);
+    return 1;
+  }
+  srand(seed);
+
+  // set1.asc and the viewsheds stored with it, which were computed without a
+  // radius or height
+  if ((in_file = fopen("set1.asc", "r"))) {
+    Grid* elev_grid = grid_read(in_file);
+    fclose(in_file);
+    printf("set1.asc\n");
+    for (i = 0; i < (int) (sizeof(vscheck_set1_viewpoints) / sizeof(vscheck_set1_viewpoints[0])); i++) {
+      int v_r = vscheck_set1_viewpoints[i][0], v_c = vscheck_set1_viewpoints[i][1];
+      Grid* stored_grid = NULL;
+      sprintf(stored_path, "set1vis.%d.%d.asc", v_r, v_c);
+      if (!engine.radius && !engine.height && (in_file = fopen(stored_path, "r"))) {
+        stored_grid = grid_read(in_file);
+        fclose(in_file);
+      }
+      failed += !vscheck_viewpoint(&engine, "set1.asc", elev_grid, v_r, v_c,
+                                   stored_grid, tolerance);
+      checked++;
+      if (stored_grid) {
+        grid_free(stored_grid);
+      }
+    }
+    grid_free(elev_grid);
+  } else {
+    printf("set1.asc is not here, so only synthetic terrains are checked\n");
+  }
+
+  // synthetic terrains, written to a binary grid for the viewshed program
+  for (i = 0; i < nterrains; i++) {
+    TerrainParams params;
+    GridioHeader header;
+    char grid_path[] = "/tmp/vscheckXXXXXX";
+    FILE* grid_file;
+    int fd;
+
+    terrain_defaults(&params, size, size);
+    params.seed = seed + i;
+    params.holes = VSCHECK_HOLES;
+    float* cells = terrain_generate(&params, &header);
+    if ((fd = mkstemp(grid_path)) < 0 || !(grid_file = fdopen(fd, "wb"))) {
+      fprintf(stderr, "Cannot create a grid file in /tmp\n");
+      return 1;
+    }
+    gridio_write_bin(grid_file, &header, cells);
+    fclose(grid_file);
+    free(cells);
+    grid_file = fopen(grid_path, "rb");
+    Grid* elev_grid = grid_read(grid_file);
+    fclose(grid_file);
+
+    printf("terrain %d x %d, seed %u\n", size, size, params.seed);
+    for (j = 0; j < nviewpoints; j++) {
+      long viewpoint = vscheck_random_viewpoint(elev_grid);
+      failed += !vscheck_viewpoint(&engine, grid_path, elev_grid,
+                                   viewpoint / size, viewpoint % size, NULL,
+                                   tolerance);
+      checked++;
+    }
+    grid_free(elev_grid);
+    unlink(grid_path);
+  }
+
+  printf("%d of %d viewpoints failed\n", failed, checked);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,449 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+
+//This file holds the viewshed server behind viewshedd, and the calls its
+//clients (viewshedc, vsload) make to it. The server keeps its grids in
+//memory and listens on a Unix domain socket. Each connection sends Requests
+//one after another and gets a reply to each, in order. The main thread polls
+//the open connections and reads what they send, and once a connection has
+//sent a whole request, it goes in a bounded queue for one of a fixed number
+//of worker threads. The worker serves that one request and hands the
+//connection back to be polled for the next, so a client that is idle or slow
+//to send holds no worker, and every client's requests take turns.
+
+//Seconds a reply may wait for a client that has stopped reading before the
+//connection is dropped, so such a client cannot hold a worker either
+#define SERVER_SEND_TIMEOUT 10
+
+//An open connection, and the request it is part way through sending
+typedef struct _connection {
+
+     int fd;
+     FILE *out;               //replies are written through this
+     Request request;
+     long have;               //bytes of the request read so far
+
+} Connection;
+
+//The requests waiting for a worker, and what the workers share
+typedef struct _server {
+
+     Grid *grids;             //the grids, blocked if the options ask for it
+     int count;
+     Options opts;            //options each viewshed is computed with
+
+     Connection **waiting;    //ring of connections with a whole request
+     int queue, first, length;
+     pthread_mutex_t lock;
+     pthread_cond_t notEmpty, notFull;
+
+     Connection **served;     //connections handed back by the workers,
+     int servedCount, servedCap;  //to be polled again
+     int wake[2];             //a pipe the workers wake the poll with
+
+} Server;
+
+//Writes all size bytes, and returns 0 if the other end went away first
+static int writeFull(int fd, const void *buf, long size)
+{
+  const char *p = (const char*) buf;
+  while (size > 0)
+  {
+    long n = write(fd, p, size);
+    if (n <= 0) {return 0;}
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+//Reads all size bytes, and returns 0 if the other end closed first
+static int readFull(int fd, void *buf, long size)
+{
+  char *p = (char*) buf;
+  while (size > 0)
+  {
+    long n = read(fd, p, size);
+    if (n <= 0) {return 0;}
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+//Takes the next request off the queue, waiting for one if it is empty
+static Connection *popRequest(Server *server)
+{
+  pthread_mutex_lock(&server->lock);
+  while (server->length == 0)
+  {
+    pthread_cond_wait(&server->notEmpty, &server->lock);
+  }
+  Connection *connection = server->waiting[server->first];
+  server->first = (server->first + 1) % server->queue;
+  server->length--;
+  pthread_cond_signal(&server->notFull);
+  pthread_mutex_unlock(&server->lock);
+  return connection;
+}
+
+//Puts a connection with a whole request on the queue, waiting for room if it
+//is full, so that a burst of requests waits in the sockets rather than in
+//memory
+static void pushRequest(Server *server, Connection *connection)
+{
+  pthread_mutex_lock(&server->lock);
+  while (server->length == server->queue)
+  {
+    pthread_cond_wait(&server->notFull, &server->lock);
+  }
+  server->waiting[(server->first + server->length) % server->queue] =
+    connection;
+  server->length++;
+  pthread_cond_signal(&server->notEmpty);
+  pthread_mutex_unlock(&server->lock);
+}
+
+//Hands a served connection back to be polled for its next request
+static void returnConnection(Server *server, Connection *connection)
+{
+  pthread_mutex_lock(&server->lock);
+  if (server->servedCount == server->servedCap)
+  {
+    server->servedCap = server->servedCap ? 2 * server->servedCap : 64;
+    server->served = (Connection**) realloc(server->served,
+                                   server->servedCap * sizeof(Connection*));
+    if (server->served == NULL)
+    {
+      printf("cannot allocate connections\n");
+      exit(1);
+    }
+  }
+  server->served[server->servedCount++] = connection;
+  pthread_mutex_unlock(&server->lock);
+  char wake = 1;
+  writeFull(server->wake[1], &wake, 1);
+}
+
+//Closes a connection and frees it
+static void closeConnection(Connection *connection)
+{
+  if (connection->out) {fclose(connection->out);}
+  close(connection->fd);
+  free(connection);
+}
+
+//Serves the request a connection has sent, and returns 0 if the connection
+//is to be closed: the request was not one, or the reply could not be sent.
+//The worker's viewshed, and the one the size of the grid that viewsheds
+//limited to a radius are put back into, are filled in again for every
+//request (see shedReuse); so is its buffer for ascii replies.
+static int serveRequest(Server *server, Connection *connection, Shed **shed,
+                        Shed **full, char **text, size_t *textSize)
+{
+  Request request = connection->request;
+  FILE *out = connection->out;
+  int status = REPLY_OK;
+  if (memcmp(request.magic, REQUEST_MAGIC, 4) != 0) {status = REPLY_BAD;}
+  else if (request.grid < 0 || request.grid >= server->count)
+  {
+    status = REPLY_NO_GRID;
+  }
+  else if (request.format != REQUEST_PACKED &&
+           request.format != REQUEST_ASCII)
+  {
+    status = REPLY_NO_FORMAT;
+  }
+  else
+  {
+    Grid *grid = &server->grids[request.grid];
+    if (request.row < 0 || request.row >= grid->rows ||
+        request.col < 0 || request.col >= grid->cols)
+    {
+      status = REPLY_OFF_GRID;
+    }
+  }
+  fwrite(&status, sizeof(int), 1, out);
+  if (status == REPLY_BAD) {return 0;}
+  if (status != REPLY_OK) {return fflush(out) == 0;}
+
+  Grid grid = server->grids[request.grid];
+  Options opts = server->opts;
+  opts.radius = request.radius > 0 ? request.radius : 0;
+  opts.crop = request.crop;
+  opts.height = request.height;
+  grid.view_shed = *shed;
+  createViewshed(&grid, request.row, request.col, &opts);
+  *shed = grid.view_shed;
+
+  //The reply is the viewshed written the same way as by viewshed, packed
+  //or ascii
+  Grid reply = grid;
+  int row = request.row, col = request.col;
+  if (opts.radius > 0 && opts.crop)
+  {
+    reply = shedCropped(&grid);
+    row -= (*shed)->row0;
+    col -= (*shed)->col0;
+  }
+  else if ((*shed)->rows != grid.rows || (*shed)->cols != grid.cols)
+  {
+    *full = shedReuse(*full, 0, 0, grid.rows, grid.cols);
+    shedCopyInto(*shed, *full);
+    reply.view_shed = *full;
+  }
+  if (request.format == REQUEST_PACKED)
+  {
+    packedHeader(out, &reply);
+    packedRecord(out, reply.view_shed, row, col);
+  }
+  else
+  {
+    //The length goes first, so the ascii viewshed is written to memory
+    FILE *memory = open_memstream(text, textSize);
+    if (memory == NULL)
+    {
+      printf("cannot allocate reply\n");
+      exit(1);
+    }
+    shedIntoStream(&reply, memory, 1);
+    fclose(memory);
+    long length = *textSize;
+    fwrite(&length, sizeof(long), 1, out);
+    fwrite(*text, 1, length, out);
+  }
+  return fflush(out) == 0;
+}
+
+//Each worker serves one request at a time, from whichever connection is next
+//in the queue, and hands the connection back for its next request
+static void *serverWorker(void *arg)
+{
+  Server *server = (Server*) arg;
+  Shed *shed = NULL, *full = NULL;
+  char *text = NULL;
+  size_t textSize = 0;
+  for (;;)
+  {
+    Connection *connection = popRequest(server);
+    int keep = serveRequest(server, connection, &shed, &full, &text,
+                            &textSize);
+    free(text);
+    text = NULL;
+    connection->have = 0;
+    if (keep) {returnConnection(server, connection);}
+    else {closeConnection(connection);}
+  }
+  return NULL;
+}
+
+//Adds a connection to the ones polled, growing their array as needed
+static Connection **addIdle(Connection **idle, int *count, int *cap,
+                            Connection *connection)
+{
+  if (*count == *cap)
+  {
+    *cap = *cap ? 2 * *cap : 64;
+    idle = (Connection**) realloc(idle, *cap * sizeof(Connection*));
+    if (idle == NULL)
+    {
+      printf("cannot allocate connections\n");
+      exit(1);
+    }
+  }
+  idle[(*count)++] = connection;
+  return idle;
+}
+
+//Serves viewsheds of the count grids on the Unix socket at path, on
+//opts->threads workers, with at most queue requests waiting for one. The
+//grids are blocked first if the options ask for it. It does not return.
+void runServer(char *path, Grid *grids, int count, Options *opts, int queue)
+{
+  Server server;
+  server.grids = grids;
+  server.count = count;
+  server.opts = *opts;
+  server.opts.threads = 1;
+  server.queue = queue > 0 ? queue : 1;
+  server.waiting = (Connection**) malloc(server.queue * sizeof(Connection*));
+  server.first = 0;
+  server.length = 0;
+  server.served = NULL;
+  server.servedCount = 0;
+  server.servedCap = 0;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.notEmpty, NULL);
+  pthread_cond_init(&server.notFull, NULL);
+  for (int g = 0; g < count; g++)
+  {
+    if (opts->blockSize > 0) {blockGrid(&grids[g], opts->blockSize);}
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    printf("socket path %s is too long\n", path);
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+      listen(listener, server.queue) != 0 || pipe(server.wake) != 0)
+  {
+    printf("cannot listen on %s\n", path);
+    exit(1);
+  }
+  //A client that hangs up early must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int t = 0; t < opts->threads; t++)
+  {
+    pthread_t worker;
+    pthread_create(&worker, NULL, serverWorker, &server);
+    pthread_detach(worker);
+  }
+  fprintf(stderr, "viewshedd: serving %d grids on %s with %d workers\n",
+          count, path, opts->threads);
+
+  //The connections not with a worker are polled, after the listener and the
+  //pipe the workers wake the poll with
+  Connection **idle = NULL;
+  struct pollfd *polled = NULL;
+  int idleCount = 0, idleCap = 0;
+  for (;;)
+  {
+    polled = (struct pollfd*) realloc(polled,
+                                      (idleCount + 2) * sizeof(struct pollfd));
+    if (polled == NULL)
+    {
+      printf("cannot allocate connections\n");
+      exit(1);
+    }
+    polled[0].fd = listener;
+    polled[1].fd = server.wake[0];
+    for (int c = 0; c < idleCount; c++) {polled[2 + c].fd = idle[c]->fd;}
+    for (int c = 0; c < idleCount + 2; c++)
+    {
+      polled[c].events = POLLIN;
+      polled[c].revents = 0;
+    }
+    if (poll(polled, idleCount + 2, -1) < 0) {continue;}
+
+    //Each connection with something to read reads it into its request,
+    //and goes to the queue once the request is whole
+    int kept = 0;
+    for (int c = 0; c < idleCount; c++)
+    {
+      Connection *connection = idle[c];
+      if (polled[2 + c].revents == 0) {idle[kept++] = connection; continue;}
+      long n = read(connection->fd, (char*) &connection->request +
+                    connection->have, sizeof(Request) - connection->have);
+      if (n <= 0) {closeConnection(connection); continue;}
+      connection->have += n;
+      if (connection->have == sizeof(Request))
+      {
+        pushRequest(&server, connection);
+      }
+      else {idle[kept++] = connection;}
+    }
+    idleCount = kept;
+
+    //The connections the workers are done with are polled again
+    if (polled[1].revents)
+    {
+      char wake[64];
+      if (read(server.wake[0], wake, sizeof(wake)) < 0) {continue;}
+      pthread_mutex_lock(&server.lock);
+      for (int c = 0; c < server.servedCount; c++)
+      {
+        idle = addIdle(idle, &idleCount, &idleCap, server.served[c]);
+      }
+      server.servedCount = 0;
+      pthread_mutex_unlock(&server.lock);
+    }
+
+    if (polled[0].revents)
+    {
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0) {continue;}
+      struct timeval timeout = {SERVER_SEND_TIMEOUT, 0};
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      Connection *connection = (Connection*) calloc(1, sizeof(Connection));
+      if (connection == NULL)
+      {
+        printf("cannot allocate connections\n");
+        exit(1);
+      }
+      connection->fd = fd;
+      connection->out = fdopen(dup(fd), "wb");
+      if (connection->out == NULL) {closeConnection(connection); continue;}
+      idle = addIdle(idle, &idleCount, &idleCap, connection);
+    }
+  }
+}
+
+//Connects to the server listening at path, and returns the socket
+int serverConnect(char *path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
+  {
+    printf("cannot connect to %s\n", path);
+    exit(1);
+  }
+  return fd;
+}
+
+//Sends a request and reads its reply. On REPLY_OK the header and record of
+//a packed viewshed are filled in, or for REQUEST_ASCII the record is the
+//ascii viewshed and the header is left as it is; *record is grown to hold the
+//record and can be passed back for the next query. Returns the status, or -1
+//if the server hung up.
+int serverQuery(int fd, Request *request, PackedHeader *header,
+                unsigned char **record, long *recordBytes)
+{
+  int status;
+  memcpy(request->magic, REQUEST_MAGIC, 4);
+  if (!writeFull(fd, request, sizeof(Request)) ||
+      !readFull(fd, &status, sizeof(int)))
+  {
+    return -1;
+  }
+  if (status != REPLY_OK) {return status;}
+  long bytes;
+  if (request->format == REQUEST_ASCII)
+  {
+    if (!readFull(fd, &bytes, sizeof(long))) {return -1;}
+  }
+  else
+  {
+    if (!readFull(fd, header, sizeof(PackedHeader))) {return -1;}
+    bytes = 2 * sizeof(int) + (long) header->rows * ((header->cols + 7) / 8);
+  }
+  if (*record == NULL || bytes > *recordBytes)
+  {
+    *record = (unsigned char*) realloc(*record, bytes);
+  }
+  *recordBytes = bytes;
+  if (!readFull(fd, *record, bytes)) {return -1;}
+  return REPLY_OK;
+}
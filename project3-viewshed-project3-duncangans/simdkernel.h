@@ -0,0 +1,184 @@
+//The simd engine's kernel, included by simdlos.c through elevation.h once for
+//each type the heights can be stored as, and once more for each instruction
+//set it is compiled for, which SIMD(name) names. The vector macros are defined
+//by simdlanes.h.
+
+//Crossing k of the ray through the columns, mirroring the first loop of
+//isVisible. Returns 1 if the crossing blocks the view.
+static int TYPED(SIMD(blocksCol))(Grid *grid, int testrow, int testcol,
+                            float slope, float viewHeight, float limit, int k)
+{
+  float s = slope * k;
+  float fl = floorf(s);
+  float midPoint = s - fl;
+  int ltempRow = testrow - (int) fl;
+  int htempRow = ltempRow - 1;
+  int i = testcol + k;
+  float low = HEIGHT_AT(ELEV, grid, ltempRow, i);
+  float high = midPoint == 0 ? 0 : HEIGHT_AT(ELEV, grid, htempRow, i);
+  float height = midPoint * high + (1-midPoint) * low;
+  float tempSlopeVis = (height - viewHeight) / sqrtf(k*k + s*s);
+  return tempSlopeVis > limit;
+}
+
+//Crossing k of the ray through the rows, mirroring the second loop of
+//isVisible.
+static int TYPED(SIMD(blocksRow))(Grid *grid, int testrow, int testcol,
+                            float invSlope, float viewHeight, float limit,
+                            int k)
+{
+  float x = invSlope * k;
+  float midPoint = -x - floorf(-x);
+  int htempCol = testcol - (int) floorf(x);
+  int ltempCol = htempCol - 1;
+  int i = testrow + k;
+  float high = midPoint == 0 ? 0 : HEIGHT_AT(ELEV, grid, i, htempCol);
+  float low = HEIGHT_AT(ELEV, grid, i, ltempCol);
+  float height = midPoint * high + (1-midPoint) * low;
+  float d = testcol - ltempCol - midPoint;
+  float tempSlopeVis = (height - viewHeight) / sqrtf(k*k + d*d);
+  return tempSlopeVis > limit;
+}
+
+#if LANES > 1
+//The height at each lane's index. With AVX2, floats are gathered in one
+//instruction, and so are 16 bit cells: each lane gathers the 32 bits that end
+//with its cell, starting a cell before it, and shifts the cell down. That
+//reads two bytes before the first cell, which is the header of a mapped grid
+//and a spare cell in front of a blocked one (see blockGrid). Other types, and
+//everything with SSE4.1, are loaded a lane at a time.
+static inline vfloat TYPED(SIMD(laneHeights))(const ELEV *p, vint idx)
+{
+#if ELEV_FLOAT && LANES == 8
+  return _mm256_i32gather_ps(p, idx, 4);
+#elif ELEV_SHORT && LANES == 8
+  vint v = _mm256_i32gather_epi32((const int*) (p - 1), idx, 2);
+  v = ((ELEV) -1 < 0) ? _mm256_srai_epi32(v, 16) : _mm256_srli_epi32(v, 16);
+  return _mm256_cvtepi32_ps(v);
+#else
+  int at[LANES];
+  float lanes[LANES];
+  vstorei(at, idx);
+  for (int l = 0; l < LANES; l++) {lanes[l] = p[at[l]];}
+  return vloadf(lanes);
+#endif
+}
+
+//The height at each lane's cell, by 32 bit index where the grid's last index
+//allows it and otherwise by each lane's long index (see laneIndexWide)
+static inline vfloat TYPED(SIMD(laneHeightsAt))(Grid *grid, const ELEV *p,
+                                          long last, vint row, vint col)
+{
+  if (last <= simdIndexLimit)
+  {
+    return TYPED(SIMD(laneHeights))(p, SIMD(laneIndex)(grid, row, col));
+  }
+  int rows[LANES], cols[LANES];
+  float lanes[LANES];
+  vstorei(rows, row);
+  vstorei(cols, col);
+  for (int l = 0; l < LANES; l++)
+  {
+    lanes[l] = p[laneIndexWide(grid, last, rows[l], cols[l])];
+  }
+  return vloadf(lanes);
+}
+#endif
+
+//Batched version of isVisible. Returns 1 if the point at row, col can be seen
+//from testrow, testcol. A batch that blocks the view counts as crossings up to
+//its last lane.
+int TYPED(SIMD(isVisibleSimd))(Grid *grid, int row, int col, int testrow,
+                               int testcol)
+{
+  int deltaX = col - testcol;
+  int deltaY = testrow - row;
+  float viewHeight = HEIGHT_AT(ELEV, grid, testrow, testcol) + grid->observer;
+  float visSlope = (HEIGHT_AT(ELEV, grid, row, col) - viewHeight) /
+                   sqrtf(deltaX*deltaX + deltaY*deltaY);
+  float limit = visSlope + .0001f;
+  float slope = (float) (testrow - row) / (float) (col - testcol);
+  float invSlope = (float) (col - testcol) / (float) (testrow - row);
+  int colChange = (col >= testcol) ? 1 : -1;
+  int rowChange = (row >= testrow) ? 1 : -1;
+  int colSteps = abs(deltaX);
+  int rowSteps = abs(deltaY);
+  int colCrossings = colSteps ? colSteps - 1 : 0;
+  int j;
+
+#if LANES > 1
+  const ELEV *data = grid->data_blocked ? grid->data_blocked :
+                                          grid->data_rowmajor;
+  vfloat vView = vset1(viewHeight);
+  vfloat vLimit = vset1(limit);
+  vfloat vOne = vset1(1.0f);
+  long last = lastIndex(grid);
+
+  //Crossings through the columns, LANES at a time
+  vfloat vSlope = vset1(slope);
+  for (j = 1; j + LANES <= colSteps; j += LANES)
+  {
+    vint k = vaddi(vseti(j * colChange), vlanes(colChange));
+    vfloat kf = vtofloat(k);
+    vfloat s = vmul(vSlope, kf);
+    vfloat fl = vfloor(s);
+    vfloat midPoint = vsub(s, fl);
+    vint ltempRow = vsubi(vseti(testrow), vtoint(fl));
+    vint i = vaddi(vseti(testcol), k);
+    vfloat high = TYPED(SIMD(laneHeightsAt))(grid, data, last,
+                                       vsubi(ltempRow, vseti(1)), i);
+    vfloat low = TYPED(SIMD(laneHeightsAt))(grid, data, last, ltempRow, i);
+    vfloat height = vadd(vmul(midPoint, high), vmul(vsub(vOne, midPoint), low));
+    vfloat dist2 = vadd(vmul(kf, kf), vmul(s, s));
+    if (vgt(SIMD(laneSlopes)(vsub(height, vView), dist2), vLimit))
+    {
+      return blockedAfter(j + LANES - 1);
+    }
+  }
+#else
+  j = 1;
+#endif
+  for (; j < colSteps; j++)
+  {
+    if (TYPED(SIMD(blocksCol))(grid, testrow, testcol, slope, viewHeight,
+                               limit, j * colChange)) {return blockedAfter(j);}
+  }
+
+#if LANES > 1
+  //Crossings through the rows, LANES at a time
+  vfloat vInvSlope = vset1(invSlope);
+  vfloat vTestCol = vset1((float) testcol);
+  for (j = 1; j + LANES <= rowSteps; j += LANES)
+  {
+    vint k = vaddi(vseti(j * rowChange), vlanes(rowChange));
+    vfloat kf = vtofloat(k);
+    vfloat x = vmul(vInvSlope, kf);
+    vfloat negX = vsub(vset1(0.0f), x);
+    vfloat midPoint = vsub(negX, vfloor(negX));
+    vint htempCol = vsubi(vseti(testcol), vtoint(vfloor(x)));
+    vint ltempCol = vsubi(htempCol, vseti(1));
+    vint i = vaddi(vseti(testrow), k);
+    vfloat high = TYPED(SIMD(laneHeightsAt))(grid, data, last, i, htempCol);
+    vfloat low = TYPED(SIMD(laneHeightsAt))(grid, data, last, i, ltempCol);
+    vfloat height = vadd(vmul(midPoint, high), vmul(vsub(vOne, midPoint), low));
+    vfloat d = vsub(vsub(vTestCol, vtofloat(ltempCol)), midPoint);
+    vfloat dist2 = vadd(vmul(kf, kf), vmul(d, d));
+    if (vgt(SIMD(laneSlopes)(vsub(height, vView), dist2), vLimit))
+    {
+      return blockedAfter(colCrossings + j + LANES - 1);
+    }
+  }
+#else
+  j = 1;
+#endif
+  for (; j < rowSteps; j++)
+  {
+    if (TYPED(SIMD(blocksRow))(grid, testrow, testcol, invSlope, viewHeight,
+                               limit, j * rowChange))
+    {
+      return blockedAfter(colCrossings + j);
+    }
+  }
+  losCounts.crossings += colCrossings + (rowSteps ? rowSteps - 1 : 0);
+  return 1;
+}
@@ -0,0 +1,117 @@
+//The vector operations of the simd kernel, included by simdlos.c once for each
+//instruction set it is compiled for, with LANES set to 8 for AVX2 or 4 for
+//SSE4.1, and SIMD(name) naming the helpers for that set. The operations of
+//the set included before are dropped first.
+//There is no include guard; simdlos.c includes it once for each set.
+
+#undef vfloat
+#undef vint
+#undef vset1
+#undef vseti
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vfloor
+#undef vrsqrt
+#undef vtoint
+#undef vtofloat
+#undef vaddi
+#undef vsubi
+#undef vmuli
+#undef vmaxi
+#undef vmini
+#undef vandi
+#undef vneg
+#undef vsll
+#undef vsrl
+#undef vgt
+#undef vlanes
+#undef vstorei
+#undef vloadf
+
+#if LANES == 8
+#define vfloat          __m256
+#define vint            __m256i
+#define vset1(x)        _mm256_set1_ps(x)
+#define vseti(x)        _mm256_set1_epi32(x)
+#define vadd(a, b)      _mm256_add_ps(a, b)
+#define vsub(a, b)      _mm256_sub_ps(a, b)
+#define vmul(a, b)      _mm256_mul_ps(a, b)
+#define vfloor(a)       _mm256_floor_ps(a)
+#define vrsqrt(a)       _mm256_rsqrt_ps(a)
+#define vtoint(a)       _mm256_cvttps_epi32(a)
+#define vtofloat(a)     _mm256_cvtepi32_ps(a)
+#define vaddi(a, b)     _mm256_add_epi32(a, b)
+#define vsubi(a, b)     _mm256_sub_epi32(a, b)
+#define vmuli(a, b)     _mm256_mullo_epi32(a, b)
+#define vmaxi(a, b)     _mm256_max_epi32(a, b)
+#define vmini(a, b)     _mm256_min_epi32(a, b)
+#define vandi(a, b)     _mm256_and_si256(a, b)
+#define vneg(a)         _mm256_cmpgt_epi32(_mm256_setzero_si256(), a)
+#define vsll(a, n)      _mm256_sllv_epi32(a, _mm256_set1_epi32(n))
+#define vsrl(a, n)      _mm256_srlv_epi32(a, _mm256_set1_epi32(n))
+#define vgt(a, b)       _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ))
+#define vlanes(x)       _mm256_setr_epi32(0, x, 2*(x), 3*(x), 4*(x), 5*(x), 6*(x), 7*(x))
+#define vstorei(p, a)   _mm256_storeu_si256((__m256i*) (p), a)
+#define vloadf(p)       _mm256_loadu_ps(p)
+#else
+#define vfloat          __m128
+#define vint            __m128i
+#define vset1(x)        _mm_set1_ps(x)
+#define vseti(x)        _mm_set1_epi32(x)
+#define vadd(a, b)      _mm_add_ps(a, b)
+#define vsub(a, b)      _mm_sub_ps(a, b)
+#define vmul(a, b)      _mm_mul_ps(a, b)
+#define vfloor(a)       _mm_floor_ps(a)
+#define vrsqrt(a)       _mm_rsqrt_ps(a)
+#define vtoint(a)       _mm_cvttps_epi32(a)
+#define vtofloat(a)     _mm_cvtepi32_ps(a)
+#define vaddi(a, b)     _mm_add_epi32(a, b)
+#define vsubi(a, b)     _mm_sub_epi32(a, b)
+#define vmuli(a, b)     _mm_mullo_epi32(a, b)
+#define vmaxi(a, b)     _mm_max_epi32(a, b)
+#define vmini(a, b)     _mm_min_epi32(a, b)
+#define vandi(a, b)     _mm_and_si128(a, b)
+#define vneg(a)         _mm_cmplt_epi32(a, _mm_setzero_si128())
+#define vsll(a, n)      _mm_sll_epi32(a, _mm_cvtsi32_si128(n))
+#define vsrl(a, n)      _mm_srl_epi32(a, _mm_cvtsi32_si128(n))
+#define vgt(a, b)       _mm_movemask_ps(_mm_cmpgt_ps(a, b))
+#define vlanes(x)       _mm_setr_epi32(0, x, 2*(x), 3*(x))
+#define vstorei(p, a)   _mm_storeu_si128((__m128i*) (p), a)
+#define vloadf(p)       _mm_loadu_ps(p)
+#endif
+
+//Slope from the viewpoint to each lane's crossing, where rise is the height
+//above the viewpoint and dist2 the squared distance to it. One Newton step on
+//the reciprocal square root brings it to nearly full float precision.
+static inline vfloat SIMD(laneSlopes)(vfloat rise, vfloat dist2)
+{
+  vfloat r = vrsqrt(dist2);
+  r = vmul(r, vsub(vset1(1.5f), vmul(vmul(vset1(0.5f), dist2), vmul(r, r))));
+  return vmul(rise, r);
+}
+
+//Index of each lane's cell in the grid's data, kept inside the grid. Out of
+//grid cells only ever show up with a weight of zero. In the blocked layout this
+//follows blockedIndex, including a column of -1 wrapping to the row before.
+//Only for grids whose lastIndex is within simdIndexLimit.
+static inline vint SIMD(laneIndex)(Grid *grid, vint row, vint col)
+{
+  if (grid->data_blocked == NULL)
+  {
+    long last = lastIndex(grid);
+    vint idx = vaddi(vmuli(row, vseti(grid->cols)), col);
+    return vmini(vmaxi(idx, vseti(0)), vseti((int) last));
+  }
+  int shift = grid->blockShift;
+  vint wrap = vneg(col);
+  col = vaddi(col, vandi(wrap, vseti(grid->cols)));
+  row = vaddi(row, wrap);
+  row = vmini(vmaxi(row, vseti(0)), vseti(grid->rows - 1));
+  col = vmini(vmaxi(col, vseti(0)), vseti(grid->cols - 1));
+  vint mask = vseti((1 << shift) - 1);
+  vint block = vaddi(vmuli(vsrl(row, shift), vseti(grid->blockCols)),
+                     vsrl(col, shift));
+  return vaddi(vsll(block, 2 * shift),
+               vaddi(vsll(vandi(row, mask), shift), vandi(col, mask)));
+}
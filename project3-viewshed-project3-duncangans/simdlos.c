@@ -0,0 +1,155 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+//This file holds the batched line of sight kernel behind --engine simd. It
+//walks the same crossings as isVisible and uses the same formulas, but in
+//float, and it tests a batch of crossings of the ray at once: 8 with AVX2, 4
+//with SSE4.1, and 1 at a time on processors with neither. Distances come from
+//a reciprocal square root with one Newton step, which keeps the slopes well
+//inside the .0001 tolerance isVisible allows.
+//
+//The kernel is compiled here for each of the three, the vector ones with GCC's
+//target pragma, so the build needs no -m flags and runs anywhere, and each
+//call takes the copy for the best set the processor running it has.
+//
+//The batches find their cells by 32 bit index, which reaches 2^31 cells. On a
+//grid with more, every lane's index is worked out in long and its cell loaded
+//on its own instead; only the arithmetic stays in vectors.
+
+//Grids whose data has more cells than this use the long indices. It is
+//INT_MAX, the most a 32 bit index reaches; losbench lowers it to check the
+//long indices against isVisible on a small grid.
+long simdIndexLimit = INT_MAX;
+
+//Index of the last cell of the grid's data, in whichever layout it is kept
+static inline long lastIndex(Grid *grid)
+{
+  if (grid->data_blocked == NULL) {return (long) grid->rows * grid->cols - 1;}
+  int shift = grid->blockShift;
+  long blockRows = (grid->rows + (1 << shift) - 1) >> shift;
+  return ((blockRows * grid->blockCols) << (2 * shift)) - 1;
+}
+
+//Index of one lane's cell, in long, the same cell laneIndex finds. last is
+//lastIndex of the grid.
+static inline long laneIndexWide(Grid *grid, long last, int row, int col)
+{
+  if (grid->data_blocked == NULL)
+  {
+    long idx = (long) row * grid->cols + col;
+    return idx < 0 ? 0 : idx > last ? last : idx;
+  }
+  if (col < 0) {row--; col += grid->cols;}
+  row = row < 0 ? 0 : row >= grid->rows ? grid->rows - 1 : row;
+  col = col < 0 ? 0 : col >= grid->cols ? grid->cols - 1 : col;
+  return blockedIndex(grid, row, col);
+}
+
+//Counts a line of sight found blocked after the given number of crossings,
+//and returns 0 for not visible
+static inline int blockedAfter(long crossings)
+{
+  losCounts.crossings += crossings;
+  losCounts.earlyExits++;
+  return 0;
+}
+
+//The kernel's helpers and its copies for each type (see simdkernel.h) are
+//named SIMD(name) for the instruction set they are compiled for, e.g.
+//isVisibleSimdAvx2Float
+#define SIMD(name) SIMD_NAME(name, SIMD_ISA)
+#define SIMD_NAME(name, isa) SIMD_PASTE(name, isa)
+#define SIMD_PASTE(name, isa) name##isa
+
+#define LANES 1
+#define SIMD_ISA Scalar
+#define KERNELS "simdkernel.h"
+#include "elevation.h"
+#undef LANES
+#undef SIMD_ISA
+
+#ifdef SIMD_X86
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#define LANES 4
+#define SIMD_ISA Sse41
+#include "simdlanes.h"
+#define KERNELS "simdkernel.h"
+#include "elevation.h"
+#undef LANES
+#undef SIMD_ISA
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define LANES 8
+#define SIMD_ISA Avx2
+#include "simdlanes.h"
+#define KERNELS "simdkernel.h"
+#include "elevation.h"
+#undef LANES
+#undef SIMD_ISA
+#pragma GCC pop_options
+#endif
+
+//Set by simdLevel once it has looked
+static int simdLevelFound = -1;
+
+//The instruction set of the processor running this: 2 for AVX2, 1 for
+//SSE4.1 and 0 for neither. It is looked up on the first call; threads that
+//race to it all store the same answer.
+static int simdLevel(void)
+{
+  int level = __atomic_load_n(&simdLevelFound, __ATOMIC_RELAXED);
+  if (level < 0)
+  {
+    level = 0;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {level = 2;}
+    else if (__builtin_cpu_supports("sse4.1")) {level = 1;}
+#endif
+    __atomic_store_n(&simdLevelFound, level, __ATOMIC_RELAXED);
+  }
+  return level;
+}
+
+//isVisibleSimd for each type, in the copy for the processor's instruction set
+#ifdef SIMD_X86
+#define SIMD_DISPATCH(T)                                                     \
+  int isVisibleSimd##T(Grid *grid, int row, int col, int testrow,            \
+                       int testcol)                                          \
+  {                                                                          \
+    switch (simdLevel())                                                     \
+    {                                                                        \
+      case 2: return isVisibleSimdAvx2##T(grid, row, col, testrow, testcol); \
+      case 1: return isVisibleSimdSse41##T(grid, row, col, testrow, testcol);\
+    }                                                                        \
+    return isVisibleSimdScalar##T(grid, row, col, testrow, testcol);         \
+  }
+#else
+#define SIMD_DISPATCH(T)                                                     \
+  int isVisibleSimd##T(Grid *grid, int row, int col, int testrow,            \
+                       int testcol)                                          \
+  {                                                                          \
+    return isVisibleSimdScalar##T(grid, row, col, testrow, testcol);         \
+  }
+#endif
+SIMD_DISPATCH(Int16)
+SIMD_DISPATCH(Uint16)
+SIMD_DISPATCH(Float)
+SIMD_DISPATCH(Double)
+
+//Batched version of isVisible, in the copy for the type the grid is stored as
+int isVisibleSimd(Grid *grid, int row, int col, int testrow, int testcol)
+{
+  return TYPED_FOR(grid->dtype, isVisibleSimd)(grid, row, col, testrow,
+                                               testcol);
+}
@@ -0,0 +1,101 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//This file holds what --stats measures: the time each phase of a run takes,
+//timed with the render tools' Rtimer, and the counts the engines keep of their
+//work. The counts are per thread while the engines run and are added up
+//whenever a thread finishes a chunk, so counting costs the kernels an add to
+//their own thread's counter rather than a shared one.
+
+__thread LosCounts losCounts;
+
+//Adds this thread's counts to the run's totals and starts them again from 0.
+//Without stats they are just dropped.
+void statsFlush(Stats *stats)
+{
+  if (stats)
+  {
+    __sync_fetch_and_add(&stats->counts.crossings, losCounts.crossings);
+    __sync_fetch_and_add(&stats->counts.earlyExits, losCounts.earlyExits);
+    __sync_fetch_and_add(&stats->counts.nodataSkips, losCounts.nodataSkips);
+    __sync_fetch_and_add(&stats->counts.cellsTested, losCounts.cellsTested);
+  }
+  losCounts.crossings = 0;
+  losCounts.earlyExits = 0;
+  losCounts.nodataSkips = 0;
+  losCounts.cellsTested = 0;
+}
+
+//Returns how many bytes the process has written so far, from /proc/self/io,
+//or -1 where there is no such file
+long statsBytesWritten(void)
+{
+  FILE *f = fopen("/proc/self/io", "r");
+  char line[256];
+  long bytes = -1;
+  if (f == NULL) {return -1;}
+  while (fgets(line, sizeof(line), f))
+  {
+    if (strncmp(line, "wchar:", 6) == 0) {bytes = atol(line + 6);}
+  }
+  fclose(f);
+  return bytes;
+}
+
+//Returns the size of a file, or 0 if there is none
+long statsFileSize(char *filename)
+{
+  struct stat st;
+  return stat(filename, &st) == 0 ? (long) st.st_size : 0;
+}
+
+//Adds the time rt measured to a phase. User and system time are the whole
+//process's, over every thread.
+void statsPhase(Stats *stats, int phase, Rtimer *rt)
+{
+  Rtimer t = *rt;
+  stats->wall[phase] += rt_w_useconds(t) / 1000000;
+  stats->user[phase] += rt_u_useconds(t) / 1000000;
+  stats->sys[phase] += rt_s_useconds(t) / 1000000;
+}
+
+//Writes the run as one line of JSON: what was run on what, the seconds each
+//phase took and the counts. mode is "single" for one viewpoint, or the batch
+//mode, which has no one viewpoint.
+void statsWrite(FILE *f, Stats *stats, Grid *grid, Options *opts,
+                char *gridFile, char *mode, int testRow, int testCol)
+{
+  static const char *engines[] = {"exact", "r2", "simd"};
+  static const char *dtypes[] = {"", "float32", "int16", "uint16", "float64"};
+  static const char *phases[] = {"read", "alloc", "compute", "write"};
+
+  fprintf(f, "{\"grid\": \"");
+  for (char *c = gridFile; *c; c++)
+  {
+    if (*c == '"' || *c == '\\') {fputc('\\', f);}
+    fputc(*c, f);
+  }
+  fprintf(f, "\", \"rows\": %d, \"cols\": %d, \"dtype\": \"%s\", "
+          "\"mode\": \"%s\", ", grid->rows, grid->cols, dtypes[grid->dtype],
+          mode);
+  if (testRow >= 0) {fprintf(f, "\"row\": %d, \"col\": %d, ", testRow, testCol);}
+  fprintf(f, "\"engine\": \"%s\", \"threads\": %d, \"block\": %d, "
+          "\"radius\": %d, \"height\": %g, \"phases\": {",
+          engines[opts->engine], opts->threads, opts->blockSize, opts->radius,
+          opts->height);
+  for (int i = 0; i < PHASES; i++)
+  {
+    fprintf(f, "%s\"%s\": {\"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f}",
+            i ? ", " : "", phases[i], stats->wall[i], stats->user[i],
+            stats->sys[i]);
+  }
+  fprintf(f, "}, \"crossings\": %ld, \"early_exits\": %ld, "
+          "\"nodata_skips\": %ld, \"cells_tested\": %ld, "
+          "\"bytes_read\": %ld, \"bytes_written\": %ld}\n",
+          stats->counts.crossings, stats->counts.earlyExits,
+          stats->counts.nodataSkips, stats->counts.cellsTested,
+          stats->bytesRead, stats->bytesWritten);
+}
@@ -0,0 +1,83 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//This program expands one record of a packed viewshed file (see bitshed.c)
+//back into the ascii grid that viewshed writes with --format ascii. The record
+//is read into a viewshed and written by shedIntoFile, the same as viewshed's.
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    printf("usage: unpackshed <packedfile> <newfile> [record]\n");
+    exit(0);
+  }
+  long record = argc > 3 ? atol(argv[3]) : 0;
+
+  FILE* f = fopen(argv[1], "rb");
+  if (f == NULL) {
+     printf("cannot open files...");
+     exit(1);
+  }
+
+  //The header gives the size and georeference of the grid
+  PackedHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, PACKED_MAGIC, 4) != 0 ||
+      header.version != PACKED_VERSION)
+  {
+    printf("%s is not a packed viewshed\n", argv[1]);
+    exit(1);
+  }
+  Grid grid;
+  grid.rows = header.rows;
+  grid.cols = header.cols;
+  grid.ndvalue = header.ndvalue;
+  grid.xllcorner = header.xllcorner;
+  grid.yllcorner = header.yllcorner;
+  grid.cellsize = header.cellsize;
+
+  //Records are all the same size, so the one asked for can be seeked to
+  size_t rowBytes = (grid.cols + 7) / 8;
+  long recordBytes = 2 * sizeof(int) + (long) grid.rows * rowBytes;
+  int viewpoint[2];
+  if (fseek(f, record * recordBytes, SEEK_CUR) != 0 ||
+      fread(viewpoint, sizeof(int), 2, f) != 2)
+  {
+    printf("%s has no record %ld\n", argv[1], record);
+    exit(1);
+  }
+
+  //Each row's bytes go into the viewshed's words, lowest byte first
+  Shed *shed = shedReuse(NULL, 0, 0, grid.rows, grid.cols);
+  unsigned char *bytes = (unsigned char*) malloc(rowBytes);
+  if (bytes == NULL)
+  {
+    printf("cannot allocate row\n");
+    exit(1);
+  }
+  long visible = 0;
+  for (int row = 0; row < grid.rows; row++)
+  {
+    if (fread(bytes, 1, rowBytes, f) != rowBytes)
+    {
+      printf("%s is cut short\n", argv[1]);
+      exit(1);
+    }
+    uint64_t *words = shed->bits + (long) row * shed->wordsPerRow;
+    for (size_t b = 0; b < rowBytes; b++)
+    {
+      visible += __builtin_popcount(bytes[b]);
+      words[b >> 3] |= (uint64_t) bytes[b] << (8 * (b & 7));
+    }
+  }
+  free(bytes);
+  fclose(f);
+  grid.view_shed = shed;
+  shedIntoFile(&grid, argv[2], 0);
+  shedFree(shed);
+  printf("record %ld, viewpoint %d %d, %ld cells visible\n", record,
+         viewpoint[0], viewpoint[1], visible);
+  return 0;
+}
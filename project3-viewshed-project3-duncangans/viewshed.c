@@ -4,89 +4,87 @@
 #include <assert.h> 
 #include <stdlib.h> 
 #include <math.h>
+#include <string.h>
+#include "render/gridio.h"
 
-//This function reads in a asci file representing a terrain and computes the
-//viewshed from a specific point. After reading in the grid and computing the
-//viewshed, the viewshed, represented by 0s and 1s is then scanned into a file
-//of the users choice
-
-int main(int argc, char **argv)
+//This function reads a grid from the file given and puts it into row major
+//format. The header is kept in the grid so the viewshed can be written with
+//the same georeference. The reading itself is shared with the render tools
+//(render/gridio.c): an asc file is mapped and its values converted on every
+//core, and a binary grid (see grid_tobin) is mapped and used as it is.
+void readGridfromFile (char * filename, Grid *grid)
 {
-  if (argc < 5) {
-    printf("usage: viewshed <filename>");
-    exit(0); 
-  }
-
-  int testrow = atol(argv[3]);
-  int testcol = atol(argv[4]);
-
-  //Grid is created
-  Grid grid;
-  
-  //Grid's values are entered from the file entered
-  //The arguments represent the files and the grid adress
-  readGridfromFile (argv[1], argv[2], &grid);
-  //The viewshed is created
-  createViewshed(&grid, testrow, testcol);
-  //The viewshed is visualized and printed, (commented out for now)
-  //printGrid(&grid);
-  //The viewshed is then read into the file
-  shedIntoFile(&grid, argv[2]);
-}
+  FILE* f;
+  GridioHeader header;
 
-//This function reads a viewshed from the file given and puts it into row
-//major format. It also adds the first few lines to the new file so it doesn't
-//have to do it later.
-void readGridfromFile (char * filename, char * newfile, Grid *grid)
-{
-  //Creates files and name for scanning as well as necessary integers
-  FILE* f; 
-  FILE* n;
-  char s[100]; 
-  int nrows, ncols, ndval;
-  
-  n=fopen(newfile, "w");
   f=fopen(filename, "r");
-  if (f== NULL || n==NULL) {
+  if (f== NULL) {
      printf("cannot open files...");
      exit(1);
   }
-  
-  //Collecting the number of columns and rows for the grid details 
-  fscanf(f, "%s", s);
-  fscanf(f, "%d", &ncols);
-  //Beginning to add stuff to new file
-  fprintf(n, "%s         %d\n", s, ncols);
-  fscanf(f, "%s", s);
-  fscanf(f, "%d", &nrows);
-  //Continuing to add details to new file
-  fprintf(n, "%s         %d\n", s, nrows);
-
-  //Scans past unecessary information
-  for (int i = 0; i < 4; i++)
+
+  //The grid comes back in one row-major block, already filled in, as floats
+  //from an asc file and as whatever type a binary grid was written in
+  grid->data_rowmajor = gridio_read_typed(f, &header, &grid->dtype,
+                                          &grid->mapSize,
+                                          gridio_default_threads());
+  fclose(f);
+  if (grid->data_rowmajor == NULL)
   {
-    fscanf(f, "%s", s); 
-    //Here I am just using ndval to indicate the second int, the last round
-    //it will actually set the value to the correct int
-    fscanf(f, "%d", &ndval);
-    //Continuing to move stuff into new file
-    fprintf(n, "%s    %d\n", s, ndval);
+    printf("cannot read grid from %s\n", filename);
+    exit(1);
   }
+  grid->data_blocked = NULL;
+  grid->view_shed = NULL;
+  grid->observer = 0;
 
   //Grid variables are set
-  grid->rows = nrows;
-  grid->cols = ncols;
-  grid->ndvalue = ndval;
-
-  //Grid is created based on ncols and nrows, and then filled from the file
-  grid->data_rowmajor = (float*) calloc(nrows * ncols, sizeof(float));
+  grid->rows = header.nrows;
+  grid->cols = header.ncols;
+  grid->xllcorner = header.xllcorner;
+  grid->yllcorner = header.yllcorner;
+  grid->cellsize = header.cellsize;
+  grid->ndvalue = header.nodata_value;
+}
 
-  float newNum;
-  for (int i = 0; i < nrows * ncols; i++)
+//The grid is copied out of row-major order into square blocks, blockSize cells
+//on a side (rounded up to a power of two). Walks that cut across rows then stay
+//inside a few blocks instead of touching a new row, and often a new page, at
+//every step. The row-major copy is freed once the blocked one is made. A spare
+//cell is left in front of the blocks for the simd kernel's 16 bit gather.
+void blockGrid(Grid *grid, int blockSize)
+{
+  int shift = 0;
+  while ((1 << shift) < blockSize) {shift++;}
+  int side = 1 << shift;
+  int blockRows = (grid->rows + side - 1) / side;
+  size_t size = gridio_dtype_size(grid->dtype);
+  grid->blockShift = shift;
+  grid->blockCols = (grid->cols + side - 1) / side;
+  char *blocks = (char*) calloc((long) blockRows * grid->blockCols *
+                                side * side + 1, size);
+  if (blocks == NULL)
   {
-    fscanf(f, "%f", &newNum);
-    grid->data_rowmajor[i] = newNum;  
+    printf("cannot allocate blocked grid\n");
+    exit(1);
   }
+  grid->data_blocked = blocks + size;
+  for (int row = 0; row < grid->rows; row++)
+  {
+    char *from = (char*) grid->data_rowmajor + (long) row * grid->cols * size;
+    long block = (long) (row >> shift) * grid->blockCols;
+    char *to = (char*) grid->data_blocked +
+               ((block << (2 * shift)) + ((row & (side - 1)) << shift)) * size;
+    //Each row is copied a block's width at a time, whatever the type
+    for (int col = 0; col < grid->cols; col += side)
+    {
+      int width = grid->cols - col < side ? grid->cols - col : side;
+      memcpy(to, from + col * size, width * size);
+      to += (long) side * side * size;
+    }
+  }
+  gridio_free(grid->data_rowmajor, grid->mapSize);
+  grid->data_rowmajor = NULL;
 }
 
 //The grid is given as a parameter and printed in row major format
@@ -97,7 +95,7 @@ void printGrid(Grid * grid)
   {
     for (int j = 0; j < grid->cols; j++)
     {
-      printf("%d ", grid->view_shed[(i * grid->cols) + j]);
+      printf("%d ", shedGet(grid->view_shed, i, j));
     }
     printf("\n------------------\n");
   }
@@ -106,108 +104,227 @@ void printGrid(Grid * grid)
 //the given location
 float getRowMajor(Grid *grid, int row, int col)
 {
-  return grid->data_rowmajor[row * grid->cols + col];
+  Grid rowMajor = *grid;
+  rowMajor.data_blocked = NULL;
+  return getHeight(&rowMajor, row, col);
 }
 
-//When given a test row and a single column it tests whether the point is
-//visible from the other point. To do this it iterates through each column/row
-//between the two and finds the point that could theoretically block the view.
-//If said point is lower than the visibility line it is all good. Otherwise,
-//a 0 is returned indicating the point is not visible.
+//The viewpoint and grid the exact engine works on, shared by its threads
+typedef struct _exactWork {
+
+     Grid *grid;
+     int testRow, testCol;
+     int (*visible)(Grid*, int, int, int, int);   //the copy of isVisible or
+                                                  //isVisibleSimd for the
+                                                  //grid's type
+
+     long radius2;   //square of the radius, 0 for no limit
+
+     Shed *known;    //cells not to test again, or NULL
+
+     Stats *stats;   //where the threads add their counts, or NULL
+
+} ExactWork;
+
+//isVisible and shedRows are compiled for each type the heights can be
+//stored as (see exactkernel.h)
+#define KERNELS "exactkernel.h"
+#include "elevation.h"
+
+//Tests a point for visibility the way the exact engine does, in the copy of
+//isVisible for the type the grid is stored as
 int isVisible(Grid *grid, int row, int col, int testrow, int testcol)
 {
-  //Distance and slopes from the viewpoint (testrow, testcol) to the point 
-  //being tested (row and col) is calculated
-  int deltaX = col - testcol;
-  int deltaY = testrow - row;
-  double delta = sqrt((deltaX*deltaX)+(deltaY*deltaY));
-  float visSlope = (getRowMajor(grid, row, col) - 
-    getRowMajor(grid, testrow, testcol)) / delta;
-  double slope = (double)(testrow - row) / (double)(col - testcol);
-  
-  //Upper and Lower bounds for rows ints are created, and colChange created
-  int ltempRow, htempRow, colChange;
-  if (col >= testcol) {colChange = 1;} else {colChange = -1;}
-  double midPoint, height, tempDelta, tempSlopeVis;
-
-  //For each line intersection through the columns, the intersection point is
-  //created and tested for visibility
-  for (int i = testcol; i != col; i+=colChange)
+  return TYPED_FOR(grid->dtype, isVisible)(grid, row, col, testrow, testcol);
+}
+
+//Viewshed grid is (c)allocated, or the grid's old one reused, and then filled
+//in by the engine chosen in the options. The exact and simd engines hand rows
+//out one at a time to its threads since rows far from the viewpoint cost much
+//more than rows close to it. With a radius, the viewshed only covers the window
+//around the viewpoint the radius reaches, and no engine looks outside it. The
+//observer stands opts->height above the viewpoint. With stats, the engines add
+//their counts to them, and when they are phased the allocation and the engine
+//are timed too.
+void createViewshed(Grid * grid, int testRow, int testCol, Options *opts)
+{
+  Stats *stats = opts->stats;
+  int timed = stats && stats->phased;
+  Rtimer rt;
+  if (timed) {rt_start(rt);}
+  grid->observer = opts->height;
+  //Grid is allocated and iterated through
+  int row0 = 0, col0 = 0, row1 = grid->rows, col1 = grid->cols;
+  if (opts->radius > 0)
   {
-    //Point between rows is created, the height at that location is calculated
-    //Finally the slope to that point is checked for visibility
-    midPoint = slope * (i - testcol) - floor(slope * (i - testcol));
-    ltempRow = testrow - floor(slope * (i - testcol));
-    htempRow = ltempRow - 1;
-    height = midPoint * getRowMajor(grid, htempRow, i) + (1-midPoint) 
-             * getRowMajor(grid, ltempRow, i);
-    tempDelta = sqrt((pow(i-testcol, 2)+pow(testrow - (ltempRow-midPoint), 2)));
-    tempSlopeVis = (height - getRowMajor(grid, testrow, testcol)) / tempDelta; 
-    if (tempSlopeVis > visSlope+.0001 && i!=testcol) {;return 0;}    
+    if (testRow - opts->radius > row0) {row0 = testRow - opts->radius;}
+    if (testCol - opts->radius > col0) {col0 = testCol - opts->radius;}
+    if (testRow + opts->radius + 1 < row1) {row1 = testRow + opts->radius + 1;}
+    if (testCol + opts->radius + 1 < col1) {col1 = testCol + opts->radius + 1;}
   }
-
-  //The code below mirrors the code above, but does so for iterating through
-  //the rows instead of the columns.
-  double invSlope = (double)(col - testcol) / (double)(testrow - row);
-  int ltempCol, htempCol, rowChange;
-  if (row >= testrow) {rowChange = 1;} else {rowChange = -1;}
-  for (int i = testrow; i!= row; i+=rowChange)
+  grid->view_shed = shedReuse(grid->view_shed, row0, col0, row1 - row0,
+                              col1 - col0);
+  if (opts->blockSize > 0 && grid->data_blocked == NULL)
+  {
+    blockGrid(grid, opts->blockSize);
+  }
+  if (timed)
+  {
+    rt_stop(rt);
+    statsPhase(stats, PHASE_ALLOC, &rt);
+    rt_start(rt);
+  }
+  if (opts->engine == ENGINE_R2)
+  {
+    createViewshedR2(grid, testRow, testCol, opts->threads, opts->radius,
+                     opts->rays, stats);
+  }
+  else
+  {
+    ExactWork work = {grid, testRow, testCol,
+      opts->engine == ENGINE_SIMD ? TYPED_FOR(grid->dtype, isVisibleSimd) :
+                                    TYPED_FOR(grid->dtype, isVisible),
+      (long) opts->radius * opts->radius, opts->known, stats};
+    parallelFor(opts->threads, row1 - row0, 1,
+                TYPED_FOR(grid->dtype, shedRows), &work);
+  }
+  if (timed)
   {
-    midPoint = invSlope * (testrow - i) - floor(invSlope * (testrow - i));
-    htempCol = testcol - floor(invSlope*(i - testrow));
-    ltempCol = htempCol - 1;
-    height = midPoint * getRowMajor(grid, i, htempCol) + 
-		(1-midPoint) * getRowMajor(grid, i, ltempCol);
-    tempDelta = sqrt((pow(i-testrow, 2)+pow(testcol-(ltempCol + midPoint), 2)));
-    tempSlopeVis = (height - getRowMajor(grid, testrow, testcol)) / tempDelta;
-    if (tempSlopeVis > visSlope+.0001 && i!=testrow) {return 0;}
+    rt_stop(rt);
+    statsPhase(stats, PHASE_COMPUTE, &rt);
   }
-  //If the function makes it to this point, it means nothing blocks the view
-  //and the point IS visible 
-  return 1;
 }
 
-//Viewshed grid is (c)allocated and then each row and column in the grid is
-//tested against the testrow and the testcol for visibility.
-void createViewshed(Grid * grid, int testRow, int testCol)
+//Writes the ascii header for a grid the size of this one, with its
+//georeference
+void writeHeader(FILE *f, Grid *grid)
 {
-  //Grid is allocated and iterated through
-  grid->view_shed = (int*) calloc(grid->rows * grid->cols, sizeof(int));  
-  for (int row = 0; row < grid->rows; row++)
+  fprintf(f, "ncols         %d\n", grid->cols);
+  fprintf(f, "nrows         %d\n", grid->rows);
+  fprintf(f, "xllcorner    %.10g\n", grid->xllcorner);
+  fprintf(f, "yllcorner    %.10g\n", grid->yllcorner);
+  fprintf(f, "cellsize    %.10g\n", grid->cellsize);
+  fprintf(f, "NODATA_value    %d\n", grid->ndvalue);
+}
+
+//Formats one row of the viewshed as 0s and 1s for shedIntoFile
+static size_t formatShedRow(void *arg, int row, char *buf)
+{
+  Shed *shed = (Shed*) arg;
+  return gridio_format_bits(buf, shed->bits + (long) row * shed->wordsPerRow,
+                            shed->cols);
+}
+
+//Writes the viewshed as an ascii grid, its header and then its rows, to a
+//stream already open. The rows are formatted in parallel on the given number
+//of threads into large buffers and written in order, rather than a fprintf
+//per cell.
+void shedIntoStream(Grid *grid, FILE *f, int threads)
+{
+  writeHeader(f, grid);
+  gridio_write_rows(f, grid->rows, (size_t) grid->cols * GRIDIO_BIT_CHARS + 1,
+                    formatShedRow, grid->view_shed, threads);
+}
+
+//Viewshed grid is then read into the file (see shedIntoStream)
+void shedIntoFile(Grid *grid, char * newfile, int threads)
+{
+  FILE* n;
+  n=fopen(newfile, "w");
+  if (n == NULL) {
+     printf("cannot open files...");
+     exit(1);
+  }
+  shedIntoStream(grid, n, threads);
+  fclose(n);
+}
+
+//Sets the options to their defaults: the R2 engine on one thread over the
+//row-major grid, written as ascii, with no radius and the observer on the
+//ground
+void optionsDefault(Options *opts)
+{
+  opts->engine = ENGINE_R2;
+  opts->threads = 1;
+  opts->blockSize = 0;
+  opts->packed = 0;
+  opts->radius = 0;
+  opts->crop = 0;
+  opts->height = 0;
+  opts->rays = NULL;
+  opts->known = NULL;
+  opts->stats = NULL;
+}
+
+//Parses the command line options from argv[i] on into opts, and returns the
+//index of the first argument that is not one of them (argc if they all are)
+int parseOptions(int argc, char **argv, int i, Options *opts)
+{
+  int blockSize = 32;
+  for (; i < argc; i++)
   {
-    for (int col = 0; col < grid->cols; col++)
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
     {
-      if (getRowMajor(grid, row, col) == grid->ndvalue)
-      {
-        //If the value is a ndvalue, it will be set to NOT visible
-	grid->view_shed[(row * grid->cols) + col] = 0;
+      i++;
+      if (strcmp(argv[i], "r2") == 0) {opts->engine = ENGINE_R2;}
+      else if (strcmp(argv[i], "exact") == 0) {opts->engine = ENGINE_EXACT;}
+      else if (strcmp(argv[i], "simd") == 0) {opts->engine = ENGINE_SIMD;}
+      else {
+        printf("unknown engine %s\n", argv[i]);
+        exit(1);
       }
-      else if (testRow == row && testCol == col)
-      {
-        grid->view_shed[(row * grid->cols) + col] = 1;
+    }
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+    {
+      opts->threads = atol(argv[++i]);
+      if (opts->threads < 1) {opts->threads = 1;}
+    }
+    else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "blocked") == 0) {opts->blockSize = blockSize;}
+      else if (strcmp(argv[i], "rowmajor") == 0) {opts->blockSize = 0;}
+      else {
+        printf("unknown layout %s\n", argv[i]);
+        exit(1);
       }
-      else
-      {
-        int vis = isVisible(grid, row, col, testRow, testCol);
-        grid->view_shed[(row * grid->cols) + col] = vis;
+    }
+    else if (strcmp(argv[i], "--block") == 0 && i + 1 < argc)
+    {
+      //A block size on its own also asks for the blocked layout
+      blockSize = atol(argv[++i]);
+      if (blockSize < 1) {blockSize = 1;}
+      opts->blockSize = blockSize;
+    }
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "packed") == 0) {opts->packed = 1;}
+      else if (strcmp(argv[i], "ascii") == 0) {opts->packed = 0;}
+      else {
+        printf("unknown format %s\n", argv[i]);
+        exit(1);
       }
     }
-  }
-}
-
-//Viewshed grid is then read into the file. 
-void shedIntoFile(Grid *grid, char * newfile)
-{
-  FILE* n;
-  n=fopen(newfile, "a");
-  for (int row = 0; row < grid->rows; row++)
-  {
-    for (int col = 0; col < grid->cols; col++)
+    else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
     {
-      fprintf(n, "%d ", grid->view_shed[row * grid->cols + col]);
+      opts->radius = atol(argv[++i]);
+      if (opts->radius < 0) {opts->radius = 0;}
     }
-  fprintf(n, "\n");
-
+    else if (strcmp(argv[i], "--crop") == 0)
+    {
+      opts->crop = 1;
+    }
+    else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+    {
+      opts->height = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--stats") == 0)
+    {
+      if (opts->stats == NULL) {opts->stats = (Stats*) calloc(1, sizeof(Stats));}
+    }
+    else {break;}
   }
-}
+  return i;
 
+}
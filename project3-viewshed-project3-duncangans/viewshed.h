@@ -5,28 +5,305 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include "render/gridio.h"
+#include "render/rtimer.h"
+
+//A viewshed kept as 1 bit per cell, 1 for visible. Every row starts on a new
+//64 bit word, so rows can be filled by different threads without sharing a
+//word, and the bits past the end of a row are always 0. A viewshed limited to
+//a radius only covers the window around the viewpoint; cells are still
+//addressed by their row and column in the grid.
+typedef struct _shed {
+
+     int rows, cols;     //size of the viewshed
+
+     int row0, col0;     //grid row and column of its first cell
+
+     long capacity;      //64 bit words allocated for bits, at least
+                         //rows * wordsPerRow
+
+     int wordsPerRow;    //64 bit words in each row
+
+     uint64_t* bits;     //the visibility bits, row after row
+
+} Shed;
+
+//Header of the packed viewshed format. It is followed by one or more records,
+//each the viewpoint (two ints) and then each row of the viewshed packed into
+//(cols+7)/8 bytes, lowest bit first.
+typedef struct _packedHeader {
+
+     char magic[4];      //"VSHD"
+
+     int version, rows, cols, ndvalue, reserved;
+
+     double xllcorner, yllcorner, cellsize;   //georeference of the grid
+
+} PackedHeader;
+
+#define PACKED_MAGIC   "VSHD"
+#define PACKED_VERSION 1
+
+//A request to the viewshed server (see server.c). The reply is a status, 0
+//when the viewshed was computed, and then the viewshed of the whole grid, or
+//with crop just the window the radius covers, encoded as format asks: a
+//packed viewshed file holding one record, or the length of an ascii viewshed
+//(a long) and then the ascii viewshed itself.
+typedef struct _request {
+
+     char magic[4];      //"VSRQ"
+
+     int grid;           //which of the server's grids, from 0
+
+     int row, col;       //the viewpoint
+
+     float height;       //height of the observer above it
+
+     int radius;         //0 for no limit
+
+     int crop;           //reply with the window the radius covers
+
+     int format;         //REQUEST_PACKED or REQUEST_ASCII
+
+} Request;
+
+#define REQUEST_MAGIC "VSRQ"
+
+//How the viewshed of a reply is encoded
+#define REQUEST_PACKED 0
+#define REQUEST_ASCII  1
+
+//Statuses the server replies with
+#define REPLY_OK        0
+#define REPLY_BAD       1   //not a request
+#define REPLY_NO_GRID   2   //there is no such grid
+#define REPLY_OFF_GRID  3   //the viewpoint is off the grid
+#define REPLY_NO_FORMAT 4   //there is no such encoding
 
 
 typedef struct _grid {
 
      int  rows, cols, ndvalue;//Necessary variables
 
-     float* data_rowmajor;   //the values in the grid, in row-major order
+     double xllcorner, yllcorner, cellsize;  //georeference from the header
 
-     float* data_blocked;    //the values in blocked layout(not actually used)
+     int dtype;              //how the values are stored: GRIDIO_DTYPE_INT16,
+                             //_UINT16, _FLOAT32 or _FLOAT64
 
-     int* view_shed;  //Viewshed Grid
+     void* data_rowmajor;    //the values in the grid, in row-major order
+
+     size_t mapSize;         //size of the mapping data_rowmajor lies in when
+                             //read from a binary grid, 0 when malloced
+
+     void* data_blocked;     //the values in blocked layout, or NULL when the
+                             //grid is only kept in row-major order
+
+     int blockShift, blockCols;  //blocks are 1<<blockShift cells on a side,
+                                 //blockCols of them across the grid
+
+     Shed* view_shed;  //Viewshed Grid
+
+     float observer;   //height of the observer above the viewpoint
 
 } Grid;
 
+//What the engines count of the work they do, for --stats. Each thread counts
+//into its own losCounts (see stats.c) and adds them to the run's Stats when it
+//finishes a chunk of rows or rays, so the kernels never share a counter.
+typedef struct _losCounts {
+
+     long crossings;     //crossings of a line of sight evaluated
+
+     long earlyExits;    //lines of sight found blocked before their cell
+
+     long nodataSkips;   //cells left not visible for being nodata
+
+     long cellsTested;   //cells whose line of sight was followed
+
+} LosCounts;
+
+extern __thread LosCounts losCounts;
+
+//Phases of a run that --stats times separately
+#define PHASE_READ    0   //reading and parsing the grid
+#define PHASE_ALLOC   1   //allocating the viewshed and blocking the grid
+#define PHASE_COMPUTE 2   //the engine
+#define PHASE_WRITE   3   //writing the viewshed
+#define PHASES        4
+
+//What a run measured with --stats, written as a JSON record at the end
+typedef struct _stats {
+
+     double wall[PHASES], user[PHASES], sys[PHASES];   //seconds per phase
+
+     int phased;         //createViewshed times allocation and compute; the
+                         //batch modes compute viewpoints on several threads
+                         //at once and time the whole run as compute instead
+
+     LosCounts counts;   //totals over every thread
+
+     long bytesRead, bytesWritten;
+
+} Stats;
+
+//The R2 rays for a radius, worked out once and shared by every viewpoint
+//(see raycast.c)
+typedef struct _rayTemplate RayTemplate;
+
+//Engines that createViewshed can run
+#define ENGINE_EXACT 0  //isVisible for every cell, the exact reference
+#define ENGINE_R2    1  //rays cast to the boundary, sharing horizons
+#define ENGINE_SIMD  2  //isVisible in float, a batch of crossings at a time
+
+typedef struct _options {
+
+     int engine;     //which engine computes the viewshed
+
+     int threads;    //how many threads share the work
+
+     int blockSize;  //side of the blocks in the blocked layout, 0 for row-major
+
+     int packed;     //write the viewshed packed instead of as ascii
+
+     int radius;     //cells further than this from the viewpoint are not
+                     //visible and not looked at, 0 for no limit
+
+     int crop;       //write only the window the radius covers
+
+     float height;   //height of the observer above the ground at the
+                     //viewpoint
+
+     RayTemplate *rays;  //the R2 rays for radius worked out ahead of time,
+                         //or NULL to work them out as they are cast
+
+     Shed *known;    //cells already known to be visible, which the exact
+                     //and simd engines do not test again, or NULL
+
+     Stats *stats;   //where the engines add their counts with --stats, or
+                     //NULL
+
+} Options;
+
 //Function declarations
-void readGridfromFile (char * filename, char * newfile, Grid *grid);
+void readGridfromFile (char * filename, Grid *grid);
+void optionsDefault(Options *opts);
+int parseOptions(int argc, char **argv, int i, Options *opts);
 void printGrid(Grid * grid);
 float getRowMajor(Grid *grid, int row, int col);
-void createViewshed(Grid * grid, int testRow, int testCol);
+void createViewshed(Grid * grid, int testRow, int testCol, Options *opts);
 int isVisible(Grid *grid, int row, int col, int testrow, int testcol);
-void shedIntoFile(Grid *grid, char * newfile);
+int isVisibleSimd(Grid *grid, int row, int col, int testrow, int testcol);
+extern long simdIndexLimit;
+void createViewshedR2(Grid * grid, int testRow, int testCol, int threads,
+                      int radius, RayTemplate *rays, Stats *stats);
+RayTemplate *rayTemplate(int radius);
+void rayTemplateFree(RayTemplate *rays);
+Shed *shedAlloc(int rows, int cols);
+Shed *shedWindow(int row0, int col0, int rows, int cols);
+Shed *shedReuse(Shed *shed, int row0, int col0, int rows, int cols);
+void shedCopyInto(Shed *from, Shed *to);
+void shedUnion(Shed *into, Shed *from);
+void shedExpand(Grid *grid);
+Grid shedCropped(Grid *grid);
+void shedFree(Shed *shed);
+long shedCount(Shed *shed);
+void packedHeader(FILE *f, Grid *grid);
+void shedIntoPacked(Grid *grid, char * newfile, int testRow, int testCol);
+void packedRecord(FILE *f, Shed *shed, int testRow, int testCol);
+void blockGrid(Grid *grid, int blockSize);
+void parallelFor(int threads, long count, long chunk,
+                 void (*task)(void *arg, long start, long end), void *arg);
+void shedIntoStream(Grid *grid, FILE *f, int threads);
+void shedIntoFile(Grid *grid, char * newfile, int threads);
+void runBatch(Grid *grid, char *viewpoints, char *newfile, Options *opts);
+void runCumulative(Grid *grid, char *viewpoints, char *newfile, Options *opts);
+void runPath(Grid *grid, char *viewpoints, char *newfile, Options *opts);
+void writeHeader(FILE *f, Grid *grid);
+void runServer(char *path, Grid *grids, int count, Options *opts, int queue);
+int serverConnect(char *path);
+int serverQuery(int fd, Request *request, PackedHeader *header,
+                unsigned char **record, long *recordBytes);
+void statsFlush(Stats *stats);
+void statsPhase(Stats *stats, int phase, Rtimer *rt);
+long statsBytesWritten(void);
+long statsFileSize(char *filename);
+void statsWrite(FILE *f, Stats *stats, Grid *grid, Options *opts,
+                char *gridFile, char *mode, int testRow, int testCol);
+
+//Returns 1 if the cell is marked visible in the viewshed
+static inline int shedGet(Shed *shed, int row, int col)
+{
+  row -= shed->row0;
+  col -= shed->col0;
+  return (shed->bits[(long) row * shed->wordsPerRow + (col >> 6)] >> (col & 63)) & 1;
+}
+
+//Marks a cell visible. Cells start out not visible.
+static inline void shedSet(Shed *shed, int row, int col)
+{
+  row -= shed->row0;
+  col -= shed->col0;
+  shed->bits[(long) row * shed->wordsPerRow + (col >> 6)] |= (uint64_t) 1 << (col & 63);
+}
+
+//Marks a cell visible when other threads may be setting bits in the same row
+static inline void shedSetShared(Shed *shed, int row, int col)
+{
+  row -= shed->row0;
+  col -= shed->col0;
+  __atomic_fetch_or(&shed->bits[(long) row * shed->wordsPerRow + (col >> 6)],
+                    (uint64_t) 1 << (col & 63), __ATOMIC_RELAXED);
+}
+
+//Index of a point in the blocked layout. The blocks are stored one after the
+//other, each in row-major order. A column of -1 wraps around to the end of the
+//row before, the same as it does in row-major order.
+static inline long blockedIndex(Grid *grid, int row, int col)
+{
+  if (col < 0) {row--; col += grid->cols;}
+  int shift = grid->blockShift;
+  int mask = (1 << shift) - 1;
+  long block = (long) (row >> shift) * grid->blockCols + (col >> shift);
+  return (block << (2 * shift)) + ((row & mask) << shift) + (col & mask);
+}
+
+//Height at a point of a grid whose values are stored as type T, in whichever
+//layout it is kept in. The engines' kernels are compiled once for each type
+//(see elevation.h) and read the grid through this.
+#define HEIGHT_AT(T, grid, row, col)                                        \
+  ((grid)->data_blocked ?                                                   \
+   ((const T*) (grid)->data_blocked)[blockedIndex(grid, row, col)] :        \
+   ((const T*) (grid)->data_rowmajor)[(long) (row) * (grid)->cols + (col)])
+
+//Height at a point, whatever type the grid is stored as. This picks the type
+//on every call; the engines pick it once for the whole viewshed instead.
+static inline float getHeight(Grid *grid, int row, int col)
+{
+  switch (grid->dtype)
+  {
+    case GRIDIO_DTYPE_INT16:   return HEIGHT_AT(int16_t, grid, row, col);
+    case GRIDIO_DTYPE_UINT16:  return HEIGHT_AT(uint16_t, grid, row, col);
+    case GRIDIO_DTYPE_FLOAT64: return HEIGHT_AT(double, grid, row, col);
+  }
+  return HEIGHT_AT(float, grid, row, col);
+}
+
+//Declares the copies of a kernel elevation.h makes, one for each type
+#define DECLARE_TYPED(ret, name, args) \
+  ret name##Int16 args; ret name##Uint16 args; \
+  ret name##Float args; ret name##Double args;
+
+DECLARE_TYPED(int, isVisible, (Grid *grid, int row, int col, int testrow,
+                               int testcol))
+DECLARE_TYPED(int, isVisibleSimd, (Grid *grid, int row, int col, int testrow,
+                                   int testcol))
 
+//The copy of a kernel for the type a grid is stored as
+#define TYPED_FOR(dtype, name)                                   \
+  ((dtype) == GRIDIO_DTYPE_INT16   ? name##Int16  :              \
+   (dtype) == GRIDIO_DTYPE_UINT16  ? name##Uint16 :              \
+   (dtype) == GRIDIO_DTYPE_FLOAT64 ? name##Double : name##Float)
 
 
 #endif
@@ -0,0 +1,84 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//This program asks a running viewshedd for one viewshed and writes it the
+//same as viewshed would with the same --format: a packed viewshed file, or
+//with --format ascii the ascii viewshed.
+
+int main(int argc, char **argv)
+{
+  if (argc < 5) {
+    printf("usage: viewshedc <socket> <newfile> <testrow> <testcol> "
+           "[--grid n] [--height h]\n"
+           "       [--radius n [--crop]] [--format ascii|packed]\n");
+    exit(0);
+  }
+  Request request;
+  memset(&request, 0, sizeof(request));
+  request.row = atol(argv[3]);
+  request.col = atol(argv[4]);
+  for (int i = 5; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc)
+    {
+      request.grid = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+    {
+      request.height = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+    {
+      request.radius = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "ascii") == 0) {request.format = REQUEST_ASCII;}
+      else if (strcmp(argv[i], "packed") == 0)
+      {
+        request.format = REQUEST_PACKED;
+      }
+      else
+      {
+        printf("unknown format %s\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--crop") == 0) {request.crop = 1;}
+    else
+    {
+      printf("unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  int fd = serverConnect(argv[1]);
+  PackedHeader header;
+  unsigned char *record = NULL;
+  long recordBytes = 0;
+  int status = serverQuery(fd, &request, &header, &record, &recordBytes);
+  close(fd);
+  if (status != REPLY_OK)
+  {
+    printf("viewshedd replied %d\n", status);
+    exit(1);
+  }
+
+  FILE *n = fopen(argv[2], "wb");
+  if (n == NULL) {
+     printf("cannot open files...");
+     exit(1);
+  }
+  if (request.format == REQUEST_PACKED)
+  {
+    fwrite(&header, sizeof(header), 1, n);
+  }
+  fwrite(record, 1, recordBytes, n);
+  fclose(n);
+  free(record);
+  return 0;
+}
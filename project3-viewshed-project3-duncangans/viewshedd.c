@@ -0,0 +1,53 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//This program keeps one or more grids in memory and serves their viewsheds
+//over a Unix domain socket (see server.c), so a client pays for reading the
+//grid once rather than on every viewshed.
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    printf("usage: viewshedd <socket> <grid> [grid ...] [--threads n] "
+           "[--queue n]\n"
+           "       [--engine r2|exact|simd] [--layout rowmajor|blocked] "
+           "[--block n]\n");
+    exit(0);
+  }
+
+  //The grids are every argument up to the first option
+  int count = 0;
+  while (2 + count < argc && strncmp(argv[2 + count], "--", 2) != 0)
+  {
+    count++;
+  }
+  Options opts;
+  optionsDefault(&opts);
+  int queue = 64;
+  int i = 2 + count;
+  while ((i = parseOptions(argc, argv, i, &opts)) < argc)
+  {
+    if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+    {
+      queue = atol(argv[i + 1]);
+      i += 2;
+    }
+    else
+    {
+      printf("unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  Grid *grids = (Grid*) malloc(count * sizeof(Grid));
+  for (int g = 0; g < count; g++)
+  {
+    readGridfromFile(argv[2 + g], &grids[g]);
+    fprintf(stderr, "viewshedd: grid %d is %s, %d x %d\n", g, argv[2 + g],
+            grids[g].rows, grids[g].cols);
+  }
+  runServer(argv[1], grids, count, &opts, queue);
+  return 0;
+}
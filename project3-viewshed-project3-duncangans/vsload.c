@@ -0,0 +1,178 @@
+#include "viewshed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+
+//This program puts a running viewshedd under load: a number of clients, each
+//on its own connection, send requests for random viewpoints one after the
+//other. It reports the median and 99th percentile latency of the requests
+//and how many were answered per second.
+
+//What each client is asked to do, and the latencies it measured
+typedef struct _client {
+
+     char *path;
+     Request request;    //the grid, height, radius and crop of each request
+     int rows, cols;     //size of the grid, for picking viewpoints
+     int count;          //requests to send
+     unsigned int seed;
+     double *latency;    //seconds each request took
+     int failed;
+
+} Client;
+
+//Returns the time in seconds
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+//Sends a client's requests, timing each one
+static void *runClient(void *arg)
+{
+  Client *client = (Client*) arg;
+  int fd = serverConnect(client->path);
+  PackedHeader header;
+  unsigned char *record = NULL;
+  long recordBytes = 0;
+  for (int i = 0; i < client->count; i++)
+  {
+    Request request = client->request;
+    request.row = rand_r(&client->seed) % client->rows;
+    request.col = rand_r(&client->seed) % client->cols;
+    double start = now();
+    if (serverQuery(fd, &request, &header, &record, &recordBytes) != REPLY_OK)
+    {
+      client->failed++;
+    }
+    client->latency[i] = now() - start;
+  }
+  close(fd);
+  free(record);
+  return NULL;
+}
+
+//Orders latencies for qsort
+static int compareLatency(const void *a, const void *b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 4) {
+    printf("usage: vsload <socket> <requests> <clients> [--grid n] "
+           "[--height h]\n"
+           "       [--radius n [--crop]] [--format ascii|packed]\n");
+    exit(0);
+  }
+  //A server that drops a connection fails that client's requests rather than
+  //killing the whole run
+  signal(SIGPIPE, SIG_IGN);
+  int requests = atol(argv[2]);
+  int clients = atol(argv[3]);
+  if (clients < 1) {clients = 1;}
+  Request request;
+  memset(&request, 0, sizeof(request));
+  for (int i = 4; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc)
+    {
+      request.grid = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+    {
+      request.height = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+    {
+      request.radius = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "ascii") == 0) {request.format = REQUEST_ASCII;}
+      else if (strcmp(argv[i], "packed") == 0)
+      {
+        request.format = REQUEST_PACKED;
+      }
+      else
+      {
+        printf("unknown format %s\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "--crop") == 0) {request.crop = 1;}
+    else
+    {
+      printf("unknown option %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  //The size of the grid comes from the header of a first, untimed packed
+  //viewshed at the corner of the grid, with the smallest radius that has one
+  Request probe = request;
+  probe.row = probe.col = 0;
+  probe.radius = 1;
+  probe.crop = 0;
+  probe.format = REQUEST_PACKED;
+  PackedHeader header;
+  unsigned char *record = NULL;
+  long recordBytes = 0;
+  int fd = serverConnect(argv[1]);
+  int status = serverQuery(fd, &probe, &header, &record, &recordBytes);
+  close(fd);
+  free(record);
+  if (status != REPLY_OK)
+  {
+    printf("viewshedd replied %d\n", status);
+    exit(1);
+  }
+
+  Client *client = (Client*) calloc(clients, sizeof(Client));
+  pthread_t *threads = (pthread_t*) malloc(clients * sizeof(pthread_t));
+  double *latency = (double*) malloc(requests * sizeof(double));
+  int given = 0;
+  double start = now();
+  for (int c = 0; c < clients; c++)
+  {
+    client[c].path = argv[1];
+    client[c].request = request;
+    client[c].rows = header.rows;
+    client[c].cols = header.cols;
+    client[c].count = requests / clients + (c < requests % clients);
+    client[c].seed = 12345 + c;
+    client[c].latency = latency + given;
+    given += client[c].count;
+    pthread_create(&threads[c], NULL, runClient, &client[c]);
+  }
+  int failed = 0;
+  for (int c = 0; c < clients; c++)
+  {
+    pthread_join(threads[c], NULL);
+    failed += client[c].failed;
+  }
+  double elapsed = now() - start;
+
+  qsort(latency, requests, sizeof(double), compareLatency);
+  printf("%d requests, %d clients, %d failed, %.3f s\n", requests, clients,
+         failed, elapsed);
+  if (requests > 0)
+  {
+    printf("p50 %.3f ms  p99 %.3f ms  %.1f queries/s\n",
+           1000 * latency[requests / 2], 1000 * latency[requests * 99 / 100],
+           requests / elapsed);
+  }
+  free(latency);
+  free(threads);
+  free(client);
+  return 0;
+}